@@ -0,0 +1,627 @@
+#include "apu.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+const uint64_t NEVER = Scheduler::NEVER;
+
+const uint8_t LENGTHS[32] = {
+    10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+    12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30,
+};
+
+const uint8_t DUTY[4][8] = {
+    {0, 1, 0, 0, 0, 0, 0, 0},
+    {0, 1, 1, 0, 0, 0, 0, 0},
+    {0, 1, 1, 1, 1, 0, 0, 0},
+    {1, 0, 0, 1, 1, 1, 1, 1},
+};
+
+const uint8_t TRIANGLE[32] = {
+    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+};
+
+/* In CPU cycles */
+const uint16_t NOISE_PERIODS[16] = {4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068};
+const uint16_t DMC_RATES[16] = {428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54};
+
+/* Steps of the frame counter in cycles from the start of its sequence, 4
+ * and 5 step modes, then how long the sequence is */
+const uint64_t FRAME_STEPS[2][5] = {
+    {7457, 14913, 22371, 29829, NEVER},
+    {7457, 14913, 22371, 29829, 37281},
+};
+const uint64_t FRAME_LENGTH[2] = {29830, 37282};
+
+/* Linear approximation of the mixer: how much a step of each channel moves
+ * the output, pulses, triangle, noise and DMC */
+const float MIX[5] = {0.00752f, 0.00752f, 0.00851f, 0.00494f, 0.00335f};
+const float VOLUME = 30000.0f;
+
+const double CPU_CLOCK = 21477272.0 / 12;
+const uint64_t SAMPLES_PER_CYCLE = (uint64_t)(4294967296.0 * APU::SAMPLE_RATE / CPU_CLOCK); /* 32.32 */
+
+// Helper Functions
+
+const int PHASES = 32;
+
+/* Band-limited impulse (windowed sinc, cut at 80% of 24 kHz) for PHASES
+ * positions between two samples, each adds up to 1. The samples add the
+ * impulses up to band-limited steps, TAPS / 2 samples late */
+struct step_kernel {
+    alignas(16) float taps[PHASES][APU::TAPS];
+
+    step_kernel() {
+        const double PI = 3.14159265358979323846, CUTOFF = 0.8;
+        const int HALF = APU::TAPS / 2;
+        for (int phase = 0; phase < PHASES; phase++) {
+            double impulse[APU::TAPS], total = 0;
+            for (int i = 0; i < APU::TAPS; i++) {
+                double x = i - (HALF - 1) - (double)phase / PHASES;
+                double sinc = x ? sin(PI * CUTOFF * x) / (PI * CUTOFF * x) : 1;
+                double window = 0.42 + 0.5 * cos(PI * x / HALF) + 0.08 * cos(2 * PI * x / HALF);
+                impulse[i] = sinc * window;
+                total += impulse[i];
+            }
+            for (int i = 0; i < APU::TAPS; i++)
+                taps[phase][i] = impulse[i] / total;
+        }
+    }
+};
+
+const step_kernel KERNEL;
+
+/* The noise shift register is linear, n clocks of it are a product with
+ * the n-th power of its matrix. Powers of 2 of the matrix, as the columns
+ * (the images of each bit), for both modes */
+struct noise_jumps {
+    uint16_t columns[2][16][15];
+
+    static uint16_t clock(uint16_t shift, int tap) {
+        return shift >> 1 | ((shift ^ shift >> tap) & 1) << 14;
+    }
+
+    static uint16_t apply(const uint16_t *columns, uint16_t shift) {
+        uint16_t result = 0;
+        for (int bit = 0; bit < 15; bit++)
+            if (shift >> bit & 1)
+                result ^= columns[bit];
+        return result;
+    }
+
+    noise_jumps() {
+        for (int mode = 0; mode < 2; mode++) {
+            for (int bit = 0; bit < 15; bit++)
+                columns[mode][0][bit] = clock(1 << bit, mode ? 6 : 1);
+            for (int power = 1; power < 16; power++)
+                for (int bit = 0; bit < 15; bit++)
+                    columns[mode][power][bit] = apply(columns[mode][power - 1], columns[mode][power - 1][bit]);
+        }
+    }
+
+    /* Shift register after clocks clocks, less than 65536 */
+    uint16_t jump(uint16_t shift, uint64_t clocks, int mode) const {
+        for (int power = 0; clocks; power++, clocks >>= 1)
+            if (clocks & 1)
+                shift = apply(columns[mode][power], shift);
+        return shift;
+    }
+};
+
+const noise_jumps NOISE_JUMPS;
+
+APU::APU(void) : cpu(nullptr), next(nullptr), event(-1), position(0), sum(0), dc(0) {
+    memset(&regs, 0, sizeof(regs));
+    regs.noise.shift = 1;
+    regs.dmc.bits = 8;
+    regs.dmc.silence = 1;
+    memset(buffer, 0, sizeof(buffer));
+    memset(levels, 0, sizeof(levels));
+    io = { &APU::read, &APU::write, this };
+}
+
+void APU::plug(CPU<BUS> &cpu) {
+    this->cpu = &cpu;
+    next = cpu.bus->device(0x40);
+    cpu.bus->map_io(0x40, 0x40, &io);
+    cpu.bus->add_state(&regs, sizeof(regs), &APU::loaded, this);
+    event = cpu.events.add(&APU::fired, this);
+
+    regs.cycle = regs.frame_start = now();
+    regs.pulse[0].next = regs.pulse[1].next = regs.cycle;
+    regs.triangle.next = regs.noise.next = regs.dmc.next = regs.cycle;
+    schedule();
+}
+
+void APU::sync() {
+    catch_up(now());
+}
+
+size_t APU::samples(int16_t *out, size_t max) {
+    sync();
+    size_t count = std::min(max, (size_t)(position >> 32));
+    drop(count, out);
+    return count;
+}
+
+// Frame Counter
+
+uint64_t APU::frame_point() const {
+    return regs.frame_start + FRAME_STEPS[regs.frame_ctrl >> 7][regs.frame_step];
+}
+
+/* The DMC fetches when the output unit takes the byte in the buffer */
+uint64_t APU::fetch_point() const {
+    const auto &dmc = regs.dmc;
+    if (!dmc.full || !dmc.remaining)
+        return NEVER;
+    return dmc.next + (dmc.bits - 1) * DMC_RATES[dmc.ctrl & 15];
+}
+
+/* Channels run up to each step of the frame counter, which changes their
+ * volume and lengths, and then up to cycle */
+void APU::catch_up(uint64_t cycle) {
+    while (regs.cycle < cycle) {
+        uint64_t point = frame_point();
+        uint64_t end = std::min(cycle, point);
+        if (end > regs.cycle) {
+            make_room(end);
+            run_pulse(0, end);
+            run_pulse(1, end);
+            run_triangle(end);
+            run_noise(end);
+            run_dmc(end);
+            position += (end - regs.cycle) * SAMPLES_PER_CYCLE;
+            regs.cycle = end;
+        }
+        if (point < cycle)
+            frame_step();
+    }
+}
+
+/* The event comes for each step of the frame counter and each DMC fetch */
+void APU::schedule() {
+    cpu->events.schedule(event, std::min(frame_point(), fetch_point()));
+}
+
+void APU::frame_step() {
+    int mode = regs.frame_ctrl >> 7;
+    switch (regs.frame_step) {
+    case 0:
+    case 2:
+        quarter_frame();
+        break;
+    case 1:
+        quarter_frame();
+        half_frame();
+        break;
+    case 3:
+        if (mode)
+            break;
+        quarter_frame();
+        half_frame();
+        if (!(regs.frame_ctrl & 0x40)) {
+            regs.frame_irq = 1;
+            cpu->set_irq(CPU<BUS>::IRQ_FRAME, true);
+        }
+        break;
+    case 4:
+        quarter_frame();
+        half_frame();
+        break;
+    }
+    if (++regs.frame_step == (mode ? 5 : 4)) {
+        regs.frame_step = 0;
+        regs.frame_start += FRAME_LENGTH[mode];
+    }
+    output(regs.cycle);
+}
+
+uint8_t APU::volume(const envelope &env, uint8_t ctrl) {
+    return ctrl & 0x10 ? ctrl & 15 : env.decay;
+}
+
+void APU::clock(envelope &env, uint8_t ctrl) {
+    if (env.start) {
+        env.start = 0;
+        env.decay = 15;
+        env.divider = ctrl & 15;
+    } else if (env.divider) {
+        env.divider--;
+    } else {
+        env.divider = ctrl & 15;
+        if (env.decay)
+            env.decay--;
+        else if (ctrl & 0x20)
+            env.decay = 15;
+    }
+}
+
+/* Envelopes and the linear counter */
+void APU::quarter_frame() {
+    clock(regs.pulse[0].env, regs.pulse[0].ctrl);
+    clock(regs.pulse[1].env, regs.pulse[1].ctrl);
+    clock(regs.noise.env, regs.noise.ctrl);
+
+    auto &triangle = regs.triangle;
+    if (triangle.reload)
+        triangle.linear = triangle.ctrl & 0x7F;
+    else if (triangle.linear)
+        triangle.linear--;
+    if (!(triangle.ctrl & 0x80))
+        triangle.reload = 0;
+}
+
+/* Length counters and sweeps */
+void APU::half_frame() {
+    for (int i = 0; i < 2; i++) {
+        auto &pulse = regs.pulse[i];
+        if (pulse.length && !(pulse.ctrl & 0x20))
+            pulse.length--;
+        if (!pulse.sweep_divider && (pulse.sweep & 0x80) && (pulse.sweep & 7) && !sweep_muted(i))
+            pulse.period = sweep_target(i);
+        if (!pulse.sweep_divider || pulse.sweep_reload) {
+            pulse.sweep_divider = pulse.sweep >> 4 & 7;
+            pulse.sweep_reload = 0;
+        } else {
+            pulse.sweep_divider--;
+        }
+    }
+    if (regs.triangle.length && !(regs.triangle.ctrl & 0x80))
+        regs.triangle.length--;
+    if (regs.noise.length && !(regs.noise.ctrl & 0x20))
+        regs.noise.length--;
+}
+
+// Channels
+
+/* Pulse 1 negates with one's complement, pulse 2 with two's */
+uint16_t APU::sweep_target(int i) const {
+    const auto &pulse = regs.pulse[i];
+    uint16_t change = pulse.period >> (pulse.sweep & 7);
+    return pulse.sweep & 0x08 ? pulse.period - change - (i == 0) : pulse.period + change;
+}
+
+/* Silenced even when the sweep is off */
+bool APU::sweep_muted(int i) const {
+    const auto &pulse = regs.pulse[i];
+    return pulse.period < 8 || (!(pulse.sweep & 0x08) && sweep_target(i) > 0x7FF);
+}
+
+uint8_t APU::pulse_level(int i) const {
+    const auto &pulse = regs.pulse[i];
+    if (!pulse.length || sweep_muted(i) || !DUTY[pulse.ctrl >> 6][pulse.step])
+        return 0;
+    return volume(pulse.env, pulse.ctrl);
+}
+
+/* Too high to hear below 2, it averages out to the middle */
+uint8_t APU::triangle_level() const {
+    return regs.triangle.period < 2 ? 7 : TRIANGLE[regs.triangle.step];
+}
+
+uint8_t APU::noise_level() const {
+    const auto &noise = regs.noise;
+    if (!noise.length || (noise.shift & 1))
+        return 0;
+    return volume(noise.env, noise.ctrl);
+}
+
+/* Output of every channel as the registers are now */
+void APU::output(uint64_t cycle) {
+    set_level(0, cycle, pulse_level(0));
+    set_level(1, cycle, pulse_level(1));
+    set_level(2, cycle, triangle_level());
+    set_level(3, cycle, noise_level());
+    set_level(4, cycle, regs.dmc.level);
+}
+
+/* Timers clock every 2 cycles for the pulses, the sequencer goes on when
+ * the pulse is silent */
+void APU::run_pulse(int i, uint64_t end) {
+    auto &pulse = regs.pulse[i];
+    if (pulse.next >= end)
+        return;
+    uint64_t interval = (pulse.period + 1) * 2;
+    uint8_t vol = volume(pulse.env, pulse.ctrl);
+    if (!pulse.length || !vol || sweep_muted(i)) {
+        uint64_t clocks = (end - pulse.next + interval - 1) / interval;
+        pulse.step = (pulse.step + clocks) & 7;
+        pulse.next += clocks * interval;
+        return;
+    }
+    const uint8_t *duty = DUTY[pulse.ctrl >> 6];
+    for (; pulse.next < end; pulse.next += interval) {
+        pulse.step = (pulse.step + 1) & 7;
+        set_level(i, pulse.next, duty[pulse.step] ? vol : 0);
+    }
+}
+
+/* The sequencer stops with either counter at 0 and holds its level */
+void APU::run_triangle(uint64_t end) {
+    auto &triangle = regs.triangle;
+    if (triangle.next >= end)
+        return;
+    uint64_t interval = triangle.period + 1;
+    uint64_t clocks = (end - triangle.next + interval - 1) / interval;
+    if (!triangle.linear || !triangle.length) {
+        triangle.next += clocks * interval;
+        return;
+    }
+    if (triangle.period < 2) {
+        triangle.step = (triangle.step + clocks) & 31;
+        triangle.next += clocks * interval;
+        return;
+    }
+    for (; triangle.next < end; triangle.next += interval) {
+        triangle.step = (triangle.step + 1) & 31;
+        set_level(2, triangle.next, TRIANGLE[triangle.step]);
+    }
+}
+
+/* The shift register turns all the time, mode 1 takes the feedback from
+ * bit 6 for the short sequences. Silent, it jumps to where it ends up */
+void APU::run_noise(uint64_t end) {
+    auto &noise = regs.noise;
+    if (noise.next >= end)
+        return;
+    uint64_t interval = NOISE_PERIODS[noise.mode & 15];
+    int mode = noise.mode >> 7;
+    uint8_t vol = noise.length ? volume(noise.env, noise.ctrl) : 0;
+    if (!vol) {
+        uint64_t clocks = (end - noise.next + interval - 1) / interval;
+        noise.shift = NOISE_JUMPS.jump(noise.shift, clocks, mode);
+        noise.next += clocks * interval;
+        return;
+    }
+    for (; noise.next < end; noise.next += interval) {
+        noise.shift = noise_jumps::clock(noise.shift, mode ? 6 : 1);
+        set_level(3, noise.next, noise.shift & 1 ? 0 : vol);
+    }
+}
+
+/* Each clock moves the level by 2 for a bit of the sample, a byte lasts 8
+ * clocks. The next byte is fetched as soon as the buffer is taken */
+void APU::run_dmc(uint64_t end) {
+    auto &dmc = regs.dmc;
+    uint64_t interval = DMC_RATES[dmc.ctrl & 15];
+    for (; dmc.next < end; dmc.next += interval) {
+        if (!dmc.silence) {
+            if (dmc.shift & 1) {
+                if (dmc.level <= 125)
+                    dmc.level += 2;
+            } else if (dmc.level >= 2) {
+                dmc.level -= 2;
+            }
+            set_level(4, dmc.next, dmc.level);
+        }
+        dmc.shift >>= 1;
+        if (--dmc.bits)
+            continue;
+        dmc.bits = 8;
+        dmc.silence = !dmc.full;
+        if (dmc.full) {
+            dmc.shift = dmc.buffer;
+            dmc.full = 0;
+            if (dmc.remaining)
+                fetch();
+        }
+    }
+}
+
+/* The CPU stops for the 4 cycles the DMC takes the bus */
+void APU::fetch() {
+    auto &dmc = regs.dmc;
+    dmc.buffer = cpu->bus->read(dmc.address);
+    dmc.full = 1;
+    dmc.address = dmc.address == 0xFFFF ? 0x8000 : dmc.address + 1;
+    if (!--dmc.remaining) {
+        if (dmc.ctrl & 0x40) {
+            dmc.address = 0xC000 | dmc.start << 6;
+            dmc.remaining = dmc.size * 16 + 1;
+        } else if (dmc.ctrl & 0x80) {
+            dmc.irq = 1;
+            cpu->set_irq(CPU<BUS>::IRQ_DMC, true);
+        }
+    }
+    cpu->stall(4);
+}
+
+// Synthesis
+
+/* Adds the band-limited step from the old level to the new one at cycle,
+ * which is not before regs.cycle */
+void APU::set_level(int channel, uint64_t cycle, uint8_t level) {
+    if (level == levels[channel])
+        return;
+    float delta = (level - levels[channel]) * MIX[channel];
+    levels[channel] = level;
+
+    uint64_t at = position + (cycle - regs.cycle) * SAMPLES_PER_CYCLE;
+    float *out = buffer + (at >> 32);
+    const float *taps = KERNEL.taps[at >> 27 & (PHASES - 1)];
+#if defined(__SSE2__)
+    __m128 d = _mm_set1_ps(delta);
+    for (int i = 0; i < TAPS; i += 4)
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(d, _mm_load_ps(taps + i))));
+#else
+    for (int i = 0; i < TAPS; i++)
+        out[i] += delta * taps[i];
+#endif
+}
+
+/* Drops the oldest samples when the ones up to end would not fit */
+void APU::make_room(uint64_t end) {
+    size_t last = (position + (end - regs.cycle) * SAMPLES_PER_CYCLE) >> 32;
+    if (last > BUFFER)
+        drop(std::min(last - BUFFER, (size_t)(position >> 32)), nullptr);
+}
+
+/* Takes count samples out of the buffer, into out when it is not null */
+void APU::drop(size_t count, int16_t *out) {
+    for (size_t i = 0; i < count; i++) {
+        sum += buffer[i];
+        dc += (sum - dc) * (1.0f / 1024); /* Follows the DC, about 7 Hz */
+        if (out)
+            out[i] = (int16_t)std::max(-32768.0f, std::min(32767.0f, (sum - dc) * VOLUME));
+    }
+    size_t used = (position >> 32) + TAPS;
+    memmove(buffer, buffer + count, (used - count) * sizeof(float));
+    std::fill(buffer + used - count, buffer + used, 0.0f);
+    position -= (uint64_t)count << 32;
+}
+
+// Registers
+
+uint8_t APU::read(void *device, uint16_t addr) {
+    APU &apu = *(APU *)device;
+    auto &regs = apu.regs;
+    if (addr != 0x4015) {
+        if (apu.next && apu.next->read)
+            return apu.next->read(apu.next->device, addr);
+        return addr >> 8;
+    }
+    apu.catch_up(apu.now());
+
+    uint8_t status = (regs.pulse[0].length > 0) | (regs.pulse[1].length > 0) << 1 |
+                     (regs.triangle.length > 0) << 2 | (regs.noise.length > 0) << 3 |
+                     (regs.dmc.remaining > 0) << 4 | regs.frame_irq << 6 | regs.dmc.irq << 7;
+    regs.frame_irq = 0;
+    apu.cpu->set_irq(CPU<BUS>::IRQ_FRAME, false);
+    return status | (addr >> 8 & 0x20); /* Bit 5 is open bus */
+}
+
+void APU::write(void *device, uint16_t addr, uint8_t val) {
+    APU &apu = *(APU *)device;
+    auto &regs = apu.regs;
+    if (addr > 0x4017 || addr == 0x4014 || addr == 0x4016) {
+        if (apu.next && apu.next->write)
+            apu.next->write(apu.next->device, addr, val);
+        return;
+    }
+    apu.catch_up(apu.now());
+
+    if (addr < 0x4008) {
+        int i = addr >> 2 & 1;
+        auto &pulse = regs.pulse[i];
+        switch (addr & 3) {
+        case 0:
+            pulse.ctrl = val;
+            break;
+        case 1:
+            pulse.sweep = val;
+            pulse.sweep_reload = 1;
+            break;
+        case 2:
+            pulse.period = (pulse.period & 0x700) | val;
+            break;
+        case 3:
+            pulse.period = (pulse.period & 0xFF) | (val & 7) << 8;
+            if (regs.enabled >> i & 1)
+                pulse.length = LENGTHS[val >> 3];
+            pulse.step = 0;
+            pulse.env.start = 1;
+            break;
+        }
+    }
+
+    auto &triangle = regs.triangle;
+    auto &noise = regs.noise;
+    auto &dmc = regs.dmc;
+    switch (addr) {
+    case 0x4008:
+        triangle.ctrl = val;
+        break;
+    case 0x400A:
+        triangle.period = (triangle.period & 0x700) | val;
+        break;
+    case 0x400B:
+        triangle.period = (triangle.period & 0xFF) | (val & 7) << 8;
+        if (regs.enabled & 0x04)
+            triangle.length = LENGTHS[val >> 3];
+        triangle.reload = 1;
+        break;
+    case 0x400C:
+        noise.ctrl = val;
+        break;
+    case 0x400E:
+        noise.mode = val;
+        break;
+    case 0x400F:
+        if (regs.enabled & 0x08)
+            noise.length = LENGTHS[val >> 3];
+        noise.env.start = 1;
+        break;
+    case 0x4010:
+        dmc.ctrl = val;
+        if (!(val & 0x80)) {
+            dmc.irq = 0;
+            apu.cpu->set_irq(CPU<BUS>::IRQ_DMC, false);
+        }
+        break;
+    case 0x4011:
+        dmc.level = val & 0x7F;
+        break;
+    case 0x4012:
+        dmc.start = val;
+        break;
+    case 0x4013:
+        dmc.size = val;
+        break;
+    case 0x4015:
+        regs.enabled = val & 0x1F;
+        if (!(val & 0x01))
+            regs.pulse[0].length = 0;
+        if (!(val & 0x02))
+            regs.pulse[1].length = 0;
+        if (!(val & 0x04))
+            triangle.length = 0;
+        if (!(val & 0x08))
+            noise.length = 0;
+        dmc.irq = 0;
+        apu.cpu->set_irq(CPU<BUS>::IRQ_DMC, false);
+        if (!(val & 0x10)) {
+            dmc.remaining = 0;
+        } else if (!dmc.remaining) {
+            dmc.address = 0xC000 | dmc.start << 6;
+            dmc.remaining = dmc.size * 16 + 1;
+            if (!dmc.full)
+                apu.fetch();
+        }
+        break;
+    case 0x4017:
+        /* The sequence starts over 3 or 4 cycles later, 5 step mode clocks
+         * everything right away */
+        regs.frame_ctrl = val;
+        if (val & 0x40) {
+            regs.frame_irq = 0;
+            apu.cpu->set_irq(CPU<BUS>::IRQ_FRAME, false);
+        }
+        regs.frame_start = regs.cycle + 3 + (regs.cycle & 1);
+        regs.frame_step = 0;
+        if (val & 0x80) {
+            apu.quarter_frame();
+            apu.half_frame();
+        }
+        break;
+    }
+    apu.output(regs.cycle);
+    apu.schedule();
+}
+
+void APU::fired(void *device, uint64_t cycle) {
+    APU &apu = *(APU *)device;
+    apu.catch_up(cycle + 1);
+    apu.schedule();
+}
+
+void APU::loaded(void *device) {
+    APU &apu = *(APU *)device;
+    apu.output(apu.regs.cycle);
+    apu.schedule();
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "bus.h"
+#include "cpu.h"
+
+/* Audio processing unit (2A03, NTSC)
+ * Two pulses, triangle, noise, DMC and the frame counter on $4000 - $4017.
+ * The APU is not clocked every cycle: it catches up when the CPU touches
+ * one of its registers and on its event, which comes at each step of the
+ * frame counter and when the DMC has to fetch a byte. Catching up runs each
+ * channel from one timer clock to the next and only does work when the
+ * output changes, so the stolen DMC cycles, $4015 and both IRQs are on time
+ * without ticking every cycle.
+ * Output changes go in as band-limited steps at 48 kHz, added 4 taps at a
+ * time with SSE, and come out by blocks through samples(). */
+class APU {
+    public:
+    static const int SAMPLE_RATE = 48000;
+    static const int TAPS = 16;     /* Length of a band-limited step, in samples */
+    static const int BUFFER = 4096; /* Samples kept until they are taken */
+
+    APU();
+    APU(const APU &) = delete;
+    APU &operator=(const APU &) = delete;
+
+    /* Maps the registers and adds the APU to the save states and events.
+     * Shares its page with the controllers, plug the APU after them and
+     * before the PPU: it passes on the accesses that are not its own */
+    void plug(CPU<BUS> &);
+
+    /* Catches up to the CPU */
+    void sync();
+
+    /* Catches up and takes up to max samples, mono. Returns how many were
+     * taken. Samples not taken for about 80 ms are dropped */
+    size_t samples(int16_t *out, size_t max);
+
+    private:
+    CPU<BUS> *cpu;
+    BUS::io io;
+    const BUS::io *next; /* Device on the page before the APU */
+    int event;
+
+    struct envelope {
+        uint8_t start, divider, decay;
+    };
+
+    struct {
+        struct {
+            uint8_t ctrl, sweep; /* $4000 and $4001 */
+            uint16_t period;
+            uint8_t length, step, sweep_divider, sweep_reload;
+            envelope env;
+            uint8_t pad;
+            uint64_t next; /* Cycle of the next timer clock */
+        } pulse[2];
+        struct {
+            uint8_t ctrl; /* $4008 */
+            uint8_t linear, reload;
+            uint8_t length, step;
+            uint8_t pad;
+            uint16_t period;
+            uint64_t next;
+        } triangle;
+        struct {
+            uint8_t ctrl, mode; /* $400C and $400E */
+            uint8_t length;
+            envelope env;
+            uint8_t pad;
+            uint16_t shift;
+            uint64_t next;
+        } noise;
+        struct {
+            uint8_t ctrl, start, size; /* $4010, $4012 and $4013 */
+            uint8_t level, buffer, full, shift, bits, silence, irq;
+            uint16_t address, remaining;
+            uint64_t next;
+        } dmc;
+        uint8_t enabled; /* $4015 */
+        uint8_t frame_ctrl, frame_irq; /* $4017 */
+        uint8_t frame_step;
+        uint8_t pad[4];
+        uint64_t frame_start; /* Cycle the frame counter started its sequence */
+        uint64_t cycle;       /* Caught up to here */
+    } regs;
+
+    /* Synthesis, not in the save states. Band-limited impulses go in buffer
+     * and add up to the steps when the samples are taken */
+    alignas(16) float buffer[BUFFER + TAPS];
+    uint64_t position; /* Where regs.cycle is in buffer, in samples, 32.32 */
+    uint8_t levels[5]; /* Output of each channel as last put in buffer */
+    float sum, dc;
+
+    inline uint64_t now() const {
+        return cpu->cycles;
+    }
+
+    uint64_t frame_point() const;
+    uint64_t fetch_point() const;
+    void catch_up(uint64_t cycle);
+    void schedule();
+    void frame_step();
+    void quarter_frame();
+    void half_frame();
+
+    static uint8_t volume(const envelope &, uint8_t ctrl);
+    static void clock(envelope &, uint8_t ctrl);
+
+    uint16_t sweep_target(int) const;
+    bool sweep_muted(int) const;
+    uint8_t pulse_level(int) const;
+    uint8_t triangle_level() const;
+    uint8_t noise_level() const;
+    void output(uint64_t cycle);
+
+    void run_pulse(int, uint64_t end);
+    void run_triangle(uint64_t end);
+    void run_noise(uint64_t end);
+    void run_dmc(uint64_t end);
+    void fetch();
+
+    void set_level(int channel, uint64_t cycle, uint8_t level);
+    void make_room(uint64_t end);
+    void drop(size_t count, int16_t *out);
+
+    static uint8_t read(void *, uint16_t);
+    static void write(void *, uint16_t, uint8_t);
+    static void fired(void *, uint64_t);
+    static void loaded(void *);
+};
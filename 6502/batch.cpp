@@ -0,0 +1,330 @@
+/* The CPU of the instances is built here from cpu.cpp, like the NMOS one,
+ * to keep it out of the translation unit of the NES CPU */
+#define CPU_OTHER_VARIANTS
+#include "cpu.cpp"
+#include "batch.h"
+
+/* Bytes taken by one instance in the state block */
+const size_t INSTANCE_SIZE = 5 * sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint64_t);
+
+template <class Bus>
+Batch<Bus>::Batch(size_t count) : count(count) {
+    padded = (count + LANES - 1) / LANES * LANES;
+    block.reset(new uint8_t[padded * INSTANCE_SIZE]());
+    buses.reset(new Bus[count]);
+    cpus.reset(new CPU<Lane<Bus>>[count]);
+    for (size_t i = 0; i < count; i++) {
+        cpus[i].set_bus(std::unique_ptr<Lane<Bus>>(new Lane<Bus>()));
+        cpus[i].bus->bus = &buses[i];
+    }
+
+    /* Widest registers first so every array stays aligned */
+    uint8_t *at = block.get();
+    regs.cycles = (uint64_t *)at;
+    at += padded * sizeof(uint64_t);
+    regs.PC = (uint16_t *)at;
+    at += padded * sizeof(uint16_t);
+    uint8_t **bytes[] = { &regs.AC, &regs.X, &regs.Y, &regs.SR, &regs.SP };
+    for (uint8_t **reg : bytes) {
+        *reg = at;
+        at += padded;
+    }
+    for (size_t i = 0; i < padded; i++) {
+        regs.SR[i] = 0x24;
+        regs.SP[i] = 0xFD;
+    }
+}
+
+template <class Bus>
+Batch<Bus>::~Batch(void) {
+}
+
+template <class Bus>
+Bus &Batch<Bus>::bus(size_t i) {
+    return buses[i];
+}
+
+template <class Bus>
+CPU<Lane<Bus>> &Batch<Bus>::cpu(size_t i) {
+    return cpus[i];
+}
+
+template <class Bus>
+void Batch<Bus>::step_all() {
+    for (size_t first = 0; first < count; first += LANES)
+        run_group(first, nullptr, 1);
+}
+
+/* Frames are counted from the cycles of each instance. Groups are run one
+ * after the other so only the buses of one group are in cache at a time */
+template <class Bus>
+void Batch<Bus>::run_frames_all(unsigned frames) {
+    std::vector<uint64_t> end(count);
+    for (size_t i = 0; i < count; i++)
+        end[i] = (regs.cycles[i] / CYCLES_PER_FRAME + frames) * CYCLES_PER_FRAME;
+
+    for (size_t first = 0; first < count; first += LANES) {
+        while (run_group(first, end.data(), SLICE))
+            ;
+    }
+}
+
+/* Runs the instances of the group still under their end cycle (all of them
+ * without end). When every instance of the group is at the same PC the
+ * instructions step_group knows are run on all of them at once, up to
+ * slice in a row and until one of them reaches its end or has an event or
+ * interrupt due. Otherwise each one runs up to slice instructions on its
+ * own, those that were in lockstep stop before the next instruction
+ * step_group knows so they are likely to still be together there. Returns
+ * whether some instance has not reached its end */
+template <class Bus>
+bool Batch<Bus>::run_group(size_t first, const uint64_t *end, unsigned slice) {
+    size_t last = first + LANES < count ? first + LANES : count;
+
+    /* Cycles the group can run for together. Group instructions do not
+     * touch the bus, so nothing moves the limits of the CPUs meanwhile */
+    uint64_t budget = last - first == LANES ? UINT64_MAX : 0;
+    for (size_t i = first; budget && i < last; i++) {
+        uint64_t limit = cpus[i].events.limit;
+        uint64_t stop = end && end[i] < limit ? end[i] : limit;
+        if (regs.PC[i] != regs.PC[first] || regs.cycles[i] >= stop)
+            budget = 0;
+        else if (stop - regs.cycles[i] < budget)
+            budget = stop - regs.cycles[i];
+    }
+
+    uint16_t pc = regs.PC[first];
+    const uint8_t *memory = budget ? group_page(first, pc >> 8) : nullptr;
+    uint64_t used = 0;
+    unsigned n = 0;
+    while (memory && used < budget && n < slice) {
+        unsigned at = pc & 0xFF;
+        uint8_t length = group_ops[memory[at]];
+        if (!length || at + length > 0x100) /* The operand has to be on the page too */
+            break;
+        uint16_t operand = length == 1 ? 0 : length == 2 ? memory[at + 1] : join_bytes(memory[at + 1], memory[at + 2]);
+        used += step_group(first, memory[at], operand);
+        n++;
+        if (regs.PC[first] >> 8 != pc >> 8)
+            memory = group_page(first, regs.PC[first] >> 8);
+        pc = regs.PC[first];
+    }
+    if (n)
+        return true;
+
+    bool running = false;
+    for (size_t i = first; i < last; i++) {
+        if (!end || regs.cycles[i] < end[i])
+            run_one(i, end ? end[i] : UINT64_MAX, slice, memory);
+        running |= end && regs.cycles[i] < end[i];
+    }
+    return running;
+}
+
+/* Memory behind the page when it is the same for the whole group, banks
+ * can differ */
+template <class Bus>
+const uint8_t *Batch<Bus>::group_page(size_t first, uint8_t page) {
+    const uint8_t *memory = buses[first].memory(page);
+    for (size_t i = first + 1; memory && i < first + LANES; i++)
+        if (buses[i].memory(page) != memory)
+            return nullptr;
+    return memory;
+}
+
+template <class Bus>
+void Batch<Bus>::run_one(size_t i, uint64_t end, unsigned slice, bool to_group) {
+    Bus &bus = buses[i];
+    CPU<Lane<Bus>> &core = cpus[i];
+    core.AC = regs.AC[i];
+    core.X = regs.X[i];
+    core.Y = regs.Y[i];
+    core.SP = regs.SP[i];
+    core.PC = regs.PC[i];
+    core.cycles = regs.cycles[i];
+    core.set_status(regs.SR[i]);
+
+    core.step();
+    for (unsigned n = 1; n < slice && core.cycles < end; n++) {
+        /* Peeked, a read could hit a device */
+        const uint8_t *page = to_group ? bus.memory(core.PC >> 8) : nullptr;
+        if (page && group_ops[page[core.PC & 0xFF]])
+            break;
+        core.step();
+    }
+
+    regs.AC[i] = core.AC;
+    regs.X[i] = core.X;
+    regs.Y[i] = core.Y;
+    regs.SP[i] = core.SP;
+    regs.PC[i] = core.PC;
+    regs.cycles[i] = core.cycles;
+    regs.SR[i] = core.status();
+}
+
+// Group Instructions
+/* Loops over the LANES instances of a group, written so they vectorize */
+#define FOR_GROUP(i) for (size_t i = first; i < first + LANES; i++)
+
+inline uint8_t set_nz(uint8_t sr, uint8_t val) {
+    return (sr & 0x7D) | (val & 0x80) | ((val == 0) << 1);
+}
+
+inline uint8_t set_nzc(uint8_t sr, uint8_t val, uint8_t carry) {
+    return (sr & 0x7C) | (val & 0x80) | ((val == 0) << 1) | carry;
+}
+
+/* Length of the instructions step_group knows, 0 for the others. All of
+ * them only touch registers and their immediate operand, but for JMP abs
+ * which takes the whole group to the same place. CLI is left to the CPU,
+ * the IRQ it lets in is taken one instruction late */
+constexpr std::array<uint8_t, 256> make_group_ops() {
+    const char *const names[] = {
+        "LDA", "LDX", "LDY", "AND", "ORA", "EOR", "CMP", "CPX", "CPY", "ADC", "SBC",
+        "TAX", "TAY", "TXA", "TYA", "TSX", "TXS", "INX", "INY", "DEX", "DEY", "ASL", "LSR",
+        "CLC", "SEC", "SEI", "CLV", "CLD", "SED", "NOP"
+    };
+    std::array<uint8_t, 256> table {};
+    table[0x4C] = OPCODES[0x4C].length;
+    for (int op = 0; op < 256; op++) {
+        addressing mode = OPCODES[op].mode;
+        if (mode != IMM && mode != IMP && mode != ACC)
+            continue;
+        for (const char *name : names)
+            if (same_name(OPCODES[op].name, name))
+                table[op] = OPCODES[op].length;
+    }
+    return table;
+}
+
+template <class Bus>
+const std::array<uint8_t, 256> Batch<Bus>::group_ops = make_group_ops();
+
+/* Runs the instruction on the whole group, returns the cycles it took */
+template <class Bus>
+uint8_t Batch<Bus>::step_group(size_t first, uint8_t op_code, uint16_t operand) {
+    uint8_t *AC = regs.AC, *X = regs.X, *Y = regs.Y, *SR = regs.SR, *SP = regs.SP;
+    uint8_t m = operand;
+
+    switch (op_code) {
+        case 0xA9 : /* LDA # */
+            FOR_GROUP(i) { AC[i] = m; SR[i] = set_nz(SR[i], AC[i]); }
+            break;
+        case 0xA2 : /* LDX # */
+            FOR_GROUP(i) { X[i] = m; SR[i] = set_nz(SR[i], X[i]); }
+            break;
+        case 0xA0 : /* LDY # */
+            FOR_GROUP(i) { Y[i] = m; SR[i] = set_nz(SR[i], Y[i]); }
+            break;
+        case 0x29 : /* AND # */
+            FOR_GROUP(i) { AC[i] &= m; SR[i] = set_nz(SR[i], AC[i]); }
+            break;
+        case 0x09 : /* ORA # */
+            FOR_GROUP(i) { AC[i] |= m; SR[i] = set_nz(SR[i], AC[i]); }
+            break;
+        case 0x49 : /* EOR # */
+            FOR_GROUP(i) { AC[i] ^= m; SR[i] = set_nz(SR[i], AC[i]); }
+            break;
+        case 0xC9 : /* CMP # */
+            FOR_GROUP(i) SR[i] = set_nzc(SR[i], AC[i] - m, AC[i] >= m);
+            break;
+        case 0xE0 : /* CPX # */
+            FOR_GROUP(i) SR[i] = set_nzc(SR[i], X[i] - m, X[i] >= m);
+            break;
+        case 0xC0 : /* CPY # */
+            FOR_GROUP(i) SR[i] = set_nzc(SR[i], Y[i] - m, Y[i] >= m);
+            break;
+        case 0xE9 : /* SBC #, ADC of the complement */
+            m = ~m;
+            /* fallthrough */
+        case 0x69 : /* ADC # */
+            FOR_GROUP(i) {
+                uint16_t sum = AC[i] + m + (SR[i] & 0x01);
+                uint8_t res = sum;
+                uint8_t v = ((AC[i] ^ res) & (m ^ res) & 0x80) >> 1;
+                SR[i] = (set_nzc(SR[i], res, sum >> 8) & 0xBF) | v;
+                AC[i] = res;
+            }
+            break;
+        case 0xAA : /* TAX */
+            FOR_GROUP(i) { X[i] = AC[i]; SR[i] = set_nz(SR[i], X[i]); }
+            break;
+        case 0xA8 : /* TAY */
+            FOR_GROUP(i) { Y[i] = AC[i]; SR[i] = set_nz(SR[i], Y[i]); }
+            break;
+        case 0x8A : /* TXA */
+            FOR_GROUP(i) { AC[i] = X[i]; SR[i] = set_nz(SR[i], AC[i]); }
+            break;
+        case 0x98 : /* TYA */
+            FOR_GROUP(i) { AC[i] = Y[i]; SR[i] = set_nz(SR[i], AC[i]); }
+            break;
+        case 0xBA : /* TSX */
+            FOR_GROUP(i) { X[i] = SP[i]; SR[i] = set_nz(SR[i], X[i]); }
+            break;
+        case 0x9A : /* TXS */
+            FOR_GROUP(i) SP[i] = X[i];
+            break;
+        case 0xE8 : /* INX */
+            FOR_GROUP(i) { X[i]++; SR[i] = set_nz(SR[i], X[i]); }
+            break;
+        case 0xC8 : /* INY */
+            FOR_GROUP(i) { Y[i]++; SR[i] = set_nz(SR[i], Y[i]); }
+            break;
+        case 0xCA : /* DEX */
+            FOR_GROUP(i) { X[i]--; SR[i] = set_nz(SR[i], X[i]); }
+            break;
+        case 0x88 : /* DEY */
+            FOR_GROUP(i) { Y[i]--; SR[i] = set_nz(SR[i], Y[i]); }
+            break;
+        case 0x0A : /* ASL A */
+            FOR_GROUP(i) { SR[i] = set_nzc(SR[i], AC[i] << 1, AC[i] >> 7); AC[i] <<= 1; }
+            break;
+        case 0x4A : /* LSR A */
+            FOR_GROUP(i) { SR[i] = set_nzc(SR[i], AC[i] >> 1, AC[i] & 0x01); AC[i] >>= 1; }
+            break;
+        case 0x18 : /* CLC */
+            FOR_GROUP(i) SR[i] &= ~0x01;
+            break;
+        case 0x38 : /* SEC */
+            FOR_GROUP(i) SR[i] |= 0x01;
+            break;
+        case 0x78 : /* SEI */
+            FOR_GROUP(i) SR[i] |= 0x04;
+            break;
+        case 0xB8 : /* CLV */
+            FOR_GROUP(i) SR[i] &= ~0x40;
+            break;
+        case 0xD8 : /* CLD */
+            FOR_GROUP(i) SR[i] &= ~0x08;
+            break;
+        case 0xF8 : /* SED */
+            FOR_GROUP(i) SR[i] |= 0x08;
+            break;
+        default : /* NOP, JMP abs */
+            break;
+    }
+
+    uint16_t pc = op_code == 0x4C ? operand : regs.PC[first] + group_ops[op_code];
+    uint8_t cycles = OPCODES[op_code].cycles;
+    FOR_GROUP(i) {
+        regs.PC[i] = pc;
+        regs.cycles[i] += cycles;
+    }
+    return cycles;
+}
+
+#undef FOR_GROUP
+
+/* Only what the batch uses, lanes can not be forked */
+template CPU<Lane<BUS>>::CPU();
+template CPU<Lane<BUS>>::~CPU();
+template void CPU<Lane<BUS>>::set_bus(std::unique_ptr<Lane<BUS>>);
+template uint8_t CPU<Lane<BUS>>::status();
+template void CPU<Lane<BUS>>::set_status(uint8_t);
+template unsigned CPU<Lane<BUS>>::step();
+template void CPU<Lane<BUS>>::nmi();
+template void CPU<Lane<BUS>>::set_irq(uint8_t, bool);
+template void CPU<Lane<BUS>>::stall(unsigned);
+
+/* Buses the batch is built for */
+template class Batch<BUS>;
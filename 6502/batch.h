@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "cpu.h"
+
+/* Bus of the CPU of an instance, forwards everything to the bus of the
+ * instance */
+template <class Bus>
+class Lane {
+    public:
+    Bus *bus;
+
+    inline uint8_t read(uint16_t addr) {
+        return bus->read(addr);
+    }
+
+    inline void write(uint16_t addr, uint8_t val) {
+        bus->write(addr, val);
+    }
+
+    inline const uint8_t *memory(uint8_t page) const {
+        return bus->memory(page);
+    }
+};
+
+/* Runs many independent consoles in lockstep
+ * The registers of every instance live in one block as structure of
+ * arrays, the buses in one array. Instances are run in groups of LANES:
+ * when a whole group is at the same PC and none of them has an event or
+ * interrupt due, register only instructions (TAX, INX, LDA #, CMP #...)
+ * and JMP are done on all of the group at once by plain loops the compiler
+ * turns into SIMD code. Everything else is run one instance at a time on
+ * its own CPU, which keeps its events and interrupt lines, and costs a copy
+ * of the registers in and out of it. It pays off for code that spends its
+ * time on registers: bench/batch.cpp runs 1024 instances of a register
+ * loop about twice as fast as separate CPUs, but takes about 40% longer on
+ * a loop with a load, a store and a branch in nine instructions. */
+template <class Bus>
+class Batch {
+    public:
+    static const size_t LANES = 16;
+    static const uint64_t CYCLES_PER_FRAME = CPU<Bus>::CYCLES_PER_FRAME;
+
+    /* Registers of all the instances, register[i] belongs to instance i.
+     * SR always holds every flag, like CPU::status() */
+    struct state {
+        uint8_t *AC, *X, *Y, *SR, *SP;
+        uint16_t *PC;
+        uint64_t *cycles;
+    };
+
+    Batch(size_t);
+    ~Batch();
+
+    size_t size() const {
+        return count;
+    }
+
+    state regs;
+    Bus &bus(size_t);
+
+    /* CPU instance i runs on, for the devices on its bus: they add events
+     * to it, raise nmi() and set_irq() and read its cycles. Its registers
+     * are only up to date while the instance runs, regs holds them
+     * otherwise. Devices made for a CPU<BUS> (PPU, APU, mappers) can not
+     * be plugged */
+    CPU<Lane<Bus>> &cpu(size_t);
+
+    void step_all(); /* Runs one instruction on every instance */
+    void run_frames_all(unsigned); /* Runs every instance for whole frames */
+
+    private:
+    size_t count;
+    size_t padded; /* count rounded up to LANES */
+    std::unique_ptr<uint8_t[]> block; /* Where regs point to */
+    std::unique_ptr<Bus[]> buses;
+    std::unique_ptr<CPU<Lane<Bus>>[]> cpus;
+
+    static const unsigned SLICE = 32; /* Most instructions an instance runs on its own in a row */
+    static const std::array<uint8_t, 256> group_ops; /* Length of what step_group runs */
+
+    bool run_group(size_t, const uint64_t *, unsigned);
+    const uint8_t *group_page(size_t, uint8_t);
+    void run_one(size_t, uint64_t, unsigned, bool);
+    uint8_t step_group(size_t, uint8_t, uint16_t);
+};
@@ -0,0 +1,107 @@
+#include "block_cache.h"
+
+template <class Bus>
+BlockCache<Bus>::BlockCache(CPU<Bus> &cpu) : cpu(cpu) {
+}
+
+template <class Bus>
+BlockCache<Bus>::~BlockCache(void) {
+}
+
+template <class Bus>
+uint64_t BlockCache<Bus>::run_for(uint64_t budget) {
+    uint64_t start = cpu.cycles;
+    uint64_t end = cpu.cycles + budget;
+    while (cpu.cycles < end) {
+        if (cpu.cycles >= cpu.events.limit) { /* Events and interrupts are looked at by step */
+            cpu.step();
+            continue;
+        }
+#ifdef CPU_TRACE
+        if (cpu.trace) { /* Blocks skip the fetch, trace one instruction at a time */
+            cpu.step();
+            continue;
+        }
+#endif
+#ifdef CPU_PROFILE
+        if (cpu.profile) {
+            cpu.step();
+            continue;
+        }
+#endif
+        const block *b = lookup(cpu.PC);
+        if (!b) {
+            cpu.step();
+            continue;
+        }
+        /* Instructions expect PC right after the opcode, their addressing
+         * mode moves it past the operand. Each one adds its cycles as it
+         * runs and the block is left where the interpreter would look at
+         * the events, PC is right between any two instructions. A store
+         * to the pages of the block leaves it too, the code after it may
+         * have changed */
+        const Bus &bus = *cpu.bus;
+        uint8_t first_page = cpu.PC >> 8;
+        for (const instruction *ins : b->code) {
+            cpu.PC++;
+            cpu.dispatch(*ins);
+            if (cpu.cycles >= cpu.events.limit || bus.version(first_page) != b->versions[0] ||
+                bus.version(b->last_page) != b->versions[1])
+                break;
+        }
+    }
+    return cpu.cycles - start;
+}
+
+template <class Bus>
+void BlockCache<Bus>::flush() {
+    for (std::unique_ptr<block[]> &page : pages)
+        page.reset();
+}
+
+/* Returns null when there is no memory behind PC, that code is interpreted */
+template <class Bus>
+const typename BlockCache<Bus>::block *BlockCache<Bus>::lookup(uint16_t pc) {
+    std::unique_ptr<block[]> &page = pages[pc >> 8];
+    if (!page)
+        page.reset(new block[0x100]());
+
+    block &b = page[pc & 0xFF];
+    const Bus &bus = *cpu.bus;
+    if (!b.valid || b.versions[0] != bus.version(pc >> 8) || b.versions[1] != bus.version(b.last_page))
+        decode(b, pc);
+    return b.valid ? &b : nullptr;
+}
+
+template <class Bus>
+void BlockCache<Bus>::decode(block &b, uint16_t pc) {
+    Bus &bus = *cpu.bus;
+    uint8_t page = pc >> 8;
+    b.code.clear();
+    b.valid = false;
+
+    const uint8_t *memory = bus.memory(page);
+    if (!memory)
+        return;
+
+    uint16_t addr = pc;
+    do {
+        uint8_t op_code = memory[addr & 0xFF];
+        const instruction &ins = CPU<Bus>::op_table[op_code];
+        b.code.push_back(&ins);
+        addr += ins.length;
+        if (OPCODES[op_code].ends_block)
+            break;
+    } while ((addr >> 8) == page && b.code.size() < MAX_BLOCK_SIZE);
+
+    /* Watch the pages so writes to code living in RAM bump their versions */
+    b.last_page = (addr - 1) >> 8;
+    bus.watch(page);
+    bus.watch(b.last_page);
+    b.versions[0] = bus.version(page);
+    b.versions[1] = bus.version(b.last_page);
+    b.valid = true;
+}
+
+/* Buses the block cache is built for */
+template class BlockCache<BUS>;
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "cpu.h"
+
+/* Optional execution engine that decodes straight line code once into
+ * blocks and runs them without fetching and decoding every opcode again.
+ * A block ends on the first instruction that can change PC (branches, JMP,
+ * JSR, RTS, RTI and BRK) or at the end of its page. Blocks are kept by the
+ * PC they start at and get decoded again when the version of their pages
+ * changes, which happens on bank switching and on writes to RAM holding
+ * code. The block being run is left right after a write to its pages.
+ * Instructions keep their own timing: devices see the same cycles as with
+ * the interpreter and a block is left as soon as an event is due */
+template <class Bus>
+class BlockCache {
+    public:
+    BlockCache(CPU<Bus> &);
+    ~BlockCache();
+
+    /* Same as CPU::run_for, but the budget is checked between blocks */
+    uint64_t run_for(uint64_t);
+    void flush();
+
+    private:
+    typedef typename CPU<Bus>::instruction instruction;
+
+    static const size_t MAX_BLOCK_SIZE = 64;
+
+    struct block {
+        std::vector<const instruction *> code; /* Entries of CPU::op_table */
+        uint8_t last_page; /* Page of the last operand byte */
+        uint32_t versions[2]; /* Of the first and last page when decoded */
+        bool valid;
+    };
+
+    CPU<Bus> &cpu;
+    std::unique_ptr<block[]> pages[0x100]; /* Blocks by high and low byte of PC */
+
+    const block *lookup(uint16_t);
+    void decode(block &, uint16_t);
+};
@@ -0,0 +1,234 @@
+#include "bus.h"
+
+#include <cstring>
+
+BUS::BUS(void) : region_count(0) {
+    for (int page = 0; page < 0x100; page++) {
+        read_map[page] = nullptr;
+        write_map[page] = nullptr;
+        io_map[page] = nullptr;
+        watch_map[page] = nullptr;
+        mirrors[page] = page;
+        versions[page] = 0;
+        home_map[page] = nullptr;
+    }
+    for (size_t i = 0; i < RAM_SIZE; i++)
+        ram[i] = 0;
+    map(0x00, 0x1F, ram, RAM_SIZE, true);
+}
+
+BUS::~BUS(void) {
+}
+
+void BUS::map(uint8_t first_page, uint8_t last_page, uint8_t *memory, size_t size, bool writable) {
+    size_t offset = 0;
+    for (int page = first_page; page <= last_page; page++) {
+        unwatch(page);
+        read_map[page] = memory + offset;
+        write_map[page] = writable ? memory + offset : nullptr;
+        watch_map[page] = nullptr;
+        home_map[page] = write_map[page];
+        frames[page].reset();
+        versions[page]++;
+        offset = (offset + PAGE_SIZE) % size;
+    }
+}
+
+void BUS::map_io(uint8_t first_page, uint8_t last_page, const io *device) {
+    for (int page = first_page; page <= last_page; page++) {
+        unwatch(page);
+        read_map[page] = nullptr;
+        write_map[page] = nullptr;
+        io_map[page] = device;
+        watch_map[page] = nullptr;
+        home_map[page] = nullptr;
+        frames[page].reset();
+        versions[page]++;
+    }
+}
+
+void BUS::unmap(uint8_t first_page, uint8_t last_page) {
+    for (int page = first_page; page <= last_page; page++) {
+        unwatch(page);
+        read_map[page] = nullptr;
+        write_map[page] = nullptr;
+        io_map[page] = nullptr;
+        watch_map[page] = nullptr;
+        home_map[page] = nullptr;
+        frames[page].reset();
+        versions[page]++;
+    }
+}
+
+/* Read only pages are never written so there is nothing to watch. The
+ * mirrors of the page get watched too and linked in a ring, so a write
+ * through any of them bumps the version of all */
+void BUS::watch(uint8_t page) {
+    uint8_t *memory = write_map[page];
+    if (!memory)
+        return;
+    watch_map[page] = memory;
+    write_map[page] = nullptr;
+    uint8_t last = page;
+    for (int mirror = 0; mirror < 0x100; mirror++) {
+        if (write_map[mirror] != memory)
+            continue;
+        watch_map[mirror] = memory;
+        write_map[mirror] = nullptr;
+        mirrors[last] = mirror;
+        last = mirror;
+    }
+    mirrors[last] = page;
+}
+
+void BUS::unwatch(uint8_t page) {
+    if (!watch_map[page])
+        return;
+    write_map[page] = watch_map[page];
+    watch_map[page] = nullptr;
+    uint8_t prev = page;
+    while (mirrors[prev] != page)
+        prev = mirrors[prev];
+    mirrors[prev] = mirrors[page];
+    mirrors[page] = page;
+}
+
+bool BUS::add_state(void *memory, size_t size, void (*loaded)(void *), void *device) {
+    if (region_count == MAX_STATE_REGIONS)
+        return false;
+    regions[region_count++] = { memory, size, loaded, device };
+    return true;
+}
+
+size_t BUS::state_size() const {
+    size_t size = RAM_SIZE;
+    for (size_t i = 0; i < region_count; i++)
+        size += regions[i].size;
+    return size;
+}
+
+/* RAM is read through its pages, on a forked bus they can still be shared */
+void BUS::save_state(uint8_t *buffer) const {
+    for (size_t offset = 0; offset < RAM_SIZE; offset += PAGE_SIZE)
+        memcpy(buffer + offset, read_map[offset >> 8], PAGE_SIZE);
+    buffer += RAM_SIZE;
+    for (size_t i = 0; i < region_count; i++) {
+        memcpy(buffer, regions[i].memory, regions[i].size);
+        buffer += regions[i].size;
+    }
+}
+
+/* The memory changes behind the back of the watched pages, code decoded
+ * from them has to go */
+void BUS::load_state(const uint8_t *buffer) {
+    for (int page = 0; page < 0x100; page++) {
+        if (frames[page])
+            unshare(page);
+    }
+    memcpy(ram, buffer, RAM_SIZE);
+    buffer += RAM_SIZE;
+    for (size_t i = 0; i < region_count; i++) {
+        memcpy(regions[i].memory, buffer, regions[i].size);
+        buffer += regions[i].size;
+    }
+    for (int page = 0; page < 0x100; page++) {
+        if (watch_map[page])
+            versions[page]++;
+    }
+    for (size_t i = 0; i < region_count; i++) {
+        if (regions[i].loaded)
+            regions[i].loaded(regions[i].device);
+    }
+}
+
+/* Sharing takes a copy of each writable page, later forks share the same
+ * copy as long as this bus does not write to the page. Watched pages are
+ * not watched anymore, writes to shared pages bump their version anyway */
+std::unique_ptr<BUS> BUS::fork() {
+    for (int page = 0; page < 0x100; page++) {
+        if (io_map[page])
+            return nullptr;
+    }
+    for (int page = 0; page < 0x100; page++)
+        unwatch(page);
+    for (int page = 0; page < 0x100; page++) {
+        uint8_t *memory = write_map[page];
+        if (!memory)
+            continue;
+        std::shared_ptr<uint8_t[]> frame(new uint8_t[PAGE_SIZE]);
+        memcpy(frame.get(), memory, PAGE_SIZE);
+        for (int mirror = page; mirror < 0x100; mirror++) {
+            if (write_map[mirror] != memory)
+                continue;
+            read_map[mirror] = frame.get();
+            write_map[mirror] = nullptr;
+            frames[mirror] = frame;
+        }
+    }
+
+    std::unique_ptr<BUS> child(new BUS());
+    for (int page = 0; page < 0x100; page++) {
+        child->read_map[page] = read_map[page];
+        child->write_map[page] = write_map[page];
+        child->frames[page] = frames[page];
+        /* The internal RAM of the child is its own, other memory gets
+         * allocated when written */
+        uint8_t *home = home_map[page];
+        bool in_ram = home >= ram && home < ram + RAM_SIZE;
+        child->home_map[page] = in_ram ? child->ram + (home - ram) : nullptr;
+    }
+    return child;
+}
+
+/* Moves the page and its mirrors from the shared copy to memory of their own */
+void BUS::unshare(uint8_t page) {
+    uint8_t *frame = read_map[page];
+    uint8_t *memory = home_map[page];
+    if (!memory) {
+        copies.emplace_back(new uint8_t[PAGE_SIZE]);
+        memory = copies.back().get();
+    }
+    memcpy(memory, frame, PAGE_SIZE);
+
+    std::shared_ptr<uint8_t[]> keep = frames[page]; /* Until every mirror moved */
+    for (int mirror = 0; mirror < 0x100; mirror++) {
+        if (!frames[mirror] || read_map[mirror] != frame)
+            continue;
+        read_map[mirror] = memory;
+        write_map[mirror] = memory;
+        home_map[mirror] = memory;
+        frames[mirror].reset();
+        versions[mirror]++;
+    }
+}
+
+/* Reads from unmapped pages return the high byte of the address, which is
+ * the last thing the CPU put on the data bus for absolute addressing */
+uint8_t BUS::read_io(uint16_t addr) {
+    const io *device = io_map[addr >> 8];
+    if (device && device->read)
+        return device->read(device->device, addr);
+    return addr >> 8;
+}
+
+void BUS::write_io(uint16_t addr, uint8_t val) {
+    uint8_t page = addr >> 8;
+    if (frames[page]) {
+        unshare(page);
+        write(addr, val);
+        return;
+    }
+    uint8_t *memory = watch_map[page];
+    if (memory) {
+        memory[addr & 0xFF] = val;
+        uint8_t mirror = page;
+        do {
+            versions[mirror]++;
+            mirror = mirrors[mirror];
+        } while (mirror != page);
+        return;
+    }
+    const io *device = io_map[page];
+    if (device && device->write)
+        device->write(device->device, addr, val);
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/* Memory map seen by the CPU
+ * The 64KB address space is split in 256 pages of 256 bytes. Each page
+ * points straight at the memory backing it (RAM, ROM...) or, when there
+ * is no memory behind it, at the I/O device handling the accesses. That
+ * way most reads and writes are a single indexed load. */
+class BUS {
+    template <class> friend class JIT; /* Generated code walks the maps itself */
+
+    public:
+    /* Device mapped on pages without backing memory (PPU, APU, mapper registers...) */
+    struct io {
+        uint8_t (*read)(void *, uint16_t);
+        void (*write)(void *, uint16_t, uint8_t);
+        void *device;
+    };
+
+    static const size_t PAGE_SIZE = 0x100;
+    static const size_t RAM_SIZE = 0x800;
+
+    uint8_t ram[RAM_SIZE]; /* Internal RAM, mirrored on 0x0000 - 0x1FFF */
+
+    BUS();
+    ~BUS();
+    BUS(const BUS &) = delete; /* The maps point inside of the object */
+    BUS &operator=(const BUS &) = delete;
+
+    /* Maps the pages from first_page to last_page to memory. When memory is
+     * smaller than the range it gets mirrored. Read only memory (ROM) sends
+     * the writes to the I/O device of the page, if there is any */
+    void map(uint8_t first_page, uint8_t last_page, uint8_t *memory, size_t size, bool writable);
+    void map_io(uint8_t first_page, uint8_t last_page, const io *device);
+    void unmap(uint8_t first_page, uint8_t last_page);
+
+    /* Every page has a version, bumped each time the page gets mapped again
+     * or, for watched pages, written (through the page or any mirror of it).
+     * Lets code decoded from a page know when it is stale. Watched pages
+     * lose the write fast path */
+    void watch(uint8_t page);
+    void unwatch(uint8_t page);
+    inline uint32_t version(uint8_t page) const {
+        return versions[page];
+    }
+
+    /* Save states hold the RAM plus the regions added here (cartridge RAM,
+     * mapper registers...), copied as they are. Regions have to stay valid
+     * for as long as the bus lives. loaded, when given, is called with
+     * device once the whole state is loaded, for the devices that have to
+     * rebuild something from it (mappers map their banks again) */
+    static const size_t MAX_STATE_REGIONS = 8;
+    bool add_state(void *memory, size_t size, void (*loaded)(void *) = nullptr, void *device = nullptr);
+    size_t state_size() const;
+    void save_state(uint8_t *) const;
+    void load_state(const uint8_t *);
+
+    /* Makes a bus mapped the same way sharing the writable memory copy on
+     * write: the pages are shared by both buses until one of them writes
+     * to a page, which then gets its own copy. ROM is only pointed to.
+     * State regions are not carried over, the devices owning them have to
+     * add them to the new bus. The ram array of the new bus only holds
+     * the pages it wrote, read RAM through the bus.
+     * Devices can not be forked yet: the new bus would still send their
+     * accesses to the devices of this one. Returns null, changing nothing,
+     * when an I/O page is mapped, so only plain RAM and ROM buses fork */
+    std::unique_ptr<BUS> fork();
+
+    /* Memory backing the page, null for I/O */
+    inline const uint8_t *memory(uint8_t page) const {
+        return read_map[page];
+    }
+
+    /* I/O device of the page, for devices sharing a page to pass on the
+     * accesses that are not theirs */
+    inline const io *device(uint8_t page) const {
+        return io_map[page];
+    }
+
+    inline uint8_t read(uint16_t addr) {
+        const uint8_t *memory = read_map[addr >> 8];
+        if (memory)
+            return memory[addr & 0xFF];
+        return read_io(addr);
+    }
+
+    inline void write(uint16_t addr, uint8_t val) {
+        uint8_t *memory = write_map[addr >> 8];
+        if (memory)
+            memory[addr & 0xFF] = val;
+        else
+            write_io(addr, val);
+    }
+
+    private:
+    uint8_t *read_map[0x100];
+    uint8_t *write_map[0x100];
+    const io *io_map[0x100];
+    uint8_t *watch_map[0x100]; /* Memory of the watched pages */
+    uint8_t mirrors[0x100]; /* Ring of the watched pages sharing memory */
+    uint32_t versions[0x100];
+    uint8_t *home_map[0x100]; /* Writable memory of the page when not shared */
+    std::shared_ptr<uint8_t[]> frames[0x100]; /* Copy shared pages are read from */
+    std::vector<std::unique_ptr<uint8_t[]>> copies; /* Pages written with no home memory */
+
+    struct region {
+        void *memory;
+        size_t size;
+        void (*loaded)(void *);
+        void *device;
+    };
+    region regions[MAX_STATE_REGIONS];
+    size_t region_count;
+
+    uint8_t read_io(uint16_t);
+    void write_io(uint16_t, uint8_t);
+    void unshare(uint8_t);
+};
@@ -0,0 +1,153 @@
+#include "cartridge.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+
+Cartridge::Cartridge(void)
+    : mapper(0), submapper(0), nametables(HORIZONTAL), battery(false), nes2(false), prg(nullptr), prg_size(0),
+      chr(nullptr), chr_size(0), trainer(nullptr), prg_ram_size(0), prg_nvram_size(0), chr_ram_size(0),
+      chr_nvram_size(0), file(nullptr), file_size(0) {
+}
+
+Cartridge::~Cartridge(void) {
+    if (file)
+        munmap(file, file_size);
+}
+
+// Helper Functions
+
+/* A file is the same when it is the same inode, untouched since */
+typedef std::tuple<dev_t, ino_t, off_t, time_t, long> file_key;
+
+std::mutex open_lock;
+std::map<file_key, std::weak_ptr<const Cartridge>> open_files;
+
+/* NES 2.0 ROM sizes: the nibble from byte 9 on top of the LSB, or when it
+ * is 0xF, an exponent and a multiplier */
+size_t rom_size(uint8_t lsb, uint8_t msb, size_t unit) {
+    if (msb == 0xF)
+        return ((size_t)1 << (lsb >> 2)) * ((lsb & 3) * 2 + 1);
+    return ((size_t)msb << 8 | lsb) * unit;
+}
+
+/* RAM sizes are 64 << shift, 0 for none */
+size_t ram_size(uint8_t shift) {
+    return shift ? (size_t)64 << shift : 0;
+}
+
+std::shared_ptr<const Cartridge> Cartridge::open(const char *path) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat info;
+    if (fstat(fd, &info) || !info.st_size) {
+        close(fd);
+        return nullptr;
+    }
+
+    file_key key(info.st_dev, info.st_ino, info.st_size, info.st_mtim.tv_sec, info.st_mtim.tv_nsec);
+    std::lock_guard<std::mutex> lock(open_lock);
+    std::shared_ptr<const Cartridge> shared = open_files[key].lock();
+    if (shared) {
+        close(fd);
+        return shared;
+    }
+
+    std::shared_ptr<Cartridge> cart(new Cartridge());
+    cart->file_size = info.st_size;
+    void *file = mmap(nullptr, cart->file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); /* The mapping keeps the file */
+    if (file == MAP_FAILED)
+        return nullptr;
+    cart->file = file;
+    if (!cart->parse())
+        return nullptr;
+
+    /* Forget the cartridges gone since */
+    for (auto it = open_files.begin(); it != open_files.end();) {
+        if (it->second.expired())
+            it = open_files.erase(it);
+        else
+            ++it;
+    }
+    open_files[key] = cart;
+    return cart;
+}
+
+bool Cartridge::parse() {
+    const uint8_t *data = (const uint8_t *)file;
+
+    if (file_size < 16 || memcmp(data, "NES\x1A", 4)) {
+        if (file_size != 0x4000 && file_size != 0x8000)
+            return false;
+        prg = data;
+        prg_size = file_size;
+        prg_ram_size = 0x2000;
+        chr_ram_size = 0x2000;
+        return true;
+    }
+
+    const uint8_t *header = data;
+    nes2 = (header[7] & 0x0C) == 0x08;
+    nametables = header[6] & 0x08 ? FOUR_SCREEN : header[6] & 0x01 ? VERTICAL : HORIZONTAL;
+    battery = header[6] & 0x02;
+    mapper = header[6] >> 4;
+    if (nes2) {
+        mapper |= (header[7] & 0xF0) | (header[8] & 0x0F) << 8;
+        submapper = header[8] >> 4;
+        prg_size = rom_size(header[4], header[9] & 0x0F, 0x4000);
+        chr_size = rom_size(header[5], header[9] >> 4, 0x2000);
+        prg_ram_size = ram_size(header[10] & 0x0F);
+        prg_nvram_size = ram_size(header[10] >> 4);
+        chr_ram_size = ram_size(header[11] & 0x0F);
+        chr_nvram_size = ram_size(header[11] >> 4);
+    } else {
+        /* Old dumps have junk ("DiskDude!") from byte 7 on, bytes 7 and 8
+         * are only trusted when the padding is clean */
+        bool clean = !header[12] && !header[13] && !header[14] && !header[15];
+        if (clean)
+            mapper |= header[7] & 0xF0;
+        prg_size = header[4] * 0x4000;
+        chr_size = header[5] * 0x2000;
+        prg_ram_size = (clean && header[8] ? header[8] : 1) * 0x2000;
+        chr_ram_size = chr_size ? 0 : 0x2000;
+        if (battery) {
+            prg_nvram_size = prg_ram_size;
+            prg_ram_size = 0;
+        }
+    }
+
+    size_t offset = 16;
+    if (header[6] & 0x04) {
+        trainer = data + offset;
+        offset += 512;
+    }
+    if (offset > file_size || !prg_size || prg_size > file_size - offset || chr_size > file_size - offset - prg_size)
+        return false;
+    prg = data + offset;
+    chr = chr_size ? data + offset + prg_size : nullptr;
+    return true;
+}
+
+/* The bus never writes to read only pages, the const goes away safely.
+ * Mapping the pages again would bump their versions for nothing, the code
+ * decoded from them would go */
+void Cartridge::map_prg(BUS &bus, uint8_t first_page, uint8_t last_page, size_t bank, size_t bank_size) const {
+    size_t banks = prg_size > bank_size ? prg_size / bank_size : 1;
+    size_t size = prg_size < bank_size ? prg_size : bank_size;
+    const uint8_t *memory = prg + bank % banks * bank_size;
+    size_t offset = 0;
+    bool mapped = true;
+    for (int page = first_page; page <= last_page && mapped; page++) {
+        mapped = bus.memory(page) == memory + offset;
+        offset = (offset + BUS::PAGE_SIZE) % size;
+    }
+    if (!mapped)
+        bus.map(first_page, last_page, (uint8_t *)memory, size, false);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "bus.h"
+
+/* Cartridge ROM from an iNES or NES 2.0 file
+ * The file is mapped read only and PRG/CHR point straight into it, the
+ * banks get mapped on the bus with no copies. Opening a file already open
+ * in the process returns the same cartridge, so any number of machines
+ * running the same game share one mapping; forked processes inherit it
+ * and the page cache backs it for the others.
+ * RAM on the cartridge (PRG RAM, CHR RAM) is per machine, only its size is
+ * given here. Headerless 16 or 32 KB PRG images are taken as NROM with
+ * CHR RAM. */
+class Cartridge {
+    public:
+    enum mirroring {
+        HORIZONTAL, VERTICAL, FOUR_SCREEN
+    };
+
+    uint16_t mapper;
+    uint8_t submapper;
+    mirroring nametables;
+    bool battery;
+    bool nes2; /* NES 2.0 header, the sizes below are exact */
+
+    const uint8_t *prg;
+    size_t prg_size;
+    const uint8_t *chr;
+    size_t chr_size; /* 0 when the cartridge has CHR RAM */
+    const uint8_t *trainer; /* 512 bytes for $7000, null when there is none */
+
+    size_t prg_ram_size, prg_nvram_size;
+    size_t chr_ram_size, chr_nvram_size;
+
+    /* Null when the file can not be read or is not a ROM */
+    static std::shared_ptr<const Cartridge> open(const char *path);
+
+    ~Cartridge();
+    Cartridge(const Cartridge &) = delete;
+    Cartridge &operator=(const Cartridge &) = delete;
+
+    /* Maps PRG bank number bank, of bank_size bytes, on the pages. Banks
+     * past the end wrap around like the unused bank bits do. Pages already
+     * showing the bank are left as they are */
+    void map_prg(BUS &, uint8_t first_page, uint8_t last_page, size_t bank, size_t bank_size) const;
+
+    private:
+    void *file; /* The whole mapping */
+    size_t file_size;
+
+    Cartridge();
+    bool parse();
+};
@@ -0,0 +1,38 @@
+#include "controller.h"
+
+Controller::Controller(void) {
+    buttons[0] = buttons[1] = 0;
+    latch.shift[0] = latch.shift[1] = 0;
+    latch.strobe = 0;
+    io = { &Controller::read, &Controller::write, this };
+}
+
+void Controller::plug(BUS &bus) {
+    bus.map_io(0x40, 0x40, &io);
+    bus.add_state(&latch, sizeof(latch));
+}
+
+/* Once the 8 buttons are out the shift register reads 1 */
+uint8_t Controller::read(void *device, uint16_t addr) {
+    Controller &pad = *(Controller *)device;
+    if (addr != 0x4016 && addr != 0x4017)
+        return addr >> 8;
+
+    int port = addr & 1;
+    if (pad.latch.strobe)
+        pad.latch.shift[port] = pad.buttons[port];
+    uint8_t bit = pad.latch.shift[port] & 1;
+    pad.latch.shift[port] = (pad.latch.shift[port] >> 1) | 0x80;
+    return (addr >> 8 & 0xE0) | bit; /* Upper bits are open bus */
+}
+
+void Controller::write(void *device, uint16_t addr, uint8_t val) {
+    Controller &pad = *(Controller *)device;
+    if (addr != 0x4016)
+        return;
+    pad.latch.strobe = val & 1;
+    if (pad.latch.strobe) {
+        pad.latch.shift[0] = pad.buttons[0];
+        pad.latch.shift[1] = pad.buttons[1];
+    }
+}
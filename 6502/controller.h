@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+#include "bus.h"
+
+/* Standard controllers on $4016 and $4017
+ * Writing 1 then 0 to $4016 latches the buttons, each read then returns
+ * the next one in bit 0: A, B, Select, Start, Up, Down, Left, Right.
+ * The controllers take the whole 0x40 page, the rest of it reads as
+ * open bus. The buttons are input and are not saved in save states */
+class Controller {
+    public:
+    enum button {
+        A = 0x01, B = 0x02, SELECT = 0x04, START = 0x08,
+        UP = 0x10, DOWN = 0x20, LEFT = 0x40, RIGHT = 0x80
+    };
+
+    uint8_t buttons[2]; /* Held buttons of each port */
+
+    Controller();
+    void plug(BUS &);
+
+    private:
+    BUS::io io;
+    struct {
+        uint8_t shift[2];
+        uint8_t strobe;
+    } latch; /* Goes in the save states */
+
+    static uint8_t read(void *, uint16_t);
+    static void write(void *, uint16_t, uint8_t);
+};
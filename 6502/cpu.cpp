@@ -1,68 +1,123 @@
 #include "cpu.h"
 
-CPU::CPU(void) {
-}
-
-CPU::~CPU(void) {
+#include <cstring>
+#ifdef CPU_PROFILE
+#include <chrono>
+#endif
+
+template <class Bus, class Variant>
+CPU<Bus, Variant>::CPU(void) : AC(0), X(0), Y(0), SP(0), PC(0), cycles(0), nmi_pending(false), irq_lines(0), irq_delayed(false) {
+    set_status(0x20);
+#ifdef CPU_TRACE
+    trace = nullptr;
+#endif
+#ifdef CPU_PROFILE
+    profile = nullptr;
+#endif
+}
+
+template <class Bus, class Variant>
+CPU<Bus, Variant>::~CPU(void) {
+}
+
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::set_bus(std::unique_ptr<Bus> bus) {
+    this->bus = std::move(bus);
+}
+
+template <class Bus, class Variant>
+std::unique_ptr<CPU<Bus, Variant>> CPU<Bus, Variant>::fork() {
+    if (events.added())
+        return nullptr;
+    std::unique_ptr<Bus> forked = bus->fork();
+    if (!forked)
+        return nullptr;
+
+    std::unique_ptr<CPU> child(new CPU());
+    child->AC = AC;
+    child->X = X;
+    child->Y = Y;
+    child->SP = SP;
+    child->PC = PC;
+    child->cycles = cycles;
+    child->set_status(status());
+    child->nmi_pending = nmi_pending;
+    child->irq_lines = irq_lines;
+    child->irq_delayed = irq_delayed;
+    child->set_bus(std::move(forked));
+    return child;
 }
 
 // Helper Functions
-template <class t> 
-void set_bit(t &var, const t bit, const bool value) {
-    var |= (1 << bit);
-    if (!value)
-        var ^= (1 << bit);
+template <class t>
+void set_bit(t &var, const uint8_t bit, const bool value) {
+    var = (var & ~(1 << bit)) | (value << bit);
 }
 
 template<class t>
-bool get_bit(const t var, const t bit) const {
+bool get_bit(const t var, const uint8_t bit) {
     return !!(var & (1 << bit));
 }
 
-uint16_t join_bytes(const uint8_t low, const uint8_t high) const {
+inline uint16_t join_bytes(const uint8_t low, const uint8_t high) {
     uint16_t res = high;
     return (res << 8) | low;
 }
 
 // Addressing Modes
 /* Addressing Mode Immediate function */
-uint16_t CPU::addr_imd() {
+template <class Bus, class Variant>
+uint16_t CPU<Bus, Variant>::addr_imd() {
     return (PC++);
 }
 
 /* Addressing Mode ZeroPage function */
-uint16_t CPU::addr_zpg() {
+template <class Bus, class Variant>
+uint16_t CPU<Bus, Variant>::addr_zpg() {
     return (bus->read(PC++));
 }
 
 /* Addressing Mode ZeroPageX function */
-uint16_t CPU::addr_zpg_x() {
-    return (bus->read(PC++ + X)); // TODO Check this CP++ + X
+template <class Bus, class Variant>
+uint16_t CPU<Bus, Variant>::addr_zpg_x() {
+    return (uint8_t)(bus->read(PC++) + X); /* Wraps around the zero page */
+}
+
+/* Addressing Mode ZeroPageY function */
+template <class Bus, class Variant>
+uint16_t CPU<Bus, Variant>::addr_zpg_y() {
+    return (uint8_t)(bus->read(PC++) + Y);
 }
 
 /* Addressing Mode Absolute function */
-uint16_t CPU::addr_abs() {
+template <class Bus, class Variant>
+uint16_t CPU<Bus, Variant>::addr_abs() {
     uint8_t low_byte = bus->read(PC++);
     uint8_t high_byte = bus->read(PC++);
-    return (bus->read(join_bytes(low_byte, high_byte)));
+    return join_bytes(low_byte, high_byte);
 }
 
 /* Addressing Mode Absolute, X function */
-uint16_t CPU::addr_abs_x() {
+template <class Bus, class Variant>
+uint16_t CPU<Bus, Variant>::addr_abs_x() {
     uint8_t low_byte = bus->read(PC++);
     uint8_t high_byte = bus->read(PC++);
-    return (bus->read(join_bytes(low_byte, high_byte) + X));
+    page_crossed = (low_byte + X) >> 8;
+    return join_bytes(low_byte, high_byte) + X;
 }
 
 /* Addressing Mode Absolute, Y function */
-uint16_t CPU::addr_abs_y() {
+template <class Bus, class Variant>
+uint16_t CPU<Bus, Variant>::addr_abs_y() {
     uint8_t low_byte = bus->read(PC++);
     uint8_t high_byte = bus->read(PC++);
-    return (bus->read(join_bytes(low_byte, high_byte) + Y));
+    page_crossed = (low_byte + Y) >> 8;
+    return join_bytes(low_byte, high_byte) + Y;
 }
 
 /* Addressing Mode Indirect */
-uint16_t CPU::addr_indr() {
+template <class Bus, class Variant>
+uint16_t CPU<Bus, Variant>::addr_indr() {
     uint16_t addr = addr_abs();
     uint8_t low_byte = bus->read(addr);
     uint8_t high_byte = bus->read(addr + 1);
@@ -70,1000 +125,1115 @@ uint16_t CPU::addr_indr() {
 }
 
 /* Addressing Mode Indexed Indirect X Function */
-uint16_t CPU::addr_indr_x() {
-    uint16_t addr_rel = bus->read(PC++) + (uint16_t)X;
+template <class Bus, class Variant>
+uint16_t CPU<Bus, Variant>::addr_indr_x() {
+    uint8_t addr_rel = bus->read(PC++) + X;
     uint8_t low_byte = bus->read(addr_rel++);
     uint8_t high_byte = bus->read(addr_rel);
     return (join_bytes(low_byte, high_byte));
 }
 
 /* Addressing Mode Indirect Indexed Y Function */
-uint16_t CPU::addr_indr_y() {
-    uint16_t addr = bus_read(PC++);
+template <class Bus, class Variant>
+uint16_t CPU<Bus, Variant>::addr_indr_y() {
+    uint8_t addr = bus->read(PC++);
     uint8_t low_byte = bus->read(addr++);
     uint8_t high_byte = bus->read(addr);
+    page_crossed = (low_byte + Y) >> 8;
     return (join_bytes(low_byte, high_byte) + (uint16_t)(Y));
 }
 
-void CPU::addr_rel(bool branch) {
-    uint8_t pc_content = read(PC++);
-    if(branch)
-        PC += pc_content;
+/* Taken branches take one more cycle, two if they land on another page */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::addr_rel(bool branch) {
+    int8_t offset = bus->read(PC++);
+    if(branch) {
+        uint16_t target = PC + offset;
+        cycles += 1 + ((PC ^ target) > 0xFF);
+        PC = target;
+    }
 }
 
-uint8_t CPU::read(std::function<uint16_t(void)> addr_mode) {
-    return bus->read(addr_mode());
+// General Methods and helpers
+
+/* The stack lives on page 0x01, SP points to the next free byte */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::push(uint8_t val) {
+    bus->write(0x100 | SP--, val);
 }
 
-// General Methods and helpers
+template <class Bus, class Variant>
+uint8_t CPU<Bus, Variant>::pop() {
+    return bus->read(0x100 | ++SP);
+}
+
+// Status Flags
+/* N and Z for every result, ready to be or'ed into SR */
+template <class Bus, class Variant>
+constexpr std::array<uint8_t, 256> CPU<Bus, Variant>::make_nz_table() {
+    std::array<uint8_t, 256> table {};
+    for (int val = 0; val < 256; val++)
+        table[val] = (val & 0x80) | (val == 0) << bs::Z;
+    return table;
+}
+
+template <class Bus, class Variant>
+const std::array<uint8_t, 256> CPU<Bus, Variant>::nz_table = CPU<Bus, Variant>::make_nz_table();
+
+/* Every instruction updates N, V, Z and C through these functions. When
+ * built with CPU_LAZY_FLAGS they only keep the values the flags come from
+ * and the flags are worked out when someone looks at them: branches,
+ * status() (PHP, BRK, debugger) and the instructions using the carry */
+#ifdef CPU_LAZY_FLAGS
+
+template <class Bus, class Variant>
+inline void CPU<Bus, Variant>::set_nz(uint8_t val) {
+    flag_n = val;
+    flag_z = val;
+}
+
+template <class Bus, class Variant>
+inline void CPU<Bus, Variant>::set_n(uint8_t val) {
+    flag_n = val;
+}
+
+template <class Bus, class Variant>
+inline void CPU<Bus, Variant>::set_z(uint8_t val) {
+    flag_z = val;
+}
+
+template <class Bus, class Variant>
+inline void CPU<Bus, Variant>::set_c(bool value) {
+    flag_c = value;
+}
+
+template <class Bus, class Variant>
+inline void CPU<Bus, Variant>::set_v(bool value) {
+    flag_v_a = 0;
+    flag_v_b = 0;
+    flag_v_r = value ? 0x80 : 0;
+}
+
+template <class Bus, class Variant>
+inline void CPU<Bus, Variant>::set_overflow(uint8_t a, uint8_t b, uint8_t res) {
+    flag_v_a = a;
+    flag_v_b = b;
+    flag_v_r = res;
+}
+
+template <class Bus, class Variant>
+inline bool CPU<Bus, Variant>::get_n() {
+    return !!(flag_n & 0x80);
+}
+
+template <class Bus, class Variant>
+inline bool CPU<Bus, Variant>::get_z() {
+    return !flag_z;
+}
+
+template <class Bus, class Variant>
+inline bool CPU<Bus, Variant>::get_c() {
+    return flag_c;
+}
+
+template <class Bus, class Variant>
+inline bool CPU<Bus, Variant>::get_v() {
+    return !!((flag_v_a ^ flag_v_r) & (flag_v_b ^ flag_v_r) & 0x80);
+}
+
+template <class Bus, class Variant>
+uint8_t CPU<Bus, Variant>::status() {
+    uint8_t val = SR & ((1 << bs::I) | (1 << bs::D));
+    val |= (1 << bs::U);
+    val |= flag_n & 0x80;
+    val |= nz_table[flag_z] & (1 << bs::Z);
+    val |= get_v() << bs::O;
+    val |= get_c() << bs::C;
+    return val;
+}
+
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::set_status(uint8_t val) {
+    SR = (val & ((1 << bs::I) | (1 << bs::D))) | (1 << bs::U);
+    set_n(val);
+    set_z(!get_bit(val, bs::Z));
+    set_c(get_bit(val, bs::C));
+    set_v(get_bit(val, bs::O));
+}
+
+#else
 
-void CPU::set_overflow_flag_adc(uint8_t a, uint8_t b, uint8_t c = 0) { // TODO Check if this is right
-    uint8_t sum = a + b;
-    bool flag = ((a & 0x80) == (b & 0x80)) && ((b & 0x80) != (sum 0x80));
-    flag |= (sum == 0x7F) && c;
-    set_bit(SR, bs.O, flag);
+/* None of these branch, N and Z come out of nz_table */
+template <class Bus, class Variant>
+inline void CPU<Bus, Variant>::set_nz(uint8_t val) {
+    SR = (SR & ~((1 << bs::N) | (1 << bs::Z))) | nz_table[val];
 }
 
-void CPU::set_overflow_flag_sbc(uint8_t a, uint8_t b, uint8_t c = 0) { // TODO Check if this is right
-    uint8_t sub = a - b;
-    bool flag = ((a & 0x80) != (b & 0x80)) && ((a & 0x80) != (sub 0x80));
-    flag |= (sub == 0xFF) && c;
-    set_bit(SR, bs.O, flag);
+template <class Bus, class Variant>
+inline void CPU<Bus, Variant>::set_n(uint8_t val) {
+    SR = (SR & ~(1 << bs::N)) | (val & 0x80);
 }
 
+template <class Bus, class Variant>
+inline void CPU<Bus, Variant>::set_z(uint8_t val) {
+    SR = (SR & ~(1 << bs::Z)) | (nz_table[val] & (1 << bs::Z));
+}
+
+template <class Bus, class Variant>
+inline void CPU<Bus, Variant>::set_c(bool value) {
+    set_bit(SR, bs::C, value);
+}
+
+template <class Bus, class Variant>
+inline void CPU<Bus, Variant>::set_v(bool value) {
+    set_bit(SR, bs::O, value);
+}
+
+/* Overflow of res = a + b, it happens when both operands have the same
+ * sign and the result has the other one. Bit 7 of that is moved to V */
+template <class Bus, class Variant>
+inline void CPU<Bus, Variant>::set_overflow(uint8_t a, uint8_t b, uint8_t res) {
+    SR = (SR & ~(1 << bs::O)) | (((a ^ res) & (b ^ res) & 0x80) >> 1);
+}
+
+template <class Bus, class Variant>
+inline bool CPU<Bus, Variant>::get_n() {
+    return get_bit(SR, bs::N);
+}
+
+template <class Bus, class Variant>
+inline bool CPU<Bus, Variant>::get_z() {
+    return get_bit(SR, bs::Z);
+}
+
+template <class Bus, class Variant>
+inline bool CPU<Bus, Variant>::get_c() {
+    return get_bit(SR, bs::C);
+}
+
+template <class Bus, class Variant>
+inline bool CPU<Bus, Variant>::get_v() {
+    return get_bit(SR, bs::O);
+}
+
+template <class Bus, class Variant>
+uint8_t CPU<Bus, Variant>::status() {
+    return SR | (1 << bs::U);
+}
+
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::set_status(uint8_t val) {
+    SR = val;
+    set_bit(SR, bs::B, false); /* B and U only exist on the stack */
+    set_bit(SR, bs::U, true);
+}
+
+#endif
+
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::compare(uint8_t reg, uint8_t m) {
+    set_nz(reg - m);
+    set_c(reg >= m);
+}
+
+/* NMOS BCD addition. Z comes from the binary sum, N and V from the sum
+ * before the high digit gets adjusted, C from the adjusted one */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::add_decimal(uint8_t m) {
+    uint8_t c = get_c();
+    int low = (AC & 0x0F) + (m & 0x0F) + c;
+    if (low > 0x09)
+        low = ((low + 0x06) & 0x0F) + 0x10;
+    int sum = (AC & 0xF0) + (m & 0xF0) + low;
+
+    set_z((uint8_t)(AC + m + c));
+    set_n(sum);
+    set_overflow(AC, m, sum);
+    if (sum > 0x9F)
+        sum += 0x60;
+    set_c(sum > 0xFF);
+    AC = sum & 0xFF;
+}
+
+/* NMOS BCD subtraction. The flags are the ones of the binary subtraction,
+ * worked out here as ADC would with D set end up back in add_decimal */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::sub_decimal(uint8_t m) {
+    uint8_t c = get_c();
+    int low = (AC & 0x0F) - (m & 0x0F) + c - 1;
+    if (low < 0)
+        low = ((low - 0x06) & 0x0F) - 0x10;
+    int diff = (AC & 0xF0) - (m & 0xF0) + low;
+    if (diff < 0)
+        diff -= 0x60;
+
+    uint8_t n = ~m;
+    uint16_t temp = (uint16_t) AC + n + c;
+    set_overflow(AC, n, temp);
+    set_c(temp > 255);
+    set_nz(temp & 0x00FF);
+    AC = diff & 0xFF;
+}
+
+// Instructions
 /* This function will add and change the status flag 
  * ac = ac + m + c Where ac is the acumulator and C the bit of status
  * Changed bits = N, O, Z, C
  * */
-void CPU::ADC(const uint8_t m) {
-    c_bit = get_bit(SR, bs.C);
-    uint16_t temp = (uint16_t) AC + m + c_bit;
-    set_overflow_flag_adc(AC, m, c_bit);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::ADC(const uint8_t m) {
+    if constexpr (Variant::DECIMAL) {
+        if (get_bit(SR, bs::D)) {
+            add_decimal(m);
+            return;
+        }
+    }
+    uint16_t temp = (uint16_t) AC + m + get_c();
+    set_overflow(AC, m, temp);
     AC = temp & 0x00FF;
-    set_bit(SR, bs.C, temp > 255);
-    set_bit(SR, bs.Z, AC == 0);
-    set_bit(SR, bs.N, !!(AC & 0x80);
+    set_c(temp > 255);
+    set_nz(AC);
 }
 
-void CPU::AND(uint8_t m) {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::AND(uint8_t m) {
     AC &= m;
-    set_bit(SR, bs.N, !!(AC & 0x80));
-    set_bit(SR, bs.Z, !AC);
+    set_nz(AC);
 }
 
-uint8_t CPU::ASL(uint8_t val) {
-    set_bit(SR, bs.C, !!(val & 0x80));
+template <class Bus, class Variant>
+uint8_t CPU<Bus, Variant>::ASL(uint8_t val) {
+    set_c(!!(val & 0x80));
     val <<= 1;
-    set_bit(SR, bs.N, !!(val & 0x80));
-    set_bit(SR, bs.Z, val == 0);
+    set_nz(val);
     return val;
 }
 
-void CPU::BCC() {
-    addr_rel(!get_bit(SR, bs.C));
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::BCC() {
+    addr_rel(!get_c());
 }
 
-void CPU::BCS() {
-    addr_rel(get_bit(SR, bs.C));
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::BCS() {
+    addr_rel(get_c());
 }
 
-void CPU::BEQ() {
-    addr_rel(get_bit(SR, bs.Z));
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::BEQ() {
+    addr_rel(get_z());
 }
 
-void CPU::BIT(const uint8_t m) {
-    AC &= m;
-    set_bit(SR, bs.Z, AC == 0);
-    set_bit(SR, bs.N, get_bit(m, 7));
-    set_bit(SR, bs.O, get_bit(m, 6));
+/* Only tests the bits, AC is left as it was */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::BIT(const uint8_t m) {
+    set_z(AC & m);
+    set_n(m);
+    set_v(get_bit(m, 6));
 }
 
-void CPU::BMI() {
-    addr_rel(get_bit(SR, bs.N));
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::BMI() {
+    addr_rel(get_n());
 }
 
-void CPU::BNE() {
-    addr_rel(!get_bit(SR, bs.Z));
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::BNE() {
+    addr_rel(!get_z());
 }
 
-void CPU::BPL() {
-    addr_rel(!get_bit(SR, bs.N));
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::BPL() {
+    addr_rel(!get_n());
 }
 
-void CPU::BRK() {
-    uint16_t pc = PC;
-    bus->write(SP--, pc >> 8);
-    bus->write(SP--, pc & 0x00FF);
-    bus->write(SP--, SR);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::BRK() {
+    uint16_t pc = PC + 1; /* BRK is followed by a padding byte */
+    push(pc >> 8);
+    push(pc & 0x00FF);
+    push(status() | (1 << bs::B));
     PC = join_bytes(bus->read(0xFFFE), bus->read(0xFFFF));
-    SR = (1 << bs.I);
+    set_bit(SR, bs::I, true);
 }
 
-void CPU::BVC() {
-    addr_rel(!get_bit(SR, bs.V));
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::BVC() {
+    addr_rel(!get_v());
 }
 
-void CPU::BVS() {
-    addr_rel(get_bit(SR, bs.V));
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::BVS() {
+    addr_rel(get_v());
 }
 
-void CPU::CLC() {
-    set_bit(SR, bs.C, 0);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::CLC() {
+    set_c(false);
 }
 
-void CPU::CLD() {
-    set_bit(SR, bs.D, 0);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::CLD() {
+    set_bit(SR, bs::D, 0);
 }
 
-void CPU::CLI() {
-    set_bit(SR, bs.I, 0);
+/* The IRQ lines are looked at before I gets cleared, a pending IRQ is
+ * taken after the next instruction */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::CLI() {
+    if (irq_lines && get_bit(SR, bs::I)) {
+        irq_delayed = true;
+        events.interrupt();
+    }
+    set_bit(SR, bs::I, 0);
 }
 
-void CPU::CLV() {
-    set_bit(SR, bs.O, 0);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::CLV() {
+    set_v(false);
 }
 
-void CPU::CMP(uint8_t m) {
-    uint8_t comp = AC - m;
-    set_bit(SR, bs.N, !!(comp & 0x80));
-    set_bit(SR, bs.Z, !comp);
-    set_bit(SR, bs.C, ((uint16_t) AC - (uint16_t) m) != comp);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::CMP(uint8_t m) {
+    compare(AC, m);
 }
 
-void CPU::CPX(uint8_t m) {
-    uint8_t comp = X - m;
-    set_bit(SR, bs.N, !!(comp & 0x80));
-    set_bit(SR, bs.Z, !comp);
-    set_bit(SR, bs.C, ((uint16_t) X - (uint16_t) m) != comp);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::CPX(uint8_t m) {
+    compare(X, m);
 }
 
-void CPU::CPY(uint8_t m) {
-    uint8_t comp = Y - m;
-    set_bit(SR, bs.N, !!(comp & 0x80));
-    set_bit(SR, bs.Z, !comp);
-    set_bit(SR, bs.C, ((uint16_t) Y - (uint16_t) m) != comp);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::CPY(uint8_t m) {
+    compare(Y, m);
 }
 
-void CPU::DEC(uint16_t memory_location) {
-    uint8_t val = read(memory_location) - 1;
-    set_bit(SR, bs.N, !!(val & 0x80));
-    set_bit(SR, bs.Z, !val);
-    bus->write(memory_location, val);
+template <class Bus, class Variant>
+uint8_t CPU<Bus, Variant>::DEC(uint8_t val) {
+    val--;
+    set_nz(val);
+    return val;
 }
 
-void CPU::DEX() {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::DEX() {
     X--;
-    set_bit(SR, bs.N, !!(X & 0x80));
-    set_bit(SR, bs.Z, !X);
+    set_nz(X);
 }
 
-void CPU::DEY() {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::DEY() {
     Y--;
-    set_bit(SR, bs.N, !!(Y & 0x80));
-    set_bit(SR, bs.Z, !Y);
+    set_nz(Y);
 }
 
-void CPU::EOR(uint8_t m) {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::EOR(uint8_t m) {
     AC ^= m;
-    set_bit(SR, bs.N, !!(AC & 0x80));
-    set_bit(SR, bs.Z, !AC);
+    set_nz(AC);
 }
 
-void CPU::INC(uint16_t memory_location) {
-    uint8_t val = read(memory_location);
+template <class Bus, class Variant>
+uint8_t CPU<Bus, Variant>::INC(uint8_t val) {
     val++;
-    set_bit(SR, bs.N, !!(val &0x80));
-    set_bit(SR, bs.Z, !val);
-    bus->write(memory_location, val);
+    set_nz(val);
+    return val;
 }
 
-void CPU::INX() {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::INX() {
     X++;
+    set_nz(X);
 }
 
-void CPU::INY() {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::INY() {
     Y++;
+    set_nz(Y);
 }
 
-void CPU::JMP(uint16_t memory_location) {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::JMP(uint16_t memory_location) {
     PC = memory_location;
 }
 
-void CPU::JSR(uint16_t memory_location) {
-    bus->write(SP--, PC >> 8);
-    bus->write(SP--, PC & 0x00FF);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::JSR(uint16_t memory_location) {
+    uint16_t pc = PC - 1; /* Last byte of the JSR, RTS adds the missing one */
+    push(pc >> 8);
+    push(pc & 0x00FF);
     PC = memory_location;
 }
 
-void CPU::LDA(uint8_t m) {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::LDA(uint8_t m) {
     AC = m;
-    set_bit(SR, bs.N, !!(AC &0x80));
-    set_bit(SR, bs.Z, !AC);
+    set_nz(AC);
 }
 
-void CPU::LDX(uint8_t m) {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::LDX(uint8_t m) {
     X = m;
-    set_bit(SR, bs.N, !!(X &0x80));
-    set_bit(SR, bs.Z, !X);
+    set_nz(X);
 }
 
-void CPU::LDY(uint8_t m) {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::LDY(uint8_t m) {
     Y = m;
-    set_bit(SR, bs.N, !!(Y &0x80));
-    set_bit(SR, bs.Z, !Y);
+    set_nz(Y);
 }
 
-/* Only works for memory, not with acumulator */
-void CPU::LSR(uint16_t memory_location) {
-    uint8_t val = bus->read(memory_location);
-    set_bit(SR, bs.C, !!(val & 0x1));
+template <class Bus, class Variant>
+uint8_t CPU<Bus, Variant>::LSR(uint8_t val) {
+    set_c(!!(val & 0x1));
     val >>= 1;
-    set_bit(SR, bs.Z, !val);
-    set_bit(SR, bs.N, false);
-    bus->write(memory_location, val);
+    set_nz(val);
+    return val;
 }
 
-void CPU::NOP() {}
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::NOP() {}
 
-void CPU::ORA(uint8_t m) {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::ORA(uint8_t m) {
     AC |= m;
-    set_bit(SR, bs.Z, !AC);
-    set_bit(SR, bs.N, !!(AC & 0x80));
+    set_nz(AC);
 }
 
-void CPU::PHA() {
-    bus->write(SP--, AC);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::PHA() {
+    push(AC);
 }
 
-void CPU:PHP() {
-    bus->write(SP--, SR);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::PHP() {
+    push(status() | (1 << bs::B));
 }
 
-void CPU::PLA() {
-    uint8_t val = bus->read(SP++);
-    set_bit(SR, bs.N, !!(val & 0x80));
-    set_bit(SR, bs.Z, !val);
-    AC = val;
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::PLA() {
+    AC = pop();
+    set_nz(AC);
 }
 
-void CPU::PLP() {
-    uint8_t val = bus->read(SP++);
-    set_bit(SR, bs.N, !!(val & 0x80));
-    set_bit(SR, bs.Z, !val);
-    SR = val;
+/* Same delay as CLI when I gets cleared */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::PLP() {
+    bool masked = get_bit(SR, bs::I);
+    set_status(pop());
+    if (irq_lines && !get_bit(SR, bs::I)) {
+        irq_delayed = masked;
+        events.interrupt();
+    }
 }
 
-uint8_t CPU::ROL(uint8_t val) {
-    bool carry = get_bit(SR, bs.C);
-    set_bit(SR, bs.C, !!(val & 0x80));
+template <class Bus, class Variant>
+uint8_t CPU<Bus, Variant>::ROL(uint8_t val) {
+    bool carry = get_c();
+    set_c(!!(val & 0x80));
     val <<= 1;
     val |= carry;
-    set_bit(SR, bs.Z, !val);
-    set_bit(SR, bs.N, !!(val & 0x80));
+    set_nz(val);
     return val;
 }
 
-void CPU::ROL(uint16_t memory_location) {
-    uint8_t val = bus->read(memory_location);
-    bus->write(memory_location, ROL(val));
-}
-
-void CPU::ROR(uint8_t val) {
-    bool carry = get_bit(SR, bs.C);
-    set_bit(SR, bs.C, !!(val & 0x1));
+template <class Bus, class Variant>
+uint8_t CPU<Bus, Variant>::ROR(uint8_t val) {
+    bool carry = get_c();
+    set_c(!!(val & 0x1));
     val >>= 1;
     if (carry)
         val |= 0x80;
-    set_bit(SR, bs.Z, !val);
-    set_bit(SR, bs.N, carry);
-}
-
-void CPU::ROR(uint16_t memory_location) {
-    uint8_t val = bus->read(memory_location);
-    bus->write(memory_location, ROL(val));
+    set_nz(val);
+    return val;
 }
 
-void CPU::RTI() {
-    SP++; /* SP is on the place to write, not to read */
-    SR = bus->read(SP++);
-    uint8_t low_byte = bus->read(SP++);
-    uint8_t high_byte = bus->read(SP++);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::RTI() {
+    set_status(pop());
+    if (irq_lines && !get_bit(SR, bs::I))
+        events.interrupt();
+    uint8_t low_byte = pop();
+    uint8_t high_byte = pop();
     PC = join_bytes(low_byte, high_byte);
 }
 
-void CPU::RTS() {
-    SP++;
-    uint8_t low_byte = bus->read(SP++);
-    uint8_t high_byte = bus->read(SP++);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::RTS() {
+    uint8_t low_byte = pop();
+    uint8_t high_byte = pop();
     PC = join_bytes(low_byte, high_byte);
-    PC++; // TODO Is this right?
+    PC++;
 }
-//TODO Add opcodes from here
 
-void CPU::SBC(uint8_t m) {
-    bool carry = get_bit(SR, bs.C);
-    uint16_t right_ans = (uint16_t) AC - (uint16_t)m - (uint16_t)carry;
-    set_overflow_flag_sbc(AC, m, carry);
-    AC -= m - carry;
-    set_bit(SR, bs.C, right_ans != AC);
-    set_bit(SR, bs.N, !!(AC & 0x80));
-    set_bit(SR, bs.Z, !AC);
+/* ac - m - !c is the same as ac + ~m + c */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::SBC(uint8_t m) {
+    if constexpr (Variant::DECIMAL) {
+        if (get_bit(SR, bs::D)) {
+            sub_decimal(m);
+            return;
+        }
+    }
+    ADC(~m);
 }
 
-void CPU::SEC() {
-    set_bit(SR, bs.C, true);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::SEC() {
+    set_c(true);
 }
 
-void CPU::SED() {
-    set_bit(SR, bs.D, true);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::SED() {
+    set_bit(SR, bs::D, true);
 }
 
-void CPU::SEI() {
-    set_bit(SR, bs.I, true);
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::SEI() {
+    set_bit(SR, bs::I, true);
 }
 
-void CPU::STA(uint16_t memory_location) {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::STA(uint16_t memory_location) {
     bus->write(memory_location, AC);
 }
 
-void CPU::STX(uint16_t memory_location) {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::STX(uint16_t memory_location) {
     bus->write(memory_location, X);
 }
 
-void CPU::STY(uint16_t memory_location) {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::STY(uint16_t memory_location) {
     bus->write(memory_location, Y);
 }
 
-void CPU::TAX() {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::TAX() {
     X = AC;
-    set_bit(SR, bs.Z, !X);
-    set_bit(SR, bs.N, !!(X & 0x80));
+    set_nz(X);
 }
 
-void CPU::TAY() {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::TAY() {
     Y = AC;
-    set_bit(SR, bs.Z, !Y);
-    set_bit(SR, bs.N, !!(Y & 0x80));
+    set_nz(Y);
 }
 
-void CPU::TSX() {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::TSX() {
     X = SP;
-    set_bit(SR, bs.Z, !X);
-    set_bit(SR, bs.N, !!(X & 0x80));
+    set_nz(X);
 }
 
-void CPU::TXA() {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::TXA() {
     AC = X;
-    set_bit(SR, bs.Z, !AC);
-    set_bit(SR, bs.N, !!(AC & 0x80));
+    set_nz(AC);
 }
 
-void CPU::TXS() {
+/* The only transfer that leaves the flags alone */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::TXS() {
     SP = X;
-    set_bit(SR, bs.Z, !SP);
-    set_bit(SR, bs.N, !!(SP & 0x80));
 }
 
-void CPU::TYA() {
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::TYA() {
     AC = Y;
-    set_bit(SR, bs.Z, !AC);
-    set_bit(SR, bs.N, !!(AC & 0x80));
-}
-
-void CPU::exec(const uint8_t op_code) {
-    switch(op_code) {
-        case 0x00 :
-            BRK();
-            this->cycles += 7;
-            break;
-        case 0x01 :
-            ORA(read(addr_indr_x));
-            this->cycles += 6;
-            break;
-        case 0x05 :
-            ORA(read(addr_zpg));
-            this->cycles += 3;
-            break;
-        case 0x06 :
-            uint16_t mem_location = addr_zpg();
-            uint8_t val = bus->read(mem_location);
-            bus->write(mem_location, ASL(val));
-            this->cycles += 5;
-            break;
-        case 0x08 :
-            PHP();
-            this->cycles += 3;
-            break;
-        case 0x09 :
-            ORA(read(addr_imd));
-            this->cycles += 2;
-            break;
-        case 0x0A :
-            uint8_t val = ASL(AC);
-            AC = val;
-            this->cycles += 2;
-            break;
-        case 0x0D :
-            ORA(read(addr_abs));
-            this->cycles += 4;
-            break;
-        case 0x0E :
-            uint16_t mem_location = addr_abs();
-            uint8_t val = bus->read(mem_location);
-            bus->write(mem_location, ASL(val));
-            this->cycles += 6;
-            break;
-        case 0x10 :
-            BPL();
-            this->cycles += 2;
-            break;
-        case 0x11 :
-            ORA(read(addr_indr_y));
-            this->cycles += 5;
-            break;
-        case 0x15 :
-            ORA(read(addr_zpg_x));
-            this->cycles += 4;
-            break;
-        case 0x16 :
-            uint16_t mem_location = addr_zpg_x();
-            uint8_t val = bus->read(mem_location);
-            bus->write(mem_location, ASL(val));
-            this->cycles += 6;
-            break;
-        case 0x18 :
-            CLC();
-            this->cycles += 2;
-            break;
-        case 0x19 :
-            ORA(read(addr_abs_y));
-            this->cycles += 4;
-            break;
-        case 0x1D :
-            ORA(read(addr_abs_x));
-            this->cycles += 4;
-            break;
-        case 0x1E :
-            uint16_t mem_location = addr_abs_x();
-            uint8_t val = bus->read(mem_location);
-            bus->write(mem_location, ASL(val));
-            this->cycles += 7;
-            break;
-        case 0x20 :
-            JSR(addr_abs());
-            this->cycles += 6;
-            break;
-        case 0x21 :
-            AND(read(addr_indr_x));
-            this->cycles += 6;
-            break;
-        case 0x24 :
-            BIT(read(addr_zpg));
-            this->cycles += 3;
-            break;
-        case 0x25 :
-            AND(read(addr_zpg));
-            this->cycles += 3;
-            break;
-        case 0x26 :
-            ROL(addr_zpg());
-            this->cycles += 5;
-            break;
-        case 0x28 :
-            PLP();
-            this->cycles += 4;
-            break;
-        case 0x29 :
-            AND(read(addr_imd));
-            this->cycles += 2;
-            break;
-        case 0x2A :
-            AC = ROL(AC);
-            this->cycles += 2;
-            break;
-        case 0x2C :
-            BIT(read(addr_abs));
-            this->cycles += 4;
-            break;
-        case 0x2D :
-            AND(read(addr_abs));
-            this->cycles += 4;
-            break;
-        case 0x2E :
-            ROL(addr_abs());
-            this->cycles += 6;
-            break;
-        case 0x30 :
-            BMI();
-            this->cycles += 2;
-            break;
-        case 0x31 :
-            AND(read(addr_indr_y));
-            this->cycles += 5;
-            break;
-        case 0x35 :
-            AND(read(addr_zpg_x));
-            this->cycles += 4;
-            break;
-        case 0x36 :
-            ROL(addr_zpg_x());
-            this->cycles += 6;
-            break;
-        case 0x38 :
-            SEC();
-            this->cycles += 2;
-            break;
-        case 0x39 :
-            AND(read(addr_abs_y));
-            this->cycles += 4;
-            break;
-        case 0x3D :
-            AND(read(addr_abs_x));
-            this->cycles += 4;
-            break;
-        case 0x3E :
-            ROL(addr_abs_x());
-            this->cycles += 7;
-            break;
-        case 0x40 :
-            RTI();
-            this->cycles += 6;
-            break;
-        case 0x41 :
-            EOR(read(addr_indr_x));
-            this->cycles += 6;
-            break;
-        case 0x45 :
-            EOR(read(addr_zpg));
-            this->cycles += 3;
-            break;
-        case 0x46 :
-            LSR(addr_zpg());
-            this->cycles += 5;
-            break;
-        case 0x48 :
-            PHA();
-            this->cycles += 3;
-            break;
-        case 0x49 :
-            EOR(read(addr_imd));
-            this->cycles += 2;
-            break;
-        case 0x4A :
-            set_bit(SR, bs.C, !!(AC & 0x1));
-            AC >>= 1;
-            set_bit(SR, bs.Z, !AC);
-            set_bit(SR, bs.N, false);
-            this->cycles += 2;
-            break;
-        case 0x4C :
-            JMP(addr_abs());
-            this->cycles += 3;
-            break;
-        case 0x4D :
-            EOR(read(addr_abs));
-            this->cycles += 4;
-            break;
-        case 0x4E :
-            LSR(addr_abs());
-            this->cycles += 6;
-            break;
-        case 0x50 :
-            BVC();
-            this->cycles += 2;
-            break;
-        case 0x51 :
-            EOR(read(addr_indr_y));
-            this->cycles += 5;
-            break;
-        case 0x55 :
-            EOR(read(addr_zpg_x));
-            this->cycles += 4;
-            break;
-        case 0x56 :
-            LSR(addr_zpg_x());
-            this->cycles += 6;
-            break;
-        case 0x58 :
-            CLI();
-            this->cycles += 2;
-            break;
-        case 0x59 :
-            EOR(read(addr_abs_y));
-            this->cycles += 4;
-            break;
-        case 0x5D :
-            EOR(read(addr_abs_x));
-            this->cycles += 4;
-            break;
-        case 0x5E :
-            LSR(addr_abs_x());
-            this->cycles += 7;
-            break;
-        case 0x60 :
-            RTS();
-            this->cycles += 6;
-            break;
-        case 0x61 :
-            ADC(read(addr_indr_x));
-            this->cycles += 6;
-            break;
-        case 0x65 :
-            ADC(read(addr_zpg));
-            this->cycles += 3;
-            break;
-        case 0x66 :
-            ROR(addr_zpg());
-            this->cycles += 5;
-            break;
-        case 0x68 :
-            PLA();
-            this->cycles += 4;
-            break;
-        case 0x69 :
-            ADC(read(addr_imd));
-            this->cycles += 2;
-            break;
-        case 0x6A :
-            AC = ROR(AC);
-            this->cycles += 2;
-            break;
-        case 0x6C :
-            JMP(addr_indr());
-            this->cycles += 5;
-            break;
-        case 0x6D :
-            ADC(read(addr_abs));
-            this->cycles += 4;
-            break;
-        case 0x6E :
-            ROR(addr_abs());
-            this->cycles += 6;
-            break;
-        case 0x70 :
-            BVS();
-            this->cycles += 2;
-            break;
-        case 0x71 :
-            ADC(read(addr_indr_y));
-            this->cycles += 5;
-            break;
-        case 0x75 :
-            ADC(read(addr_zpg_x));
-            this->cycles += 4;
-            break;
-        case 0x76 :
-            ROR(addr_zpg_x());
-            this->cycles += 6;
-            break;
-        case 0x78 :
-            SEI();
-            this->cycles += 2;
-            break;
-        case 0x79 :
-            ADC(read(addr_abs_y));
-            this->cycles += 4;
-            break;
-        case 0x7D :
-            ADC(read(addr_abs_x));
-            this->cycles += 4;
-            break;
-        case 0x7E :
-            ROR(addr_abs_x());
-            this->cycles += 7;
-            break;
-        case 0x81 :
-            STA(addr_indr_x());
-            this->cycles += 6;
-            break;
-        case 0x84 :
-            STY(addr_zpg());
-            this->cycles += 3;
-            break;
-        case 0x85 :
-            STA(addr_zpg());
-            this->cycles += 3;
-            break;
-        case 0x86 :
-            STX(addr_zpg());
-            this->cycles += 3;
-            break;
-        case 0x88 :
-            DEY();
-            this->cycles += 2;
-            break;
-        case 0x8A :
-            TXA();
-            this->cycles += 2;
-            break;
-        case 0x8C :
-            STY(addr_abs());
-            this->cycles += 4;
-            break;
-        case 0x8D :
-            STA(addr_abs());
-            this->cycles += 4;
-            break;
-        case 0x8E :
-            STX(addr_abs());
-            this->cycles += 4;
-            break;
-        case 0x90 :
-            BCC();
-            this->cycles += 2;
-            break;
-        case 0x91 :
-            STA(addr_indr_y());
-            this->cycles += 6;
-            break;
-        case 0x94 :
-            STY(addr_zpg_x());
-            this->cycles += 4;
-            break;
-        case 0x95 :
-            STA(addr_zpg_x());
-            this->cycles += 4;
-            break;
-        case 0x96 :
-            STX(addr_zpg_x());
-            this->cycles += 4;
-            break;
-        case 0x98 :
-            TYA();
-            this->cycles += 2;
-            break;
-        case 0x99 :
-            STA(addr_abs_y());
-            this->cycles += 5;
-            break;
-        case 0x9A :
-            TXS();
-            this->cycles += 2;
-            break;
-        case 0x9D :
-            STA(addr_abs_x());
-            this->cycles += 5;
-            break;
-        case 0xA0 :
-            LDY(read(add_imd));
-            this->cycles += 2;
-            break;
-        case 0xA1 :
-            LDA(read(addr_indr_x));
-            this->cycles += 6;
-            break;
-        case 0xA2 :
-            LDX(read(addr_imd));
-            this->cycles += 2;
-            break;
-        case 0xA4 :
-            LDY(read(addr_zpg));
-            this->cycles += 3;
-            break;
-        case 0xA5 :
-            LDA(read(addr_zpg));
-            this->cycles += 3;
-            break;
-        case 0xA6 :
-            LDX(read(addr_zpg));
-            this->cycles += 3;
-            break;
-        case 0xA8 :
-            TAY();
-            this->cycles += 2;
-            break;
-        case 0xA9 :
-            LDA(read(addr_imd));
-            this->cycles += 2;
-            break;
-        case 0xAA :
-            TAX();
-            this->cycles += 2;
-            break;
-        case 0xAC :
-            LDY(read(addr_abs));
-            this->cycles += 4;
-            break;
-        case 0xAD :
-            LDA(read(addr_abs));
-            this->cycles += 4;
-            break;
-        case 0xAE :
-            LDX(read(addr_abs));
-            this->cycles += 4;
-            break;
-        case 0xB0 :
-            BCS();
-            this->cycles += 2;
-            break;
-        case 0xB1 :
-            LDA(read(addr_indr_y));
-            this->cycles += 5;
-            break;
-        case 0xB4 :
-            LDY(read(addr_zpg_x));
-            this->cycles += 4;
-            break;
-        case 0xB5 :
-            LDA(read(addr_zpg_x));
-            this->cycles += 4;
-            break;
-        case 0xB6 :
-            LDX(read(addr_zpg_y));
-            this->cycles += 4;
-            break;
-        case 0xB8 :
-            CLV();
-            this->cycles += 2;
-            break;
-        case 0xB9 :
-            LDA(read(addr_abs_y));
-            this-cycles += 4;
-            break;
-        case 0xBA :
-            TSX();
-            this->cycles += 2;
-            break;
-        case 0xBC :
-            LDY(read(addr_abs_x));
-            this->cycles += 4;
-            break;
-        case 0xBD :
-            LDA(read(addr_abs_x));
-            this->cycles += 4;
-            break;
-        case 0xBE :
-            LDX(read(addr_abs_y));
-            this->cycles += 4;
-            break;
-        case 0xC0 :
-            CPY(read(addr_imd));
-            this->cycles += 2;
-            break;
-        case 0xC1 :
-            CMP(read(addr_indr_x));
-            this->cycles += 6;
-            break;
-        case 0xC4 :
-            CPY(read(addr_zpg));
-            this->cycles += 3;
-            break;
-        case 0xC5 :
-            CMP(read(addr_zpg));
-            this->cycles += 3;
-            break;
-        case 0xC6 :
-            DEC(addr_zpg());
-            this->cycles += 5;
-            break;
-        case 0xC8 :
-            INY();
-            this->cycles += 2;
-            break;
-        case 0xC9 :
-            CMP(read(addr_imd));
-            this->cycles += 2;
-            break;
-        case 0xCA :
-            DEX();
-            this->cycles += 2;
-            break;
-        case 0xCC :
-            CPY(read(addr_abs));
-            this->cycles += 4;
-            break;
-        case 0xCD :
-            CMP(read(addr_abs));
-            this->cycles += 4;
-            break;
-        case 0xCE :
-            DEC(addr_abs());
-            this->cycles += 6;
-            break;
-        case 0xD0 :
-            BNE();
-            this->cycles += 2;
-            break;
-        case 0xD1 :
-            CMP(read(addr_indr_y));
-            this->cycles += 5;
-            break;
-        case 0xD5 :
-            CMP(read(addr_zpg_x));
-            this->cycles += 4;
-            break;
-        case 0xD6 :
-            DEC(addr_zpg_x());
-            this->cycles += 6;
-            break;
-        case 0xD8 :
-            CLD();
-            this->cycles += 2;
-            break;
-        case 0xD9 :
-            CMP(read(addr_abs_y));
-            this->cycles += 4;
-            break;
-        case 0xDD :
-            CMP(read(addr_abs_x));
-            this->cycles += 4;
-            break;
-        case 0xDE :
-            DEC(addr_abs_x());
-            this->cycles += 7;
-            break;
-        case 0xE0 :
-            CPX(read(addr_imd));
-            this->cycles += 2;
-            break;
-        case 0xE1 :
-            SBC(read(addr_indr_x));
-            this->cycles += 6;
-            break;
-        case 0xE4 :
-            CPX(read(addr_zpg));
-            this->cycles += 3;
-            break;
-        case 0xE5 :
-            SBC(read(addr_zpg));
-            this_cycles += 3;
-            break;
-        case 0xE6 :
-            INC(addr_zpg());
-            this->cycles += 5;
-            break;
-        case 0xE8 :
-            INX();
-            this->cycles += 2;
-            break;
-        case 0xE9 :
-            SBC(read(addr_imd));
-            this->cycles += 2;
-            break;
-        case 0xEA :
-            NOP();
-            this->cycles += 2;
-            break;
-        case 0xEC :
-            CPX(read(addr_abs));
-            this->cycles += 4;
-            break;
-        case 0xED :
-            SBC(read(addr_abs));
-            this->cycles += 4;
-            break;
-        case 0xEE :
-            INC(addr_abs());
-            this->cycles += 6;
-            break;
-        case 0xF1 :
-            SBC(read(addr_indr_y));
-            this->cycles += 5;
-            break;
-        case 0xF5 :
-            SBC(read(addr_zpg_x));
-            this->cycles += 4;
-            break;
-        case 0xF6 :
-            INC(addr_zpg_x());
-            this->cycles += 6;
-            break;
-        case 0xF8 :
-            SED();
-            this->cycles += 2;
-            break;
-        case 0xF9 :
-            SBC(read(addr_abs_y));
-            this->cycles += 4;
-            break;
-        case 0xFD :
-            SBC(read(addr_abs_x));
-            this->cycles += 4;
-            break;
-        case 0xFE :
-            INC(addr_abs_x());
-            this->cycles += 7;
-            break;
+    set_nz(AC);
+}
+
+// Opcode Table
+/* Loads the operand through the addressing mode and hands it to the instruction.
+ * Indexed reads take one more cycle when the index crosses a page, stores
+ * and read-modify-write instructions always take it so it is in their base cycles.
+ * The extra cycle comes before the read, which is the last cycle */
+template <class Bus, class Variant>
+template <uint16_t (CPU<Bus, Variant>::*mode)(), void (CPU<Bus, Variant>::*op)(uint8_t)>
+void CPU<Bus, Variant>::read_op(CPU &cpu) {
+    uint16_t mem_location = (cpu.*mode)();
+    if constexpr (mode == &CPU::addr_abs_x || mode == &CPU::addr_abs_y || mode == &CPU::addr_indr_y)
+        cpu.cycles += cpu.page_crossed;
+    (cpu.*op)(cpu.bus->read(mem_location));
+}
+
+/* Hands the address of the operand to the instruction (stores and jumps) */
+template <class Bus, class Variant>
+template <uint16_t (CPU<Bus, Variant>::*mode)(), void (CPU<Bus, Variant>::*op)(uint16_t)>
+void CPU<Bus, Variant>::addr_op(CPU &cpu) {
+    (cpu.*op)((cpu.*mode)());
+}
+
+/* Read, modify and write back the operand. The 6502 writes the value it
+ * read back first, on the cycle before the result: devices see both
+ * writes (the MMC1 ignores the second one) */
+template <class Bus, class Variant>
+template <uint16_t (CPU<Bus, Variant>::*mode)(), uint8_t (CPU<Bus, Variant>::*op)(uint8_t)>
+void CPU<Bus, Variant>::modify_op(CPU &cpu) {
+    uint16_t mem_location = (cpu.*mode)();
+    cpu.cycles -= 2;
+    uint8_t val = cpu.bus->read(mem_location);
+    cpu.cycles++;
+    cpu.bus->write(mem_location, val);
+    cpu.cycles++;
+    cpu.bus->write(mem_location, (cpu.*op)(val));
+}
+
+/* Same as modify_op but working on the acumulator */
+template <class Bus, class Variant>
+template <uint8_t (CPU<Bus, Variant>::*op)(uint8_t)>
+void CPU<Bus, Variant>::acc_op(CPU &cpu) {
+    cpu.AC = (cpu.*op)(cpu.AC);
+}
+
+template <class Bus, class Variant>
+template <void (CPU<Bus, Variant>::*op)()>
+void CPU<Bus, Variant>::implied_op(CPU &cpu) {
+    (cpu.*op)();
+}
+
+/* Unofficial opcodes are not emulated, they behave as a NOP */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::illegal_op(CPU &) {}
+
+template <class Bus, class Variant>
+constexpr std::array<typename CPU<Bus, Variant>::instruction, 256> CPU<Bus, Variant>::make_op_table() {
+    std::array<handler, 256> handlers {};
+    for (handler &h : handlers)
+        h = &illegal_op;
+
+    handlers[0x00] = &implied_op<&CPU::BRK>;
+    handlers[0x01] = &read_op<&CPU::addr_indr_x, &CPU::ORA>;
+    handlers[0x05] = &read_op<&CPU::addr_zpg, &CPU::ORA>;
+    handlers[0x06] = &modify_op<&CPU::addr_zpg, &CPU::ASL>;
+    handlers[0x08] = &implied_op<&CPU::PHP>;
+    handlers[0x09] = &read_op<&CPU::addr_imd, &CPU::ORA>;
+    handlers[0x0A] = &acc_op<&CPU::ASL>;
+    handlers[0x0D] = &read_op<&CPU::addr_abs, &CPU::ORA>;
+    handlers[0x0E] = &modify_op<&CPU::addr_abs, &CPU::ASL>;
+    handlers[0x10] = &implied_op<&CPU::BPL>;
+    handlers[0x11] = &read_op<&CPU::addr_indr_y, &CPU::ORA>;
+    handlers[0x15] = &read_op<&CPU::addr_zpg_x, &CPU::ORA>;
+    handlers[0x16] = &modify_op<&CPU::addr_zpg_x, &CPU::ASL>;
+    handlers[0x18] = &implied_op<&CPU::CLC>;
+    handlers[0x19] = &read_op<&CPU::addr_abs_y, &CPU::ORA>;
+    handlers[0x1D] = &read_op<&CPU::addr_abs_x, &CPU::ORA>;
+    handlers[0x1E] = &modify_op<&CPU::addr_abs_x, &CPU::ASL>;
+    handlers[0x20] = &addr_op<&CPU::addr_abs, &CPU::JSR>;
+    handlers[0x21] = &read_op<&CPU::addr_indr_x, &CPU::AND>;
+    handlers[0x24] = &read_op<&CPU::addr_zpg, &CPU::BIT>;
+    handlers[0x25] = &read_op<&CPU::addr_zpg, &CPU::AND>;
+    handlers[0x26] = &modify_op<&CPU::addr_zpg, &CPU::ROL>;
+    handlers[0x28] = &implied_op<&CPU::PLP>;
+    handlers[0x29] = &read_op<&CPU::addr_imd, &CPU::AND>;
+    handlers[0x2A] = &acc_op<&CPU::ROL>;
+    handlers[0x2C] = &read_op<&CPU::addr_abs, &CPU::BIT>;
+    handlers[0x2D] = &read_op<&CPU::addr_abs, &CPU::AND>;
+    handlers[0x2E] = &modify_op<&CPU::addr_abs, &CPU::ROL>;
+    handlers[0x30] = &implied_op<&CPU::BMI>;
+    handlers[0x31] = &read_op<&CPU::addr_indr_y, &CPU::AND>;
+    handlers[0x35] = &read_op<&CPU::addr_zpg_x, &CPU::AND>;
+    handlers[0x36] = &modify_op<&CPU::addr_zpg_x, &CPU::ROL>;
+    handlers[0x38] = &implied_op<&CPU::SEC>;
+    handlers[0x39] = &read_op<&CPU::addr_abs_y, &CPU::AND>;
+    handlers[0x3D] = &read_op<&CPU::addr_abs_x, &CPU::AND>;
+    handlers[0x3E] = &modify_op<&CPU::addr_abs_x, &CPU::ROL>;
+    handlers[0x40] = &implied_op<&CPU::RTI>;
+    handlers[0x41] = &read_op<&CPU::addr_indr_x, &CPU::EOR>;
+    handlers[0x45] = &read_op<&CPU::addr_zpg, &CPU::EOR>;
+    handlers[0x46] = &modify_op<&CPU::addr_zpg, &CPU::LSR>;
+    handlers[0x48] = &implied_op<&CPU::PHA>;
+    handlers[0x49] = &read_op<&CPU::addr_imd, &CPU::EOR>;
+    handlers[0x4A] = &acc_op<&CPU::LSR>;
+    handlers[0x4C] = &addr_op<&CPU::addr_abs, &CPU::JMP>;
+    handlers[0x4D] = &read_op<&CPU::addr_abs, &CPU::EOR>;
+    handlers[0x4E] = &modify_op<&CPU::addr_abs, &CPU::LSR>;
+    handlers[0x50] = &implied_op<&CPU::BVC>;
+    handlers[0x51] = &read_op<&CPU::addr_indr_y, &CPU::EOR>;
+    handlers[0x55] = &read_op<&CPU::addr_zpg_x, &CPU::EOR>;
+    handlers[0x56] = &modify_op<&CPU::addr_zpg_x, &CPU::LSR>;
+    handlers[0x58] = &implied_op<&CPU::CLI>;
+    handlers[0x59] = &read_op<&CPU::addr_abs_y, &CPU::EOR>;
+    handlers[0x5D] = &read_op<&CPU::addr_abs_x, &CPU::EOR>;
+    handlers[0x5E] = &modify_op<&CPU::addr_abs_x, &CPU::LSR>;
+    handlers[0x60] = &implied_op<&CPU::RTS>;
+    handlers[0x61] = &read_op<&CPU::addr_indr_x, &CPU::ADC>;
+    handlers[0x65] = &read_op<&CPU::addr_zpg, &CPU::ADC>;
+    handlers[0x66] = &modify_op<&CPU::addr_zpg, &CPU::ROR>;
+    handlers[0x68] = &implied_op<&CPU::PLA>;
+    handlers[0x69] = &read_op<&CPU::addr_imd, &CPU::ADC>;
+    handlers[0x6A] = &acc_op<&CPU::ROR>;
+    handlers[0x6C] = &addr_op<&CPU::addr_indr, &CPU::JMP>;
+    handlers[0x6D] = &read_op<&CPU::addr_abs, &CPU::ADC>;
+    handlers[0x6E] = &modify_op<&CPU::addr_abs, &CPU::ROR>;
+    handlers[0x70] = &implied_op<&CPU::BVS>;
+    handlers[0x71] = &read_op<&CPU::addr_indr_y, &CPU::ADC>;
+    handlers[0x75] = &read_op<&CPU::addr_zpg_x, &CPU::ADC>;
+    handlers[0x76] = &modify_op<&CPU::addr_zpg_x, &CPU::ROR>;
+    handlers[0x78] = &implied_op<&CPU::SEI>;
+    handlers[0x79] = &read_op<&CPU::addr_abs_y, &CPU::ADC>;
+    handlers[0x7D] = &read_op<&CPU::addr_abs_x, &CPU::ADC>;
+    handlers[0x7E] = &modify_op<&CPU::addr_abs_x, &CPU::ROR>;
+    handlers[0x81] = &addr_op<&CPU::addr_indr_x, &CPU::STA>;
+    handlers[0x84] = &addr_op<&CPU::addr_zpg, &CPU::STY>;
+    handlers[0x85] = &addr_op<&CPU::addr_zpg, &CPU::STA>;
+    handlers[0x86] = &addr_op<&CPU::addr_zpg, &CPU::STX>;
+    handlers[0x88] = &implied_op<&CPU::DEY>;
+    handlers[0x8A] = &implied_op<&CPU::TXA>;
+    handlers[0x8C] = &addr_op<&CPU::addr_abs, &CPU::STY>;
+    handlers[0x8D] = &addr_op<&CPU::addr_abs, &CPU::STA>;
+    handlers[0x8E] = &addr_op<&CPU::addr_abs, &CPU::STX>;
+    handlers[0x90] = &implied_op<&CPU::BCC>;
+    handlers[0x91] = &addr_op<&CPU::addr_indr_y, &CPU::STA>;
+    handlers[0x94] = &addr_op<&CPU::addr_zpg_x, &CPU::STY>;
+    handlers[0x95] = &addr_op<&CPU::addr_zpg_x, &CPU::STA>;
+    handlers[0x96] = &addr_op<&CPU::addr_zpg_y, &CPU::STX>;
+    handlers[0x98] = &implied_op<&CPU::TYA>;
+    handlers[0x99] = &addr_op<&CPU::addr_abs_y, &CPU::STA>;
+    handlers[0x9A] = &implied_op<&CPU::TXS>;
+    handlers[0x9D] = &addr_op<&CPU::addr_abs_x, &CPU::STA>;
+    handlers[0xA0] = &read_op<&CPU::addr_imd, &CPU::LDY>;
+    handlers[0xA1] = &read_op<&CPU::addr_indr_x, &CPU::LDA>;
+    handlers[0xA2] = &read_op<&CPU::addr_imd, &CPU::LDX>;
+    handlers[0xA4] = &read_op<&CPU::addr_zpg, &CPU::LDY>;
+    handlers[0xA5] = &read_op<&CPU::addr_zpg, &CPU::LDA>;
+    handlers[0xA6] = &read_op<&CPU::addr_zpg, &CPU::LDX>;
+    handlers[0xA8] = &implied_op<&CPU::TAY>;
+    handlers[0xA9] = &read_op<&CPU::addr_imd, &CPU::LDA>;
+    handlers[0xAA] = &implied_op<&CPU::TAX>;
+    handlers[0xAC] = &read_op<&CPU::addr_abs, &CPU::LDY>;
+    handlers[0xAD] = &read_op<&CPU::addr_abs, &CPU::LDA>;
+    handlers[0xAE] = &read_op<&CPU::addr_abs, &CPU::LDX>;
+    handlers[0xB0] = &implied_op<&CPU::BCS>;
+    handlers[0xB1] = &read_op<&CPU::addr_indr_y, &CPU::LDA>;
+    handlers[0xB4] = &read_op<&CPU::addr_zpg_x, &CPU::LDY>;
+    handlers[0xB5] = &read_op<&CPU::addr_zpg_x, &CPU::LDA>;
+    handlers[0xB6] = &read_op<&CPU::addr_zpg_y, &CPU::LDX>;
+    handlers[0xB8] = &implied_op<&CPU::CLV>;
+    handlers[0xB9] = &read_op<&CPU::addr_abs_y, &CPU::LDA>;
+    handlers[0xBA] = &implied_op<&CPU::TSX>;
+    handlers[0xBC] = &read_op<&CPU::addr_abs_x, &CPU::LDY>;
+    handlers[0xBD] = &read_op<&CPU::addr_abs_x, &CPU::LDA>;
+    handlers[0xBE] = &read_op<&CPU::addr_abs_y, &CPU::LDX>;
+    handlers[0xC0] = &read_op<&CPU::addr_imd, &CPU::CPY>;
+    handlers[0xC1] = &read_op<&CPU::addr_indr_x, &CPU::CMP>;
+    handlers[0xC4] = &read_op<&CPU::addr_zpg, &CPU::CPY>;
+    handlers[0xC5] = &read_op<&CPU::addr_zpg, &CPU::CMP>;
+    handlers[0xC6] = &modify_op<&CPU::addr_zpg, &CPU::DEC>;
+    handlers[0xC8] = &implied_op<&CPU::INY>;
+    handlers[0xC9] = &read_op<&CPU::addr_imd, &CPU::CMP>;
+    handlers[0xCA] = &implied_op<&CPU::DEX>;
+    handlers[0xCC] = &read_op<&CPU::addr_abs, &CPU::CPY>;
+    handlers[0xCD] = &read_op<&CPU::addr_abs, &CPU::CMP>;
+    handlers[0xCE] = &modify_op<&CPU::addr_abs, &CPU::DEC>;
+    handlers[0xD0] = &implied_op<&CPU::BNE>;
+    handlers[0xD1] = &read_op<&CPU::addr_indr_y, &CPU::CMP>;
+    handlers[0xD5] = &read_op<&CPU::addr_zpg_x, &CPU::CMP>;
+    handlers[0xD6] = &modify_op<&CPU::addr_zpg_x, &CPU::DEC>;
+    handlers[0xD8] = &implied_op<&CPU::CLD>;
+    handlers[0xD9] = &read_op<&CPU::addr_abs_y, &CPU::CMP>;
+    handlers[0xDD] = &read_op<&CPU::addr_abs_x, &CPU::CMP>;
+    handlers[0xDE] = &modify_op<&CPU::addr_abs_x, &CPU::DEC>;
+    handlers[0xE0] = &read_op<&CPU::addr_imd, &CPU::CPX>;
+    handlers[0xE1] = &read_op<&CPU::addr_indr_x, &CPU::SBC>;
+    handlers[0xE4] = &read_op<&CPU::addr_zpg, &CPU::CPX>;
+    handlers[0xE5] = &read_op<&CPU::addr_zpg, &CPU::SBC>;
+    handlers[0xE6] = &modify_op<&CPU::addr_zpg, &CPU::INC>;
+    handlers[0xE8] = &implied_op<&CPU::INX>;
+    handlers[0xE9] = &read_op<&CPU::addr_imd, &CPU::SBC>;
+    handlers[0xEA] = &implied_op<&CPU::NOP>;
+    handlers[0xEC] = &read_op<&CPU::addr_abs, &CPU::CPX>;
+    handlers[0xED] = &read_op<&CPU::addr_abs, &CPU::SBC>;
+    handlers[0xEE] = &modify_op<&CPU::addr_abs, &CPU::INC>;
+    handlers[0xF0] = &implied_op<&CPU::BEQ>;
+    handlers[0xF1] = &read_op<&CPU::addr_indr_y, &CPU::SBC>;
+    handlers[0xF5] = &read_op<&CPU::addr_zpg_x, &CPU::SBC>;
+    handlers[0xF6] = &modify_op<&CPU::addr_zpg_x, &CPU::INC>;
+    handlers[0xF8] = &implied_op<&CPU::SED>;
+    handlers[0xF9] = &read_op<&CPU::addr_abs_y, &CPU::SBC>;
+    handlers[0xFD] = &read_op<&CPU::addr_abs_x, &CPU::SBC>;
+    handlers[0xFE] = &modify_op<&CPU::addr_abs_x, &CPU::INC>;
+
+    std::array<instruction, 256> table {};
+    for (int op = 0; op < 256; op++)
+        table[op] = { handlers[op], OPCODES[op].cycles, OPCODES[op].length };
+    return table;
+}
+
+template <class Bus, class Variant>
+constexpr unsigned CPU<Bus, Variant>::count_official(const std::array<instruction, 256> &table) {
+    unsigned count = 0;
+    for (const instruction &ins : table)
+        count += ins.exec != &illegal_op;
+    return count;
+}
+
+/* The opcodes with a handler are the ones OPCODES has a name for */
+template <class Bus, class Variant>
+constexpr bool CPU<Bus, Variant>::same_opcodes(const std::array<instruction, 256> &table) {
+    for (int op = 0; op < 256; op++)
+        if ((table[op].exec != &illegal_op) == same_name(OPCODES[op].name, "???"))
+            return false;
+    return true;
+}
+
+template <class Bus, class Variant>
+const std::array<typename CPU<Bus, Variant>::instruction, 256> CPU<Bus, Variant>::op_table = CPU<Bus, Variant>::make_op_table();
+
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::exec(const uint8_t op_code) {
+    static_assert(count_official(make_op_table()) == 151, "The 6502 has 151 official opcodes");
+    static_assert(same_opcodes(make_op_table()), "OPCODES describes every opcode of the table");
+
+    dispatch(op_table[op_code]);
+}
+
+/* Fetches, decodes and executes one instruction, taking a pending
+ * interrupt first. Events due fire before it */
+template <class Bus, class Variant>
+unsigned CPU<Bus, Variant>::step() {
+    uint64_t start = cycles;
+    if (cycles >= events.limit)
+        service(Scheduler::NEVER);
+    uint8_t op_code = bus->read(PC++);
+#ifdef CPU_TRACE
+    if (trace)
+        trace_op(op_code);
+#endif
+#ifdef CPU_PROFILE
+    if (profile)
+        profile_op(op_code);
+    else
+#endif
+        exec(op_code);
+    return cycles - start;
+}
+
+/* Runs instructions until budget cycles went by. The last instruction can
+ * take the CPU past the budget, the cycles actually used are returned so
+ * the caller can take the excess out of the next budget.
+ * The inner loop only checks the cycles against events.limit: events and
+ * interrupts are looked at when it is reached, or after an instruction
+ * that raised an interrupt (events.interrupt() drops the limit to 0) */
+template <class Bus, class Variant>
+uint64_t CPU<Bus, Variant>::run_for(uint64_t budget) {
+    uint64_t start = cycles;
+    uint64_t end = cycles + budget;
+    while (cycles < end) {
+        service(end);
+#ifdef CPU_PROFILE
+        if (profile && !profile->exact) {
+            profile_run();
+            continue;
+        }
+#endif
+        do {
+            uint8_t op_code = bus->read(PC++);
+#ifdef CPU_TRACE
+            if (trace)
+                trace_op(op_code);
+#endif
+#ifdef CPU_PROFILE
+            if (profile)
+                profile_op(op_code);
+            else
+#endif
+                exec(op_code);
+        } while (cycles < events.limit);
+    }
+    return cycles - start;
+}
+
+/* Fires the events due, takes a pending interrupt and sets the limit the
+ * run loop goes to: end or the next event. An IRQ line left up while I is
+ * set waits for CLI, PLP or RTI to drop the limit. After CLI and PLP the
+ * IRQ is left for one more instruction, the limit stays where it is so
+ * the run loop comes back right after it */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::service(uint64_t end) {
+    events.run(cycles);
+    bool delayed = irq_delayed;
+    irq_delayed = false;
+    if (nmi_pending) {
+        nmi_pending = false;
+        interrupt(0xFFFA);
+    } else if (irq_lines && !get_bit(SR, bs::I) && !delayed) {
+        interrupt(0xFFFE);
+    }
 
+    uint64_t next = events.next();
+    events.limit = irq_lines && !get_bit(SR, bs::I) ? cycles : next < end ? next : end;
+}
+
+/* Same as BRK without the B flag */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::interrupt(uint16_t vector) {
+    push(PC >> 8);
+    push(PC & 0x00FF);
+    push(status());
+    set_bit(SR, bs::I, true);
+    PC = join_bytes(bus->read(vector), bus->read(vector + 1));
+    cycles += 7;
+}
+
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::nmi() {
+    nmi_pending = true;
+    events.interrupt();
+}
+
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::set_irq(uint8_t source, bool up) {
+    irq_lines = up ? irq_lines | source : irq_lines & ~source;
+    if (irq_lines)
+        events.interrupt();
+}
+
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::stall(unsigned stalled) {
+    cycles += stalled;
+}
+
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::reset() {
+    SP -= 3;
+    set_bit(SR, bs::I, true);
+    PC = join_bytes(bus->read(0xFFFC), bus->read(0xFFFD));
+    nmi_pending = false;
+    irq_delayed = false;
+    cycles += 7;
+    events.interrupt();
+}
+
+#ifdef CPU_TRACE
+/* Called right after the fetch, PC is past the opcode. The operands are
+ * taken straight from memory, reading I/O twice could have side effects */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::trace_op(uint8_t op_code) {
+    uint16_t pc = PC - 1;
+    Trace::entry e = { cycles, pc, { op_code, 0, 0 }, AC, X, Y, status(), SP, 0 };
+    for (int i = 1; i < op_table[op_code].length; i++) {
+        uint16_t addr = pc + i;
+        const uint8_t *memory = bus->memory(addr >> 8);
+        if (memory)
+            e.bytes[i] = memory[addr & 0xFF];
     }
-}
+    trace->push(e);
+}
+#endif
+
+#ifdef CPU_PROFILE
+/* Executes the opcode like exec, counting it, timing it after a sample and
+ * taking the sample when it is due by the end of it */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::profile_op(uint8_t op_code) {
+    uint16_t pc = PC - 1;
+    uint64_t start = cycles;
+    if (profile->timing()) {
+        auto begin = std::chrono::steady_clock::now();
+        exec(op_code);
+        auto end = std::chrono::steady_clock::now();
+        profile->add_time(op_code, std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+    } else {
+        exec(op_code);
+    }
+    if (profile->exact)
+        profile->count(op_code, cycles - start);
+    if (profile->due(cycles))
+        profile->add_sample(op_code, pc, cycles - start, cycles);
+}
+
+/* Runs up to events.limit for run_for without exact counts. The next sample
+ * lowers the limit like an event, so it is taken after the loop from the
+ * last instruction and the ones before it are only run */
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::profile_run() {
+    if (profile->timing()) {
+        uint8_t op_code = bus->read(PC++);
+#ifdef CPU_TRACE
+        if (trace)
+            trace_op(op_code);
+#endif
+        profile_op(op_code);
+        return;
+    }
+
+    if (profile->next() < events.limit)
+        events.limit = profile->next();
+    uint8_t op_code;
+    uint16_t pc;
+    uint64_t start;
+    do {
+        pc = PC;
+        start = cycles;
+        op_code = bus->read(PC++);
+#ifdef CPU_TRACE
+        if (trace)
+            trace_op(op_code);
+#endif
+        exec(op_code);
+    } while (cycles < events.limit);
+    if (profile->due(cycles))
+        profile->add_sample(op_code, pc, cycles - start, cycles);
+}
+#endif
+
+template <class Bus, class Variant>
+size_t CPU<Bus, Variant>::state_size() const {
+    return sizeof(state_header) + sizeof(state_registers) + bus->state_size();
+}
+
+template <class Bus, class Variant>
+void CPU<Bus, Variant>::save_state(uint8_t *buffer) {
+    state_header header = { { 'N', 'E', 'S', 'S' }, STATE_VERSION, (uint32_t)state_size() };
+    state_registers regs;
+    memset(&regs, 0, sizeof(regs)); /* Padding too, states get hashed */
+    regs.cycles = cycles;
+    regs.PC = PC;
+    regs.AC = AC;
+    regs.X = X;
+    regs.Y = Y;
+    regs.SR = status();
+    regs.SP = SP;
+    regs.nmi_pending = nmi_pending;
+    regs.irq_lines = irq_lines;
+    regs.irq_delayed = irq_delayed;
+    events.save(regs.events);
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), &regs, sizeof(regs));
+    bus->save_state(buffer + sizeof(header) + sizeof(regs));
+}
+
+template <class Bus, class Variant>
+bool CPU<Bus, Variant>::load_state(const uint8_t *buffer) {
+    state_header header;
+    memcpy(&header, buffer, sizeof(header));
+    if (memcmp(header.magic, "NESS", 4) || header.version != STATE_VERSION || header.size != state_size())
+        return false;
+
+    state_registers regs;
+    memcpy(&regs, buffer + sizeof(header), sizeof(regs));
+    cycles = regs.cycles;
+    PC = regs.PC;
+    AC = regs.AC;
+    X = regs.X;
+    Y = regs.Y;
+    SP = regs.SP;
+    set_status(regs.SR);
+    nmi_pending = regs.nmi_pending;
+    irq_lines = regs.irq_lines;
+    irq_delayed = regs.irq_delayed;
+    events.restore(regs.events);
+    bus->load_state(buffer + sizeof(header) + sizeof(regs));
+    return true;
+}
+
+/* Other variants are built in cpu_nmos.cpp and batch.cpp, which include
+ * this file */
+#ifndef CPU_OTHER_VARIANTS
+
+/* Buses the CPU is built for */
+template class CPU<BUS>;
+
+#endif
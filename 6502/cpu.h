@@ -1,27 +1,273 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
 #include "bus.h"
+#include "opcodes.h"
+#include "scheduler.h"
+#ifdef CPU_TRACE
+#include "trace.h"
+#endif
+#ifdef CPU_PROFILE
+#include "profile.h"
+#endif
+
+template <class Bus>
+class BlockCache;
+template <class Bus>
+class JIT;
+
+/* CPU variants, given as template parameter so everything they change is
+ * resolved at compile time */
+struct RP2A03 { /* NES, decimal mode is wired off: D is only a flag */
+    static const bool DECIMAL = false;
+};
+struct NMOS6502 { /* Plain 6502, ADC and SBC do BCD when D is set */
+    static const bool DECIMAL = true;
+};
 
+template <class Bus, class Variant = RP2A03>
 class CPU {
+    friend class BlockCache<Bus>;
+    friend class JIT<Bus>;
+
     public:
-    /* Registers */
+    /* Registers, all clear until reset() powers up */
     uint8_t AC, X, Y, SR, SP; /* Acumulator, x, y, status, stack pointer */
     uint16_t PC; /* Program counter */
 
-    std::unique_ptr<BUS> bus;
-    void set_bus(std::unique_ptr<BUS>);
+    /* Cycles elapsed since power up. While an instruction runs it is the
+     * cycle the operand is read or written on, not the one it started on */
+    uint64_t cycles;
+    static const uint64_t CYCLES_PER_FRAME = 29781; /* NTSC, 341 * 262 / 3 */
+
+    std::unique_ptr<Bus> bus;
+    void set_bus(std::unique_ptr<Bus>);
+
+    /* Status register with every flag up to date, use it instead of SR
+     * which does not hold N, V, Z and C when built with CPU_LAZY_FLAGS */
+    uint8_t status();
+    void set_status(uint8_t);
 
+    /* Events of the devices, looked at by the run loop only when the next
+     * one is due */
+    Scheduler events;
+
+    /* Interrupts are taken between instructions. NMI is edge triggered,
+     * IRQ is a level with one line per source (mapper, APU frame, DMC...),
+     * taken while any line is up and I is clear, one instruction late when
+     * CLI or PLP cleared I */
+    enum irq_source {
+        IRQ_MAPPER = 1, IRQ_FRAME = 2, IRQ_DMC = 4
+    };
+    void nmi();
+    void set_irq(uint8_t source, bool);
+    /* The CPU does nothing for that many cycles (OAM DMA, DMC fetches) */
+    void stall(unsigned);
+
+    /* Reset line: SP goes down by 3 with nothing written, I is set and PC
+     * comes from the reset vector. Takes 7 cycles */
     void reset();
 
+#ifdef CPU_TRACE
+    /* Instructions run by step and run_for go here when set */
+    Trace *trace;
+#endif
+#ifdef CPU_PROFILE
+    /* Counts the instructions run by step and run_for when set */
+    Profile *profile;
+#endif
+
+    /* New CPU with the same registers on a copy on write fork of the bus.
+     * Null when the bus can not be forked (see BUS::fork) or devices added
+     * events, which would fire on the devices of this CPU */
+    std::unique_ptr<CPU> fork();
+
+    /* Save states, a header, the registers and the state of the bus copied
+     * in a row to or from a buffer of state_size() bytes. Saved in host
+     * byte order, they are meant to be loaded back on the same kind of
+     * machine. load_state returns false when the buffer is not a state of
+     * this version or of a bus laid out the same way */
+    static const uint32_t STATE_VERSION = 3;
+    size_t state_size() const;
+    void save_state(uint8_t *);
+    bool load_state(const uint8_t *);
+
     CPU();
     ~CPU();
 
-    void exec(const uint8_t);
+    void exec(const uint8_t); /* Executes an opcode already fetched from PC */
+    unsigned step(); /* Returns the cycles the instruction took */
+    uint64_t run_for(uint64_t);
 
     private:
     enum bs {
-        N, O, U, B, D, I, Z, C // Negative, Overflow, Unused, Break, Decimal, Interrupt, Zero, Carry
+        C, Z, I, D, B, U, O, N // Carry, Zero, Interrupt, Decimal, Break, Unused, Overflow, Negative
     };
 
-};
+    /* Addressing Modes, all of them return the address of the operand */
+    uint16_t addr_imd();
+    uint16_t addr_zpg();
+    uint16_t addr_zpg_x();
+    uint16_t addr_zpg_y();
+    uint16_t addr_abs();
+    uint16_t addr_abs_x();
+    uint16_t addr_abs_y();
+    uint16_t addr_indr();
+    uint16_t addr_indr_x();
+    uint16_t addr_indr_y();
+    void addr_rel(bool);
+    uint8_t page_crossed; /* Set by the indexed modes when the index crosses a page */
 
+    void push(uint8_t);
+    uint8_t pop();
+
+    bool nmi_pending;
+    uint8_t irq_lines;
+    bool irq_delayed; /* I was just cleared by CLI or PLP */
+    void service(uint64_t);
+    void interrupt(uint16_t);
+
+#ifdef CPU_TRACE
+    void trace_op(uint8_t);
+#endif
+#ifdef CPU_PROFILE
+    void profile_op(uint8_t);
+    void profile_run();
+#endif
+
+    struct state_header {
+        char magic[4];
+        uint32_t version;
+        uint32_t size;
+    };
+    struct state_registers {
+        uint64_t cycles;
+        uint16_t PC;
+        uint8_t AC, X, Y, SR, SP;
+        uint8_t nmi_pending, irq_lines, irq_delayed;
+        uint64_t events[Scheduler::MAX_EVENTS]; /* When each event is due */
+    };
+
+    /* Status flags */
+#ifdef CPU_LAZY_FLAGS
+    uint8_t flag_n, flag_z; /* Values N and Z come from */
+    uint8_t flag_c;
+    uint8_t flag_v_a, flag_v_b, flag_v_r; /* Operands and result V comes from */
+#endif
+    void set_nz(uint8_t);
+    void set_n(uint8_t);
+    void set_z(uint8_t);
+    void set_c(bool);
+    void set_v(bool);
+    void set_overflow(uint8_t, uint8_t, uint8_t);
+    bool get_n();
+    bool get_z();
+    bool get_c();
+    bool get_v();
+    void compare(uint8_t, uint8_t);
+    void add_decimal(uint8_t);
+    void sub_decimal(uint8_t);
+
+    static constexpr std::array<uint8_t, 256> make_nz_table();
+    static const std::array<uint8_t, 256> nz_table;
+
+    /* Instructions */
+    void ADC(const uint8_t);
+    void AND(uint8_t);
+    uint8_t ASL(uint8_t);
+    void BCC();
+    void BCS();
+    void BEQ();
+    void BIT(const uint8_t);
+    void BMI();
+    void BNE();
+    void BPL();
+    void BRK();
+    void BVC();
+    void BVS();
+    void CLC();
+    void CLD();
+    void CLI();
+    void CLV();
+    void CMP(uint8_t);
+    void CPX(uint8_t);
+    void CPY(uint8_t);
+    uint8_t DEC(uint8_t);
+    void DEX();
+    void DEY();
+    void EOR(uint8_t);
+    uint8_t INC(uint8_t);
+    void INX();
+    void INY();
+    void JMP(uint16_t);
+    void JSR(uint16_t);
+    void LDA(uint8_t);
+    void LDX(uint8_t);
+    void LDY(uint8_t);
+    uint8_t LSR(uint8_t);
+    void NOP();
+    void ORA(uint8_t);
+    void PHA();
+    void PHP();
+    void PLA();
+    void PLP();
+    uint8_t ROL(uint8_t);
+    uint8_t ROR(uint8_t);
+    void RTI();
+    void RTS();
+    void SBC(uint8_t);
+    void SEC();
+    void SED();
+    void SEI();
+    void STA(uint16_t);
+    void STX(uint16_t);
+    void STY(uint16_t);
+    void TAX();
+    void TAY();
+    void TSX();
+    void TXA();
+    void TXS();
+    void TYA();
+
+    /* Opcode table
+     * Every entry is an (addressing mode, instruction) pair resolved at
+     * compile time plus the base number of cycles it takes and its length,
+     * both from OPCODES */
+    typedef void (*handler)(CPU &);
+    struct instruction {
+        handler exec;
+        uint8_t cycles;
+        uint8_t length; /* Opcode and operand bytes */
+    };
+
+    template <uint16_t (CPU::*mode)(), void (CPU::*op)(uint8_t)>
+    static void read_op(CPU &);
+    template <uint16_t (CPU::*mode)(), void (CPU::*op)(uint16_t)>
+    static void addr_op(CPU &);
+    template <uint16_t (CPU::*mode)(), uint8_t (CPU::*op)(uint8_t)>
+    static void modify_op(CPU &);
+    template <uint8_t (CPU::*op)(uint8_t)>
+    static void acc_op(CPU &);
+    template <void (CPU::*op)()>
+    static void implied_op(CPU &);
+    static void illegal_op(CPU &);
+
+    static constexpr std::array<instruction, 256> make_op_table();
+    static constexpr unsigned count_official(const std::array<instruction, 256> &);
+    static constexpr bool same_opcodes(const std::array<instruction, 256> &);
+    static const std::array<instruction, 256> op_table;
+
+    /* Runs an instruction already decoded, with PC past the opcode. Devices
+     * look at cycles when they are read or written and the operand is
+     * accessed on the last cycle, so cycles is moved there first and the
+     * instruction gets its last cycle once it is done */
+    inline void dispatch(const instruction &ins) {
+        cycles += ins.cycles - 1;
+        ins.exec(*this);
+        cycles++;
+    }
+};
@@ -0,0 +1,7 @@
+/* The plain NMOS 6502, for non NES code. It is built in a translation unit
+ * of its own: instantiating it next to the NES CPU makes the compiler
+ * inline less of the latter */
+#define CPU_OTHER_VARIANTS
+#include "cpu.cpp"
+
+template class CPU<BUS, NMOS6502>;
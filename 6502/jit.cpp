@@ -0,0 +1,836 @@
+#include "jit.h"
+
+#include <cstddef>
+#include <vector>
+
+#if defined(__linux__) && defined(__x86_64__)
+#define JIT_NATIVE
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+// Instructions the translator knows
+enum class kind {
+    NONE, ADC, AND, ASL, BIT, BRANCH, CLC, CLV, CMP, CPX, CPY, DEC, DEX, DEY, EOR, INC, INX, INY,
+    JMP, JSR, LDA, LDX, LDY, LSR, NOP, ORA, PHA, PLA, ROL, ROR, RTS, SBC, SEC, STA, STX, STY,
+    TAX, TAY, TSX, TXA, TXS, TYA
+};
+
+/* Names of the kinds, branches are told by their addressing mode */
+constexpr const char *kind_names[] = {
+    "", "ADC", "AND", "ASL", "BIT", "", "CLC", "CLV", "CMP", "CPX", "CPY", "DEC", "DEX", "DEY", "EOR", "INC", "INX", "INY",
+    "JMP", "JSR", "LDA", "LDX", "LDY", "LSR", "NOP", "ORA", "PHA", "PLA", "ROL", "ROR", "RTS", "SBC", "SEC", "STA", "STX", "STY",
+    "TAX", "TAY", "TSX", "TXA", "TXS", "TYA"
+};
+static_assert(sizeof(kind_names) / sizeof(*kind_names) == (size_t)kind::TYA + 1, "A name for each kind");
+
+struct op_info {
+    kind op;
+    addressing addr;
+};
+
+/* From OPCODES. BRK, RTI, PHP, PLP, SEI, CLI, SED, CLD and JMP (ind) are left to the interpreter */
+constexpr std::array<op_info, 256> make_op_info() {
+    std::array<op_info, 256> table {};
+    for (int op = 0; op < 256; op++) {
+        table[op] = { kind::NONE, OPCODES[op].mode };
+        if (OPCODES[op].mode == REL)
+            table[op].op = kind::BRANCH;
+        else if (OPCODES[op].mode != IND)
+            for (size_t k = 0; k <= (size_t)kind::TYA; k++)
+                if (same_name(OPCODES[op].name, kind_names[k]))
+                    table[op].op = (kind)k;
+    }
+    return table;
+}
+
+const std::array<op_info, 256> op_infos = make_op_info();
+
+// x86-64 Code Emitter
+/* Host registers, the 6502 ones are kept zero extended in 32 bits */
+enum reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15,
+    NONE = RSP /* No index register in a memory operand */
+};
+
+const reg AC = RBX, X = R12, Y = R13, SP = R14;
+const reg FLAG_N = R15, FLAG_Z = RBP, FLAG_C = R8, FLAG_V = R9;
+const reg STATE = RDI, READ_MAP = RSI, WRITE_MAP = RDX;
+
+/* x86 condition codes */
+enum cond {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5
+};
+
+/* x86 ALU opcodes, register / register form and /digit of the immediate form */
+enum alu {
+    ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29, ALU_XOR = 0x31, ALU_MOV = 0x89
+};
+
+int alu_digit(alu op) {
+    switch (op) {
+        case ALU_ADD : return 0;
+        case ALU_OR : return 1;
+        case ALU_AND : return 4;
+        case ALU_SUB : return 5;
+        default : return 6; /* ALU_XOR, there is no mov in the 0x81 group */
+    }
+}
+
+class Emitter {
+    public:
+    uint8_t *code;
+    size_t used;
+
+    Emitter(uint8_t *code) : code(code), used(0) {}
+
+    void byte(uint8_t val) {
+        code[used++] = val;
+    }
+
+    void word(uint16_t val) {
+        byte(val);
+        byte(val >> 8);
+    }
+
+    void dword(uint32_t val) {
+        word(val);
+        word(val >> 16);
+    }
+
+    /* REX prefix, byte forces it so registers 4 - 7 mean spl, bpl, sil, dil */
+    void rex(bool w, int r, int x, int b, bool force = false) {
+        uint8_t val = 0x40 | (w << 3) | ((r >> 3) << 2) | ((x >> 3) << 1) | (b >> 3);
+        if (val != 0x40 || force)
+            byte(val);
+    }
+
+    void modrm_reg(int r, int rm) {
+        byte(0xC0 | ((r & 7) << 3) | (rm & 7));
+    }
+
+    /* Every memory operand is [base + index * scale + disp32] through a SIB byte */
+    void modrm_mem(int r, int base, int index, int scale, int32_t disp) {
+        uint8_t ss = scale == 8 ? 3 : 0;
+        byte(0x80 | ((r & 7) << 3) | 4);
+        byte((ss << 6) | ((index & 7) << 3) | (base & 7));
+        dword(disp);
+    }
+
+    /* op dst, src on 32 bits */
+    void alu_rr(alu op, reg dst, reg src) {
+        rex(false, src, 0, dst);
+        byte(op);
+        modrm_reg(src, dst);
+    }
+
+    void alu_ri(alu op, reg dst, uint32_t imm) {
+        if (op == ALU_MOV) {
+            rex(false, 0, 0, dst);
+            byte(0xB8 | (dst & 7));
+        } else {
+            rex(false, 0, 0, dst);
+            byte(0x81);
+            modrm_reg(alu_digit(op), dst);
+        }
+        dword(imm);
+    }
+
+    void shl(reg dst, uint8_t count) {
+        rex(false, 0, 0, dst);
+        byte(0xC1);
+        modrm_reg(4, dst);
+        byte(count);
+    }
+
+    void shr(reg dst, uint8_t count) {
+        rex(false, 0, 0, dst);
+        byte(0xC1);
+        modrm_reg(5, dst);
+        byte(count);
+    }
+
+    /* movzx dst, src8 */
+    void zero_extend(reg dst, reg src) {
+        rex(false, dst, 0, src, true);
+        byte(0x0F);
+        byte(0xB6);
+        modrm_reg(dst, src);
+    }
+
+    /* test src8, imm8 */
+    void test_byte(reg src, uint8_t imm) {
+        rex(false, 0, 0, src, true);
+        byte(0xF6);
+        modrm_reg(0, src);
+        byte(imm);
+    }
+
+    /* test reg, reg on 64 bits */
+    void test_pointer(reg src) {
+        rex(true, src, 0, src);
+        byte(0x85);
+        modrm_reg(src, src);
+    }
+
+    /* movzx dst, byte [base + index + disp] */
+    void load_byte(reg dst, reg base, reg index, int32_t disp) {
+        rex(false, dst, index, base);
+        byte(0x0F);
+        byte(0xB6);
+        modrm_mem(dst, base, index, 1, disp);
+    }
+
+    /* mov byte [base + index + disp], src8 */
+    void store_byte(reg src, reg base, reg index, int32_t disp) {
+        rex(false, src, index, base, true);
+        byte(0x88);
+        modrm_mem(src, base, index, 1, disp);
+    }
+
+    void store_byte_imm(reg base, reg index, int32_t disp, uint8_t imm) {
+        rex(false, 0, index, base);
+        byte(0xC6);
+        modrm_mem(0, base, index, 1, disp);
+        byte(imm);
+    }
+
+    /* mov dst, qword [base + index * 8 + disp] */
+    void load_pointer(reg dst, reg base, reg index, int32_t disp) {
+        rex(true, dst, index, base);
+        byte(0x8B);
+        modrm_mem(dst, base, index, 8, disp);
+    }
+
+    void store_word(reg src, reg base, int32_t disp) {
+        byte(0x66);
+        rex(false, src, 0, base);
+        byte(0x89);
+        modrm_mem(src, base, NONE, 1, disp);
+    }
+
+    void store_word_imm(reg base, int32_t disp, uint16_t imm) {
+        byte(0x66);
+        rex(false, 0, 0, base);
+        byte(0xC7);
+        modrm_mem(0, base, NONE, 1, disp);
+        word(imm);
+    }
+
+    /* add qword [base + disp], src */
+    void add_mem(reg base, int32_t disp, reg src) {
+        rex(true, src, 0, base);
+        byte(0x01);
+        modrm_mem(src, base, NONE, 1, disp);
+    }
+
+    void add_mem_imm(reg base, int32_t disp, uint32_t imm) {
+        rex(true, 0, 0, base);
+        byte(0x81);
+        modrm_mem(0, base, NONE, 1, disp);
+        dword(imm);
+    }
+
+    void push(reg src) {
+        rex(false, 0, 0, src);
+        byte(0x50 | (src & 7));
+    }
+
+    void pop(reg dst) {
+        rex(false, 0, 0, dst);
+        byte(0x58 | (dst & 7));
+    }
+
+    void ret() {
+        byte(0xC3);
+    }
+
+    /* Jumps are emitted with a rel32 to be patched, they return where it is */
+    size_t jump(cond cc) {
+        byte(0x0F);
+        byte(0x80 | cc);
+        dword(0);
+        return used - 4;
+    }
+
+    size_t jump() {
+        byte(0xE9);
+        dword(0);
+        return used - 4;
+    }
+
+    void patch(size_t at, size_t target) {
+        int32_t rel = target - (at + 4);
+        for (int i = 0; i < 4; i++)
+            code[at + i] = rel >> (8 * i);
+    }
+};
+
+}
+
+template <class Bus>
+JIT<Bus>::JIT(CPU<Bus> &cpu) : cpu(cpu), bus(nullptr), code(nullptr), code_used(0) {
+#ifdef JIT_NATIVE
+    void *memory = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED)
+        code = (uint8_t *)memory;
+#endif
+}
+
+template <class Bus>
+JIT<Bus>::~JIT(void) {
+#ifdef JIT_NATIVE
+    if (code)
+        munmap(code, CODE_SIZE);
+#endif
+}
+
+template <class Bus>
+uint64_t JIT<Bus>::run_for(uint64_t budget) {
+    if (cpu.bus.get() != bus) {
+        flush();
+        bus = cpu.bus.get();
+    }
+
+    uint64_t start = cpu.cycles;
+    uint64_t end = cpu.cycles + budget;
+    while (cpu.cycles < end) {
+        if (cpu.cycles >= cpu.events.limit) { /* Events and interrupts are looked at by step */
+            cpu.step();
+            continue;
+        }
+#ifdef CPU_TRACE
+        if (cpu.trace) { /* Native code is not traced, interpret while tracing */
+            cpu.step();
+            continue;
+        }
+#endif
+#ifdef CPU_PROFILE
+        if (cpu.profile) {
+            cpu.step();
+            continue;
+        }
+#endif
+        /* Flushing frees the blocks, it is done before one is looked up
+         * so translate never has to while it holds one */
+        if (CODE_SIZE - code_used < MAX_CODE)
+            flush();
+        block &b = lookup(cpu.PC);
+        if (!b.code && !b.failed && ++b.hits >= HOT_BLOCK) {
+            b.code = translate(b, cpu.PC);
+            b.failed = !b.code;
+        }
+        if (!b.code || cpu.cycles + b.lead >= cpu.events.limit) {
+            interpret(end);
+            continue;
+        }
+
+        /* Stay in native code while the next block is translated too.
+         * Devices only run when the native code is left, the limit stays */
+        load();
+        native next = b.code;
+        int fallback;
+        do {
+            fallback = next(&regs);
+            if (fallback || regs.cycles >= end)
+                break;
+            const block &n = lookup(regs.PC);
+            next = n.code && regs.cycles + n.lead < cpu.events.limit ? n.code : nullptr;
+        } while (next);
+        store();
+
+        if (fallback)
+            cpu.step();
+    }
+    return cpu.cycles - start;
+}
+
+template <class Bus>
+void JIT<Bus>::flush() {
+    for (std::unique_ptr<block[]> &page : pages)
+        page.reset();
+    code_used = 0;
+}
+
+template <class Bus>
+void JIT<Bus>::load() {
+    uint8_t status = cpu.status();
+    regs.AC = cpu.AC;
+    regs.X = cpu.X;
+    regs.Y = cpu.Y;
+    regs.SP = cpu.SP;
+    regs.n = status & 0x80;
+    regs.z = !(status & 0x02);
+    regs.c = status & 0x01;
+    regs.v = (status >> 6) & 0x01;
+    regs.status = status;
+    regs.PC = cpu.PC;
+    regs.cycles = cpu.cycles;
+    regs.read_map = cpu.bus->read_map;
+    regs.write_map = cpu.bus->write_map;
+}
+
+template <class Bus>
+void JIT<Bus>::store() {
+    cpu.AC = regs.AC;
+    cpu.X = regs.X;
+    cpu.Y = regs.Y;
+    cpu.SP = regs.SP;
+    cpu.set_status((regs.status & 0x0C) | (regs.n & 0x80) | (regs.v << 6) | (!regs.z << 1) | regs.c);
+    cpu.PC = regs.PC;
+    cpu.cycles = regs.cycles;
+}
+
+template <class Bus>
+typename JIT<Bus>::block &JIT<Bus>::lookup(uint16_t pc) {
+    std::unique_ptr<block[]> &page = pages[pc >> 8];
+    if (!page)
+        page.reset(new block[0x100]());
+
+    block &b = page[pc & 0xFF];
+    if ((b.code || b.failed) && stale(b, pc)) {
+        b.code = nullptr;
+        b.failed = false;
+        b.hits = 0;
+    }
+    return b;
+}
+
+template <class Bus>
+bool JIT<Bus>::stale(const block &b, uint16_t pc) {
+    return b.versions[0] != bus->version(pc >> 8) || b.versions[1] != bus->version(b.last_page);
+}
+
+/* Runs the interpreter up to the end of the block */
+template <class Bus>
+void JIT<Bus>::interpret(uint64_t end) {
+    bool last;
+    do {
+        const uint8_t *memory = cpu.bus->memory(cpu.PC >> 8);
+        last = !memory || OPCODES[memory[cpu.PC & 0xFF]].ends_block;
+        cpu.step();
+    } while (!last && cpu.cycles < end);
+}
+
+template <class Bus>
+bool JIT<Bus>::read_only(uint8_t page) {
+    return bus->read_map[page] && !bus->write_map[page] && !bus->watch_map[page] && !bus->frames[page];
+}
+
+template <class Bus>
+typename JIT<Bus>::native JIT<Bus>::translate(block &b, uint16_t pc) {
+    uint8_t page = pc >> 8;
+    b.last_page = page;
+    b.versions[0] = b.versions[1] = bus->version(page);
+#ifdef JIT_NATIVE
+    if (!code || !read_only(page))
+        return nullptr;
+
+    /* Exits back to the interpreter, one per instruction that may need it */
+    struct exit {
+        std::vector<size_t> jumps;
+        uint16_t pc;
+        uint32_t cycles; /* Base cycles of the instructions before */
+    };
+    std::vector<exit> exits;
+    std::vector<size_t> done; /* Jumps to the end of the block */
+
+    Emitter e(code + code_used);
+    const int AC_AT = offsetof(state, AC), X_AT = offsetof(state, X), Y_AT = offsetof(state, Y);
+    const int SP_AT = offsetof(state, SP), N_AT = offsetof(state, n), Z_AT = offsetof(state, z);
+    const int C_AT = offsetof(state, c), V_AT = offsetof(state, v), PC_AT = offsetof(state, PC);
+    const int CYCLES_AT = offsetof(state, cycles);
+
+    const reg saved[] = { RBX, RBP, R12, R13, R14, R15 };
+    for (reg r : saved)
+        e.push(r);
+    e.load_byte(AC, STATE, NONE, AC_AT);
+    e.load_byte(X, STATE, NONE, X_AT);
+    e.load_byte(Y, STATE, NONE, Y_AT);
+    e.load_byte(SP, STATE, NONE, SP_AT);
+    e.load_byte(FLAG_N, STATE, NONE, N_AT);
+    e.load_byte(FLAG_Z, STATE, NONE, Z_AT);
+    e.load_byte(FLAG_C, STATE, NONE, C_AT);
+    e.load_byte(FLAG_V, STATE, NONE, V_AT);
+    e.load_pointer(READ_MAP, STATE, NONE, offsetof(state, read_map));
+    e.load_pointer(WRITE_MAP, STATE, NONE, offsetof(state, write_map));
+
+    auto set_nz = [&e](reg val) {
+        e.alu_rr(ALU_MOV, FLAG_N, val);
+        e.alu_rr(ALU_MOV, FLAG_Z, val);
+    };
+    auto exit_here = [&exits](size_t jump) {
+        exits.back().jumps.push_back(jump);
+    };
+    /* Pointer to the page of the address in ecx, leaves if it is not memory */
+    auto page_of = [&](reg dst, reg map) {
+        e.alu_rr(ALU_MOV, dst, RCX);
+        e.shr(dst, 8);
+        e.load_pointer(dst, map, dst, 0);
+        e.test_pointer(dst);
+        exit_here(e.jump(CC_E));
+    };
+    auto fixed_page = [&](reg dst, reg map, uint8_t page) {
+        e.load_pointer(dst, map, NONE, page * 8);
+        e.test_pointer(dst);
+        exit_here(e.jump(CC_E));
+    };
+
+    uint16_t addr = pc;
+    uint32_t cycles = 0;
+    uint32_t worst = 0; /* Cycles with every page crossed and every branch taken */
+    size_t count = 0;
+    bool dynamic_pc = false; /* PC already stored by the last instruction */
+    uint16_t next_pc = pc;
+    do {
+        if ((addr >> 8) != page)
+            break;
+        uint8_t op_code = bus->read_map[page][addr & 0xFF];
+        const op_info info = op_infos[op_code];
+        const typename CPU<Bus>::instruction &ins = CPU<Bus>::op_table[op_code];
+        if (info.op == kind::NONE)
+            break;
+
+        /* Operands can spill over the next page, it has to be ROM too */
+        uint8_t operand[2] = { 0, 0 };
+        for (int i = 1; i < ins.length; i++) {
+            uint16_t at = addr + i;
+            if (!read_only(at >> 8))
+                goto translated;
+            operand[i - 1] = bus->read_map[at >> 8][at & 0xFF];
+            b.last_page = at >> 8;
+        }
+
+        {
+        exits.push_back({ {}, addr, cycles });
+        uint16_t abs = operand[0] | (operand[1] << 8);
+        uint16_t next = addr + ins.length;
+        bool reads = info.op != kind::STA && info.op != kind::STX && info.op != kind::STY;
+        bool modifies = info.op == kind::ASL || info.op == kind::LSR || info.op == kind::ROL ||
+                        info.op == kind::ROR || info.op == kind::INC || info.op == kind::DEC;
+        bool penalty = false; /* Page crossing cycle left in r11 */
+
+        /* Effective address in ecx */
+        switch (info.addr) {
+            case ZPG :
+                e.alu_ri(ALU_MOV, RCX, operand[0]);
+                break;
+            case ZPX :
+            case ZPY :
+                e.alu_rr(ALU_MOV, RCX, info.addr == ZPX ? X : Y);
+                e.alu_ri(ALU_ADD, RCX, operand[0]);
+                e.zero_extend(RCX, RCX);
+                break;
+            case ABS :
+                e.alu_ri(ALU_MOV, RCX, abs);
+                break;
+            case ABX :
+            case ABY :
+                if (reads && !modifies) {
+                    e.alu_rr(ALU_MOV, R11, info.addr == ABX ? X : Y);
+                    e.alu_ri(ALU_ADD, R11, operand[0]);
+                    e.shr(R11, 8);
+                    penalty = true;
+                }
+                e.alu_ri(ALU_MOV, RCX, abs);
+                e.alu_rr(ALU_ADD, RCX, info.addr == ABX ? X : Y);
+                e.alu_ri(ALU_AND, RCX, 0xFFFF);
+                break;
+            case IZX :
+                fixed_page(R10, READ_MAP, 0x00);
+                e.alu_rr(ALU_MOV, RAX, X);
+                e.alu_ri(ALU_ADD, RAX, operand[0]);
+                e.zero_extend(RAX, RAX);
+                e.load_byte(RCX, R10, RAX, 0);
+                e.alu_ri(ALU_ADD, RAX, 1);
+                e.zero_extend(RAX, RAX);
+                e.load_byte(RAX, R10, RAX, 0);
+                e.shl(RAX, 8);
+                e.alu_rr(ALU_OR, RCX, RAX);
+                break;
+            case IZY :
+                fixed_page(R10, READ_MAP, 0x00);
+                e.load_byte(RCX, R10, NONE, operand[0]);
+                e.load_byte(RAX, R10, NONE, (uint8_t)(operand[0] + 1));
+                if (reads) {
+                    e.alu_rr(ALU_MOV, R11, Y);
+                    e.alu_rr(ALU_ADD, R11, RCX);
+                    e.shr(R11, 8);
+                    penalty = true;
+                }
+                e.shl(RAX, 8);
+                e.alu_rr(ALU_OR, RCX, RAX);
+                e.alu_rr(ALU_ADD, RCX, Y);
+                e.alu_ri(ALU_AND, RCX, 0xFFFF);
+                break;
+            default :
+                break;
+        }
+
+        bool memory = info.addr != IMP && info.addr != ACC &&
+                      info.addr != IMM && info.addr != REL &&
+                      info.op != kind::JMP && info.op != kind::JSR;
+        /* Operand in eax. Every check that can leave is done before
+         * anything changes, the interpreter starts the instruction over */
+        if (memory && (modifies || !reads))
+            page_of(R11, WRITE_MAP);
+        if (memory && reads) {
+            page_of(RAX, READ_MAP);
+            e.zero_extend(R10, RCX);
+            e.load_byte(RAX, RAX, R10, 0);
+            if (penalty)
+                e.add_mem(STATE, CYCLES_AT, R11);
+        } else if (info.addr == IMM) {
+            e.alu_ri(ALU_MOV, RAX, operand[0]);
+        }
+        reg val = info.addr == ACC ? AC : RAX; /* Of shifts, rotations, INC and DEC */
+
+        switch (info.op) {
+            case kind::LDA : e.alu_rr(ALU_MOV, AC, RAX); set_nz(AC); break;
+            case kind::LDX : e.alu_rr(ALU_MOV, X, RAX); set_nz(X); break;
+            case kind::LDY : e.alu_rr(ALU_MOV, Y, RAX); set_nz(Y); break;
+            case kind::AND : e.alu_rr(ALU_AND, AC, RAX); set_nz(AC); break;
+            case kind::ORA : e.alu_rr(ALU_OR, AC, RAX); set_nz(AC); break;
+            case kind::EOR : e.alu_rr(ALU_XOR, AC, RAX); set_nz(AC); break;
+            case kind::SBC :
+            case kind::ADC :
+                if (info.op == kind::SBC)
+                    e.alu_ri(ALU_XOR, RAX, 0xFF);
+                e.alu_rr(ALU_MOV, RCX, AC);
+                e.alu_rr(ALU_ADD, RCX, RAX);
+                e.alu_rr(ALU_ADD, RCX, FLAG_C);
+                /* V = (ac ^ res) & (m ^ res) & 0x80 */
+                e.alu_rr(ALU_MOV, R10, AC);
+                e.alu_rr(ALU_XOR, R10, RCX);
+                e.alu_rr(ALU_XOR, RAX, RCX);
+                e.alu_rr(ALU_AND, R10, RAX);
+                e.shr(R10, 7);
+                e.alu_ri(ALU_AND, R10, 1);
+                e.alu_rr(ALU_MOV, FLAG_V, R10);
+                e.alu_rr(ALU_MOV, FLAG_C, RCX);
+                e.shr(FLAG_C, 8);
+                e.zero_extend(AC, RCX);
+                set_nz(AC);
+                break;
+            case kind::CMP :
+            case kind::CPX :
+            case kind::CPY :
+                /* reg + ~m + 1, bit 8 is the carry */
+                e.alu_ri(ALU_XOR, RAX, 0xFF);
+                e.alu_rr(ALU_MOV, RCX, info.op == kind::CMP ? AC : info.op == kind::CPX ? X : Y);
+                e.alu_rr(ALU_ADD, RCX, RAX);
+                e.alu_ri(ALU_ADD, RCX, 1);
+                e.alu_rr(ALU_MOV, FLAG_C, RCX);
+                e.shr(FLAG_C, 8);
+                e.zero_extend(RCX, RCX);
+                set_nz(RCX);
+                break;
+            case kind::BIT :
+                e.alu_rr(ALU_MOV, FLAG_N, RAX);
+                e.alu_rr(ALU_MOV, FLAG_Z, AC);
+                e.alu_rr(ALU_AND, FLAG_Z, RAX);
+                e.alu_rr(ALU_MOV, FLAG_V, RAX);
+                e.shr(FLAG_V, 6);
+                e.alu_ri(ALU_AND, FLAG_V, 1);
+                break;
+            case kind::ASL :
+                e.alu_rr(ALU_MOV, FLAG_C, val);
+                e.shr(FLAG_C, 7);
+                e.shl(val, 1);
+                e.zero_extend(val, val);
+                set_nz(val);
+                break;
+            case kind::LSR :
+                e.alu_rr(ALU_MOV, FLAG_C, val);
+                e.alu_ri(ALU_AND, FLAG_C, 1);
+                e.shr(val, 1);
+                set_nz(val);
+                break;
+            case kind::ROL :
+                e.shl(val, 1);
+                e.alu_rr(ALU_OR, val, FLAG_C);
+                e.alu_rr(ALU_MOV, FLAG_C, val);
+                e.shr(FLAG_C, 8);
+                e.zero_extend(val, val);
+                set_nz(val);
+                break;
+            case kind::ROR :
+                e.alu_rr(ALU_MOV, R10, FLAG_C);
+                e.shl(R10, 8);
+                e.alu_rr(ALU_OR, val, R10);
+                e.alu_rr(ALU_MOV, FLAG_C, val);
+                e.alu_ri(ALU_AND, FLAG_C, 1);
+                e.shr(val, 1);
+                set_nz(val);
+                break;
+            case kind::INC :
+            case kind::DEC :
+                e.alu_ri(info.op == kind::INC ? ALU_ADD : ALU_SUB, RAX, 1);
+                e.zero_extend(RAX, RAX);
+                set_nz(RAX);
+                break;
+            case kind::STA :
+            case kind::STX :
+            case kind::STY :
+                e.alu_rr(ALU_MOV, RAX, info.op == kind::STA ? AC : info.op == kind::STX ? X : Y);
+                break;
+            case kind::INX :
+            case kind::DEX :
+                e.alu_ri(info.op == kind::INX ? ALU_ADD : ALU_SUB, X, 1);
+                e.zero_extend(X, X);
+                set_nz(X);
+                break;
+            case kind::INY :
+            case kind::DEY :
+                e.alu_ri(info.op == kind::INY ? ALU_ADD : ALU_SUB, Y, 1);
+                e.zero_extend(Y, Y);
+                set_nz(Y);
+                break;
+            case kind::TAX : e.alu_rr(ALU_MOV, X, AC); set_nz(X); break;
+            case kind::TAY : e.alu_rr(ALU_MOV, Y, AC); set_nz(Y); break;
+            case kind::TXA : e.alu_rr(ALU_MOV, AC, X); set_nz(AC); break;
+            case kind::TYA : e.alu_rr(ALU_MOV, AC, Y); set_nz(AC); break;
+            case kind::TSX : e.alu_rr(ALU_MOV, X, SP); set_nz(X); break;
+            case kind::TXS : e.alu_rr(ALU_MOV, SP, X); break;
+            case kind::CLC : e.alu_rr(ALU_XOR, FLAG_C, FLAG_C); break;
+            case kind::SEC : e.alu_ri(ALU_MOV, FLAG_C, 1); break;
+            case kind::CLV : e.alu_rr(ALU_XOR, FLAG_V, FLAG_V); break;
+            case kind::NOP : break;
+            case kind::PHA :
+                fixed_page(R11, WRITE_MAP, 0x01);
+                e.store_byte(AC, R11, SP, 0);
+                e.alu_ri(ALU_SUB, SP, 1);
+                e.zero_extend(SP, SP);
+                break;
+            case kind::PLA :
+                fixed_page(R10, READ_MAP, 0x01);
+                e.alu_ri(ALU_ADD, SP, 1);
+                e.zero_extend(SP, SP);
+                e.load_byte(AC, R10, SP, 0);
+                set_nz(AC);
+                break;
+            case kind::JSR :
+                fixed_page(R11, WRITE_MAP, 0x01);
+                e.store_byte_imm(R11, SP, 0, (uint16_t)(next - 1) >> 8);
+                e.alu_ri(ALU_SUB, SP, 1);
+                e.zero_extend(SP, SP);
+                e.store_byte_imm(R11, SP, 0, (uint16_t)(next - 1) & 0xFF);
+                e.alu_ri(ALU_SUB, SP, 1);
+                e.zero_extend(SP, SP);
+                next = abs;
+                break;
+            case kind::RTS :
+                fixed_page(R10, READ_MAP, 0x01);
+                e.alu_ri(ALU_ADD, SP, 1);
+                e.zero_extend(SP, SP);
+                e.load_byte(RCX, R10, SP, 0);
+                e.alu_ri(ALU_ADD, SP, 1);
+                e.zero_extend(SP, SP);
+                e.load_byte(RAX, R10, SP, 0);
+                e.shl(RAX, 8);
+                e.alu_rr(ALU_OR, RCX, RAX);
+                e.alu_ri(ALU_ADD, RCX, 1);
+                e.store_word(RCX, STATE, PC_AT);
+                dynamic_pc = true;
+                break;
+            case kind::JMP :
+                next = abs;
+                break;
+            case kind::BRANCH : {
+                /* Bits 7 - 6 of the opcode pick the flag, bit 5 the value taken on */
+                static const reg flags[] = { FLAG_N, FLAG_V, FLAG_C, FLAG_Z };
+                reg flag = flags[op_code >> 6];
+                bool on = op_code & 0x20;
+                if (flag == FLAG_N)
+                    e.test_byte(flag, 0x80);
+                else
+                    e.alu_rr((alu)0x85, flag, flag); /* test */
+                bool taken_when_zero = flag == FLAG_Z ? on : !on;
+                size_t taken = e.jump(taken_when_zero ? CC_E : CC_NE);
+
+                uint16_t target = next + (int8_t)operand[0];
+                uint32_t total = cycles + ins.cycles;
+                e.store_word_imm(STATE, PC_AT, next);
+                e.add_mem_imm(STATE, CYCLES_AT, total);
+                done.push_back(e.jump());
+                e.patch(taken, e.used);
+                e.store_word_imm(STATE, PC_AT, target);
+                e.add_mem_imm(STATE, CYCLES_AT, total + 1 + ((next ^ target) > 0xFF));
+                done.push_back(e.jump());
+                dynamic_pc = true;
+                break;
+            }
+            default :
+                break;
+        }
+
+        if (memory && (modifies || !reads)) {
+            e.zero_extend(R10, RCX);
+            e.store_byte(RAX, R11, R10, 0);
+        }
+
+        b.lead = worst;
+        worst += ins.cycles + penalty + (info.op == kind::BRANCH ? 2 : 0);
+        cycles += ins.cycles;
+        count++;
+        addr = next;
+        next_pc = next;
+        if (OPCODES[op_code].ends_block)
+            break;
+        }
+    } while (count < MAX_BLOCK_SIZE);
+translated:
+
+    if (!count)
+        return nullptr;
+
+    if (!dynamic_pc)
+        e.store_word_imm(STATE, PC_AT, next_pc);
+    if (!(dynamic_pc && done.size()))
+        e.add_mem_imm(STATE, CYCLES_AT, cycles);
+
+    /* Normal end, the branches jump here with PC and cycles already set */
+    for (size_t jump : done)
+        e.patch(jump, e.used);
+    e.alu_rr(ALU_XOR, RAX, RAX);
+    size_t epilogue_jump = e.jump();
+
+    std::vector<size_t> to_epilogue;
+    to_epilogue.push_back(epilogue_jump);
+    for (const exit &out : exits) {
+        if (out.jumps.empty())
+            continue;
+        for (size_t jump : out.jumps)
+            e.patch(jump, e.used);
+        e.store_word_imm(STATE, PC_AT, out.pc);
+        e.add_mem_imm(STATE, CYCLES_AT, out.cycles);
+        e.alu_ri(ALU_MOV, RAX, 1);
+        to_epilogue.push_back(e.jump());
+    }
+
+    for (size_t jump : to_epilogue)
+        e.patch(jump, e.used);
+    e.store_byte(AC, STATE, NONE, AC_AT);
+    e.store_byte(X, STATE, NONE, X_AT);
+    e.store_byte(Y, STATE, NONE, Y_AT);
+    e.store_byte(SP, STATE, NONE, SP_AT);
+    e.store_byte(FLAG_N, STATE, NONE, N_AT);
+    e.store_byte(FLAG_Z, STATE, NONE, Z_AT);
+    e.store_byte(FLAG_C, STATE, NONE, C_AT);
+    e.store_byte(FLAG_V, STATE, NONE, V_AT);
+    for (int i = 5; i >= 0; i--)
+        e.pop(saved[i]);
+    e.ret();
+
+    native block_code = (native)(code + code_used);
+    code_used += (e.used + 15) & ~(size_t)15;
+    b.versions[1] = bus->version(b.last_page);
+    return block_code;
+#else
+    return nullptr;
+#endif
+}
+
+/* Buses the JIT is built for */
+template class JIT<BUS>;
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "cpu.h"
+
+/* Optional dynamic recompiler for Linux x86-64
+ * Blocks of code (same boundaries as the BlockCache) are interpreted and
+ * counted. Once a block starting in ROM gets hot it is translated to
+ * native code keeping AC, X, Y, SP and the flags in host registers.
+ * Accesses that do not land on memory (I/O, mapper registers) leave the
+ * native code right before the instruction and the interpreter runs it.
+ * Instructions the translator does not know about end the block the same
+ * way. Code in RAM is always interpreted, ROM blocks are translated again
+ * when their pages get mapped to something else. Native code does not look
+ * at the events: a block that could reach the next one before its last
+ * instruction is interpreted instead, so they land on the same
+ * instruction as with the interpreter.
+ * On other platforms everything is interpreted. */
+template <class Bus>
+class JIT {
+    public:
+    JIT(CPU<Bus> &);
+    ~JIT();
+
+    /* Same as CPU::run_for, but the budget is checked between blocks */
+    uint64_t run_for(uint64_t);
+    void flush();
+
+    /* What the generated code works on, the CPU registers are copied in
+     * and out of it only when switching to and from the interpreter */
+    struct state {
+        uint8_t AC, X, Y, SP;
+        uint8_t n, z, c, v; /* Flags as kept by the generated code, same as lazy flags */
+        uint16_t PC;
+        uint8_t status; /* Flags the generated code does not touch (I, D) */
+        uint64_t cycles;
+        uint8_t *const *read_map;
+        uint8_t *const *write_map;
+    };
+
+    private:
+    /* Returns 0 at the end of the block and 1 when the instruction at PC
+     * has to be run by the interpreter */
+    typedef int (*native)(state *);
+
+    static const unsigned HOT_BLOCK = 32; /* Times a block runs before getting translated */
+    static const size_t MAX_BLOCK_SIZE = 64;
+    static const size_t CODE_SIZE = 4 << 20;
+    static const size_t MAX_CODE = 0x10000; /* Room a translated block can take */
+
+    struct block {
+        native code;
+        uint32_t hits;
+        uint8_t last_page;
+        uint32_t versions[2];
+        uint32_t lead; /* Most cycles the instructions before the last one take */
+        bool failed; /* Starts with an instruction the translator does not know */
+    };
+
+    CPU<Bus> &cpu;
+    const Bus *bus; /* The bus the blocks were translated for */
+    std::unique_ptr<block[]> pages[0x100];
+
+    uint8_t *code; /* Executable memory for the translated blocks */
+    size_t code_used;
+
+    state regs;
+
+    void load();
+    void store();
+    block &lookup(uint16_t);
+    bool stale(const block &, uint16_t);
+    void interpret(uint64_t);
+    native translate(block &, uint16_t);
+    bool read_only(uint8_t);
+};
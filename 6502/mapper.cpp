@@ -0,0 +1,424 @@
+#include "mapper.h"
+
+#include <algorithm>
+#include <cstring>
+
+Mapper::Mapper(std::shared_ptr<const Cartridge> cart)
+    : before_write(nullptr), listener(nullptr), cart(cart), cpu(nullptr), ram_mapping(-1) {
+    prg_ram_size = cart->prg_ram_size + cart->prg_nvram_size;
+    if (prg_ram_size) {
+        prg_ram.reset(new uint8_t[prg_ram_size]);
+        memset(prg_ram.get(), 0, prg_ram_size);
+    }
+    chr_ram_size = cart->chr_size ? 0 : cart->chr_ram_size + cart->chr_nvram_size;
+    if (!cart->chr_size && !chr_ram_size)
+        chr_ram_size = 0x2000;
+    if (chr_ram_size) {
+        chr_ram.reset(new uint8_t[chr_ram_size]);
+        memset(chr_ram.get(), 0, chr_ram_size);
+    }
+    for (int page = 0; page < 8; page++) {
+        chr[page] = nullptr;
+        chr_write[page] = nullptr;
+    }
+    mirror(cart->nametables);
+    io = { nullptr, &Mapper::write_io, this };
+}
+
+Mapper::~Mapper(void) {
+}
+
+void Mapper::plug(CPU<BUS> &cpu) {
+    this->cpu = &cpu;
+    cpu.bus->map_io(0x80, 0xFF, &io); /* Writes to ROM land here */
+    if (prg_ram)
+        cpu.bus->add_state(prg_ram.get(), prg_ram_size);
+    if (chr_ram)
+        cpu.bus->add_state(chr_ram.get(), chr_ram_size);
+    attach();
+    update();
+}
+
+void Mapper::ppu_timing(uint64_t, bool) {
+}
+
+void Mapper::write(uint16_t, uint8_t) {
+}
+
+void Mapper::attach() {
+}
+
+/* Fixed banks: 32 KB of PRG (16 KB mirrored) and 8 KB of CHR */
+void Mapper::update() {
+    map_prg(0x80, 0xFF, 0, 0x8000);
+    map_prg_ram(true, true);
+    map_chr(0, 8, 0, 0x2000);
+}
+
+void Mapper::map_prg(uint8_t first_page, uint8_t last_page, size_t bank, size_t bank_size) {
+    cart->map_prg(*cpu->bus, first_page, last_page, bank, bank_size);
+}
+
+void Mapper::map_chr(int first, int count, size_t bank, size_t bank_size) {
+    const uint8_t *rom = chr_ram ? chr_ram.get() : cart->chr;
+    size_t size = chr_ram ? chr_ram_size : cart->chr_size;
+    size_t banks = size > bank_size ? size / bank_size : 1;
+    size_t offset = bank % banks * bank_size;
+    for (int page = 0; page < count; page++) {
+        size_t at = (offset + page * 0x400) % size;
+        chr[first + page] = rom + at;
+        chr_write[first + page] = chr_ram ? chr_ram.get() + at : nullptr;
+    }
+}
+
+/* PRG RAM that is disabled reads as open bus, write protected goes read
+ * only. Left alone when it does not change, like PRG ROM */
+void Mapper::map_prg_ram(bool enabled, bool writable) {
+    int mapping = enabled ? 1 + writable : 0;
+    if (!prg_ram || mapping == ram_mapping)
+        return;
+    ram_mapping = mapping;
+    if (enabled)
+        cpu->bus->map(0x60, 0x7F, prg_ram.get(), prg_ram_size, writable);
+    else
+        cpu->bus->unmap(0x60, 0x7F);
+}
+
+void Mapper::mirror(Cartridge::mirroring nametables) {
+    static const uint8_t arrangements[3][4] = {
+        { 0, 0, 1, 1 }, /* Horizontal */
+        { 0, 1, 0, 1 }, /* Vertical */
+        { 0, 1, 2, 3 }, /* Four screen */
+    };
+    if (cart->nametables == Cartridge::FOUR_SCREEN)
+        nametables = Cartridge::FOUR_SCREEN;
+    memcpy(nametable, arrangements[nametables], 4);
+}
+
+void Mapper::mirror_single(uint8_t page) {
+    memset(nametable, page, 4);
+}
+
+void Mapper::write_io(void *device, uint16_t addr, uint8_t val) {
+    Mapper &mapper = *(Mapper *)device;
+    if (addr < 0x8000)
+        return;
+    if (mapper.before_write)
+        mapper.before_write(mapper.listener);
+    mapper.write(addr, val);
+}
+
+void Mapper::loaded(void *device) {
+    ((Mapper *)device)->update();
+}
+
+// Mappers
+
+/* MMC1: registers loaded one bit at a time through a shift register. A
+ * write on the cycle right after another one is ignored, which is the
+ * second write of a read-modify-write instruction */
+class MMC1 : public Mapper {
+    public:
+    MMC1(std::shared_ptr<const Cartridge> cart) : Mapper(cart) {
+        memset(&regs, 0, sizeof(regs));
+        regs.control = 0x0C;
+        regs.shift = 0x10;
+        last_write = UINT64_MAX - 1; /* Not right before any cycle */
+    }
+
+    protected:
+    struct {
+        uint8_t shift; /* A 1 walks down to bit 0 when full */
+        uint8_t control, chr0, chr1, prg;
+    } regs;
+    uint64_t last_write;
+
+    void attach() {
+        cpu->bus->add_state(&regs, sizeof(regs), &Mapper::loaded, this);
+    }
+
+    void write(uint16_t addr, uint8_t val) {
+        bool again = cpu->cycles == last_write + 1;
+        last_write = cpu->cycles;
+        if (again)
+            return;
+        if (val & 0x80) {
+            regs.shift = 0x10;
+            regs.control |= 0x0C;
+            update();
+            return;
+        }
+        bool full = regs.shift & 1;
+        regs.shift = (regs.shift >> 1) | (val & 1) << 4;
+        if (!full)
+            return;
+        switch (addr & 0x6000) {
+        case 0x0000: regs.control = regs.shift; break;
+        case 0x2000: regs.chr0 = regs.shift; break;
+        case 0x4000: regs.chr1 = regs.shift; break;
+        case 0x6000: regs.prg = regs.shift; break;
+        }
+        regs.shift = 0x10;
+        update();
+    }
+
+    /* 512 KB boards (SUROM) take the PRG outer bank from bit 4 of chr0 */
+    void update() {
+        switch (regs.control & 3) {
+        case 0: mirror_single(0); break;
+        case 1: mirror_single(1); break;
+        case 2: mirror(Cartridge::VERTICAL); break;
+        case 3: mirror(Cartridge::HORIZONTAL); break;
+        }
+
+        size_t outer = cart->prg_size > 0x40000 ? (regs.chr0 & 0x10) : 0;
+        size_t bank = outer | (regs.prg & 0x0F);
+        switch (regs.control >> 2 & 3) {
+        case 0:
+        case 1:
+            map_prg(0x80, 0xFF, bank >> 1, 0x8000);
+            break;
+        case 2:
+            map_prg(0x80, 0xBF, outer, 0x4000);
+            map_prg(0xC0, 0xFF, bank, 0x4000);
+            break;
+        case 3:
+            map_prg(0x80, 0xBF, bank, 0x4000);
+            map_prg(0xC0, 0xFF, outer | 0x0F, 0x4000);
+            break;
+        }
+        map_prg_ram(!(regs.prg & 0x10), true);
+
+        if (regs.control & 0x10) {
+            map_chr(0, 4, regs.chr0, 0x1000);
+            map_chr(4, 4, regs.chr1, 0x1000);
+        } else {
+            map_chr(0, 8, regs.chr0 >> 1, 0x2000);
+        }
+    }
+};
+
+/* UxROM: 16 KB at $8000 switched, the last bank fixed at $C000 */
+class UxROM : public Mapper {
+    public:
+    UxROM(std::shared_ptr<const Cartridge> cart) : Mapper(cart), bank(0) {
+    }
+
+    protected:
+    uint8_t bank;
+
+    void attach() {
+        cpu->bus->add_state(&bank, sizeof(bank), &Mapper::loaded, this);
+    }
+
+    void write(uint16_t, uint8_t val) {
+        bank = val;
+        update();
+    }
+
+    void update() {
+        map_prg(0x80, 0xBF, bank, 0x4000);
+        map_prg(0xC0, 0xFF, cart->prg_size / 0x4000 - 1, 0x4000);
+        map_prg_ram(true, true);
+        map_chr(0, 8, 0, 0x2000);
+    }
+};
+
+/* CNROM: fixed PRG, 8 KB of CHR switched */
+class CNROM : public Mapper {
+    public:
+    CNROM(std::shared_ptr<const Cartridge> cart) : Mapper(cart), bank(0) {
+    }
+
+    protected:
+    uint8_t bank;
+
+    void attach() {
+        cpu->bus->add_state(&bank, sizeof(bank), &Mapper::loaded, this);
+    }
+
+    void write(uint16_t, uint8_t val) {
+        bank = val;
+        update();
+    }
+
+    void update() {
+        Mapper::update();
+        map_chr(0, 8, bank, 0x2000);
+    }
+};
+
+/* MMC3: 8 KB PRG banks, 1 and 2 KB CHR banks and a scanline counter
+ * clocked by the PPU fetching from $1000 after $0000 (A12 rising), taken
+ * here at dot 260 of the visible and pre-render lines while rendering, as
+ * with the background at $0000 and the sprites at $1000.
+ * The counter is not clocked as lines go by: it is brought up to date
+ * when a register is written, and an event is scheduled at the cycle the
+ * counter will reach 0, which raises the IRQ. */
+class MMC3 : public Mapper {
+    public:
+    MMC3(std::shared_ptr<const Cartridge> cart) : Mapper(cart), event(-1) {
+        memset(&regs, 0, sizeof(regs));
+        static const uint8_t banks[8] = { 0, 2, 4, 5, 6, 7, 0, 1 };
+        memcpy(regs.banks, banks, sizeof(banks));
+        regs.ram = 0x80;
+    }
+
+    void ppu_timing(uint64_t frame_dot, bool rendering) {
+        catch_up(cpu->cycles);
+        regs.frame = frame_dot;
+        regs.rendering = rendering;
+        schedule();
+    }
+
+    protected:
+    static const uint64_t LINE = 341;
+    static const uint64_t FRAME = 341 * 262;
+    static const uint64_t CLOCKS = 241; /* Per frame, 240 visible lines and pre-render */
+    static const uint64_t DOT = 260;
+
+    struct {
+        uint8_t select, banks[8], mirroring, ram;
+        uint8_t latch, counter, reload, enabled;
+        uint8_t rendering;
+        uint64_t counted; /* Dot the counter is up to date at */
+        uint64_t frame;
+    } regs;
+    int event;
+
+    void attach() {
+        cpu->bus->add_state(&regs, sizeof(regs), &MMC3::loaded, this);
+        event = cpu->events.add(&MMC3::irq, this);
+    }
+
+    void write(uint16_t addr, uint8_t val) {
+        /* An IRQ due before the write happens first, the block cache and
+         * the JIT only look at events between blocks */
+        uint64_t due = cpu->events.when(event);
+        if (due <= cpu->cycles) {
+            cpu->events.cancel(event);
+            irq(this, due);
+        }
+        catch_up(cpu->cycles);
+        switch (addr & 0xE001) {
+        case 0x8000: regs.select = val; update(); break;
+        case 0x8001: regs.banks[regs.select & 7] = val; update(); break;
+        case 0xA000: regs.mirroring = val; update(); break;
+        case 0xA001: regs.ram = val; update(); break;
+        case 0xC000: regs.latch = val; break;
+        case 0xC001: regs.counter = 0; regs.reload = 1; break;
+        case 0xE000:
+            regs.enabled = 0;
+            cpu->set_irq(CPU<BUS>::IRQ_MAPPER, false);
+            break;
+        case 0xE001: regs.enabled = 1; break;
+        }
+        schedule();
+    }
+
+    void update() {
+        size_t last = cart->prg_size / 0x2000 - 1;
+        bool swap = regs.select & 0x40;
+        map_prg(0x80, 0x9F, swap ? last - 1 : regs.banks[6], 0x2000);
+        map_prg(0xA0, 0xBF, regs.banks[7], 0x2000);
+        map_prg(0xC0, 0xDF, swap ? regs.banks[6] : last - 1, 0x2000);
+        map_prg(0xE0, 0xFF, last, 0x2000);
+        map_prg_ram(regs.ram & 0x80, !(regs.ram & 0x40));
+
+        int invert = regs.select & 0x80 ? 4 : 0;
+        map_chr(0 ^ invert, 2, regs.banks[0] >> 1, 0x800);
+        map_chr(2 ^ invert, 2, regs.banks[1] >> 1, 0x800);
+        for (int i = 0; i < 4; i++)
+            map_chr((4 + i) ^ invert, 1, regs.banks[2 + i], 0x400);
+
+        mirror(regs.mirroring & 1 ? Cartridge::HORIZONTAL : Cartridge::VERTICAL);
+    }
+
+    /* Counter clocks up to and including dot */
+    uint64_t clocks(uint64_t dot) const {
+        if (!regs.rendering || dot < regs.frame)
+            return 0;
+        uint64_t frames = (dot - regs.frame) / FRAME;
+        uint64_t in_frame = (dot - regs.frame) % FRAME;
+        uint64_t n = 0;
+        if (in_frame >= 261 * LINE + DOT)
+            n = CLOCKS;
+        else if (in_frame >= DOT)
+            n = std::min<uint64_t>(240, (in_frame - DOT) / LINE + 1);
+        return frames * CLOCKS + n;
+    }
+
+    /* Dot of the nth counter clock, counting from 1 */
+    uint64_t clock_dot(uint64_t n) const {
+        uint64_t frames = (n - 1) / CLOCKS;
+        uint64_t line = (n - 1) % CLOCKS;
+        if (line == 240)
+            line = 261;
+        return regs.frame + frames * FRAME + line * LINE + DOT;
+    }
+
+    /* Clocks the counter n times at once: it goes down to 0, then reloads */
+    void clock(uint64_t n) {
+        if (!n)
+            return;
+        if (regs.reload || !regs.counter)
+            regs.counter = regs.latch;
+        else
+            regs.counter--;
+        regs.reload = 0;
+        n--;
+        if (n <= regs.counter) {
+            regs.counter -= n;
+            return;
+        }
+        n -= regs.counter; /* Clocks left from 0 */
+        regs.counter = regs.latch - (n - 1) % (regs.latch + 1);
+    }
+
+    /* Brings the counter up to the cycle */
+    void catch_up(uint64_t cycle) {
+        uint64_t now = cycle * 3;
+        if (now <= regs.counted)
+            return;
+        clock(clocks(now) - clocks(regs.counted));
+        regs.counted = now;
+    }
+
+    /* Clocks until the counter reaches 0, at the cycle of that dot */
+    void schedule() {
+        if (!regs.enabled || !regs.rendering) {
+            cpu->events.cancel(event);
+            return;
+        }
+        uint64_t n = regs.reload || !regs.counter ? regs.latch + 1 : regs.counter;
+        if (!regs.latch && (regs.reload || !regs.counter))
+            n = 1;
+        uint64_t dot = clock_dot(clocks(regs.counted) + n);
+        cpu->events.schedule(event, (dot + 2) / 3);
+    }
+
+    static void irq(void *device, uint64_t cycle) {
+        MMC3 &mmc3 = *(MMC3 *)device;
+        mmc3.catch_up(cycle);
+        if (mmc3.regs.enabled && !mmc3.regs.counter)
+            mmc3.cpu->set_irq(CPU<BUS>::IRQ_MAPPER, true);
+        mmc3.schedule();
+    }
+
+    static void loaded(void *device) {
+        MMC3 &mmc3 = *(MMC3 *)device;
+        mmc3.update();
+        mmc3.schedule();
+    }
+};
+
+std::unique_ptr<Mapper> Mapper::create(std::shared_ptr<const Cartridge> cart) {
+    switch (cart->mapper) {
+    case 0: return std::unique_ptr<Mapper>(new Mapper(cart));
+    case 1: return std::unique_ptr<Mapper>(new MMC1(cart));
+    case 2: return std::unique_ptr<Mapper>(new UxROM(cart));
+    case 3: return std::unique_ptr<Mapper>(new CNROM(cart));
+    case 4: return std::unique_ptr<Mapper>(new MMC3(cart));
+    }
+    return nullptr;
+}
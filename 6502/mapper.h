@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "bus.h"
+#include "cartridge.h"
+#include "cpu.h"
+
+/* Cartridge mapper
+ * Bank switching maps the banks again on the page tables, of the bus for
+ * PRG and of chr for the PPU, when a register is written. Reads never ask
+ * the mapper anything, a banked read costs what a RAM read does.
+ * Mappers: NROM (0), MMC1 (1), UxROM (2), CNROM (3), MMC3 (4). */
+class Mapper {
+    public:
+    /* Null when the mapper of the cartridge is not supported */
+    static std::unique_ptr<Mapper> create(std::shared_ptr<const Cartridge>);
+
+    virtual ~Mapper();
+    Mapper(const Mapper &) = delete;
+    Mapper &operator=(const Mapper &) = delete;
+
+    /* Maps PRG ROM, PRG RAM at $6000 and the registers on the bus of the
+     * CPU and adds the mapper to its save states and events. Once only */
+    void plug(CPU<BUS> &);
+
+    /* PPU side: the pattern tables as 1 KB pages, chr_write is null for
+     * the pages of CHR ROM. nametable tells which 1 KB of nametable RAM
+     * each of $2000, $2400, $2800 and $2C00 shows, 0 to 3 (2 and 3 only
+     * for four screen cartridges) */
+    const uint8_t *chr[8];
+    uint8_t *chr_write[8];
+    uint8_t nametable[4];
+
+    /* The PPU tells where its frame started, dot 0 of scanline 0 in PPU
+     * dots (3 per CPU cycle), each frame and whenever rendering is turned
+     * on or off. Mappers counting scanlines (MMC3) schedule their IRQ from
+     * it, the others ignore it */
+    virtual void ppu_timing(uint64_t frame_dot, bool rendering);
+
+    /* Called with listener before each register write, so the PPU can
+     * render up to now with the banks and the mirroring of before */
+    void (*before_write)(void *);
+    void *listener;
+
+    protected:
+    std::shared_ptr<const Cartridge> cart;
+    CPU<BUS> *cpu;
+    std::unique_ptr<uint8_t[]> prg_ram;
+    size_t prg_ram_size;
+    std::unique_ptr<uint8_t[]> chr_ram;
+    size_t chr_ram_size;
+
+    Mapper(std::shared_ptr<const Cartridge>);
+
+    /* Registers written, $8000 - $FFFF */
+    virtual void write(uint16_t, uint8_t);
+    /* Adds the registers to the state and the events, called by plug */
+    virtual void attach();
+    /* Maps the banks the registers select */
+    virtual void update();
+
+    void map_prg(uint8_t first_page, uint8_t last_page, size_t bank, size_t bank_size);
+    void map_chr(int first, int count, size_t bank, size_t bank_size); /* In 1 KB pages */
+    void map_prg_ram(bool enabled, bool writable);
+    void mirror(Cartridge::mirroring);
+    void mirror_single(uint8_t page);
+
+    /* Callback for BUS::add_state, maps the banks of the registers loaded */
+    static void loaded(void *);
+
+    private:
+    BUS::io io;
+    int ram_mapping; /* How PRG RAM is mapped: -1 not yet, 0 not, 1 read only, 2 read write */
+
+    static void write_io(void *, uint16_t, uint8_t);
+};
@@ -0,0 +1,72 @@
+#include "movie.h"
+
+#include <cstdio>
+#include <cstring>
+
+Movie::Movie(void) : start_hash(0) {
+}
+
+void Movie::record(uint8_t port1, uint8_t port2) {
+    input.push_back(port1);
+    input.push_back(port2);
+}
+
+// Helper Functions
+void put_le(uint8_t *out, uint64_t val, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        out[i] = val >> (8 * i);
+}
+
+uint64_t get_le(const uint8_t *in, int bytes) {
+    uint64_t val = 0;
+    for (int i = 0; i < bytes; i++)
+        val |= (uint64_t)in[i] << (8 * i);
+    return val;
+}
+
+const size_t HEADER_SIZE = 20;
+
+bool Movie::load(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    uint8_t header[HEADER_SIZE];
+    bool ok = fread(header, 1, HEADER_SIZE, file) == HEADER_SIZE &&
+              !memcmp(header, "NESM", 4) && get_le(header + 4, 4) == VERSION;
+    /* The frame count has to match the rest of the file before it sizes anything */
+    long end = -1;
+    if (ok && !fseek(file, 0, SEEK_END))
+        end = ftell(file);
+    ok = ok && end >= 0 && (uint64_t)end - HEADER_SIZE == get_le(header + 8, 4) * 2 &&
+         !fseek(file, HEADER_SIZE, SEEK_SET);
+    if (ok) {
+        start_hash = get_le(header + 12, 8);
+        input.resize(get_le(header + 8, 4) * 2);
+        ok = fread(input.data(), 1, input.size(), file) == input.size();
+    }
+    fclose(file);
+    return ok;
+}
+
+bool Movie::save(const char *path) const {
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    uint8_t header[HEADER_SIZE];
+    memcpy(header, "NESM", 4);
+    put_le(header + 4, VERSION, 4);
+    put_le(header + 8, frames(), 4);
+    put_le(header + 12, start_hash, 8);
+    bool ok = fwrite(header, 1, HEADER_SIZE, file) == HEADER_SIZE &&
+              fwrite(input.data(), 1, input.size(), file) == input.size();
+    return fclose(file) == 0 && ok;
+}
+
+uint64_t hash_state(const uint8_t *state, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ state[i]) * 0x100000001B3;
+    return hash;
+}
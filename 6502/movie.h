@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* Input movie, the buttons of both controllers for every frame
+ * File layout, little endian: "NESM", version (32 bits), number of frames
+ * (32 bits), hash of the save state the movie starts from (64 bits), then
+ * two bytes per frame, the buttons of port 1 and port 2 */
+class Movie {
+    public:
+    static const uint32_t VERSION = 1;
+
+    uint64_t start_hash;
+    std::vector<uint8_t> input; /* Two bytes per frame */
+
+    Movie();
+
+    size_t frames() const {
+        return input.size() / 2;
+    }
+
+    void record(uint8_t port1, uint8_t port2);
+    bool load(const char *path);
+    bool save(const char *path) const;
+};
+
+/* FNV-1a 64 of a save state */
+uint64_t hash_state(const uint8_t *, size_t);
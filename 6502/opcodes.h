@@ -0,0 +1,217 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/* What each opcode is: name, addressing mode, base cycles and length.
+ * The CPU takes the cycles and lengths of its opcode table from here, the
+ * engines, traces and profiles look here too, so an opcode is described
+ * once. The ones the CPU does not know about show as ??? and run as a 1
+ * byte NOP */
+enum addressing {
+    IMP, ACC, IMM, ZPG, ZPX, ZPY, ABS, ABX, ABY, IND, IZX, IZY, REL,
+    ADDRESSING_MODES
+};
+
+constexpr int instruction_length(addressing mode) {
+    switch (mode) {
+    case IMP: case ACC: return 1;
+    case ABS: case ABX: case ABY: case IND: return 3;
+    default: return 2;
+    }
+}
+
+constexpr bool same_name(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+struct opcode {
+    const char *name;
+    addressing mode;
+    uint8_t cycles; /* Without the page crossing and taken branch ones */
+    uint8_t length; /* Opcode and operand bytes */
+    bool ends_block; /* Can go somewhere else than the next instruction */
+
+    /* Length and ends_block follow from the name and the mode */
+    constexpr opcode(const char *name, addressing mode, uint8_t cycles)
+        : name(name), mode(mode), cycles(cycles), length(instruction_length(mode)), ends_block(jumps(name, mode)) {}
+    constexpr opcode() : opcode("???", IMP, 2) {}
+
+    /* Branches, jumps, returns and BRK end the blocks of the block cache
+     * and the JIT */
+    static constexpr bool jumps(const char *name, addressing mode) {
+        const char *const names[] = { "BRK", "JSR", "RTI", "JMP", "RTS" };
+        bool jump = mode == REL;
+        for (const char *n : names)
+            jump |= same_name(name, n);
+        return jump;
+    }
+};
+
+constexpr std::array<opcode, 256> make_opcodes() {
+    std::array<opcode, 256> table {}; /* ??? until listed below */
+
+    table[0x00] = { "BRK", IMP, 7 };
+    table[0x01] = { "ORA", IZX, 6 };
+    table[0x05] = { "ORA", ZPG, 3 };
+    table[0x06] = { "ASL", ZPG, 5 };
+    table[0x08] = { "PHP", IMP, 3 };
+    table[0x09] = { "ORA", IMM, 2 };
+    table[0x0A] = { "ASL", ACC, 2 };
+    table[0x0D] = { "ORA", ABS, 4 };
+    table[0x0E] = { "ASL", ABS, 6 };
+    table[0x10] = { "BPL", REL, 2 };
+    table[0x11] = { "ORA", IZY, 5 };
+    table[0x15] = { "ORA", ZPX, 4 };
+    table[0x16] = { "ASL", ZPX, 6 };
+    table[0x18] = { "CLC", IMP, 2 };
+    table[0x19] = { "ORA", ABY, 4 };
+    table[0x1D] = { "ORA", ABX, 4 };
+    table[0x1E] = { "ASL", ABX, 7 };
+    table[0x20] = { "JSR", ABS, 6 };
+    table[0x21] = { "AND", IZX, 6 };
+    table[0x24] = { "BIT", ZPG, 3 };
+    table[0x25] = { "AND", ZPG, 3 };
+    table[0x26] = { "ROL", ZPG, 5 };
+    table[0x28] = { "PLP", IMP, 4 };
+    table[0x29] = { "AND", IMM, 2 };
+    table[0x2A] = { "ROL", ACC, 2 };
+    table[0x2C] = { "BIT", ABS, 4 };
+    table[0x2D] = { "AND", ABS, 4 };
+    table[0x2E] = { "ROL", ABS, 6 };
+    table[0x30] = { "BMI", REL, 2 };
+    table[0x31] = { "AND", IZY, 5 };
+    table[0x35] = { "AND", ZPX, 4 };
+    table[0x36] = { "ROL", ZPX, 6 };
+    table[0x38] = { "SEC", IMP, 2 };
+    table[0x39] = { "AND", ABY, 4 };
+    table[0x3D] = { "AND", ABX, 4 };
+    table[0x3E] = { "ROL", ABX, 7 };
+    table[0x40] = { "RTI", IMP, 6 };
+    table[0x41] = { "EOR", IZX, 6 };
+    table[0x45] = { "EOR", ZPG, 3 };
+    table[0x46] = { "LSR", ZPG, 5 };
+    table[0x48] = { "PHA", IMP, 3 };
+    table[0x49] = { "EOR", IMM, 2 };
+    table[0x4A] = { "LSR", ACC, 2 };
+    table[0x4C] = { "JMP", ABS, 3 };
+    table[0x4D] = { "EOR", ABS, 4 };
+    table[0x4E] = { "LSR", ABS, 6 };
+    table[0x50] = { "BVC", REL, 2 };
+    table[0x51] = { "EOR", IZY, 5 };
+    table[0x55] = { "EOR", ZPX, 4 };
+    table[0x56] = { "LSR", ZPX, 6 };
+    table[0x58] = { "CLI", IMP, 2 };
+    table[0x59] = { "EOR", ABY, 4 };
+    table[0x5D] = { "EOR", ABX, 4 };
+    table[0x5E] = { "LSR", ABX, 7 };
+    table[0x60] = { "RTS", IMP, 6 };
+    table[0x61] = { "ADC", IZX, 6 };
+    table[0x65] = { "ADC", ZPG, 3 };
+    table[0x66] = { "ROR", ZPG, 5 };
+    table[0x68] = { "PLA", IMP, 4 };
+    table[0x69] = { "ADC", IMM, 2 };
+    table[0x6A] = { "ROR", ACC, 2 };
+    table[0x6C] = { "JMP", IND, 5 };
+    table[0x6D] = { "ADC", ABS, 4 };
+    table[0x6E] = { "ROR", ABS, 6 };
+    table[0x70] = { "BVS", REL, 2 };
+    table[0x71] = { "ADC", IZY, 5 };
+    table[0x75] = { "ADC", ZPX, 4 };
+    table[0x76] = { "ROR", ZPX, 6 };
+    table[0x78] = { "SEI", IMP, 2 };
+    table[0x79] = { "ADC", ABY, 4 };
+    table[0x7D] = { "ADC", ABX, 4 };
+    table[0x7E] = { "ROR", ABX, 7 };
+    table[0x81] = { "STA", IZX, 6 };
+    table[0x84] = { "STY", ZPG, 3 };
+    table[0x85] = { "STA", ZPG, 3 };
+    table[0x86] = { "STX", ZPG, 3 };
+    table[0x88] = { "DEY", IMP, 2 };
+    table[0x8A] = { "TXA", IMP, 2 };
+    table[0x8C] = { "STY", ABS, 4 };
+    table[0x8D] = { "STA", ABS, 4 };
+    table[0x8E] = { "STX", ABS, 4 };
+    table[0x90] = { "BCC", REL, 2 };
+    table[0x91] = { "STA", IZY, 6 };
+    table[0x94] = { "STY", ZPX, 4 };
+    table[0x95] = { "STA", ZPX, 4 };
+    table[0x96] = { "STX", ZPY, 4 };
+    table[0x98] = { "TYA", IMP, 2 };
+    table[0x99] = { "STA", ABY, 5 };
+    table[0x9A] = { "TXS", IMP, 2 };
+    table[0x9D] = { "STA", ABX, 5 };
+    table[0xA0] = { "LDY", IMM, 2 };
+    table[0xA1] = { "LDA", IZX, 6 };
+    table[0xA2] = { "LDX", IMM, 2 };
+    table[0xA4] = { "LDY", ZPG, 3 };
+    table[0xA5] = { "LDA", ZPG, 3 };
+    table[0xA6] = { "LDX", ZPG, 3 };
+    table[0xA8] = { "TAY", IMP, 2 };
+    table[0xA9] = { "LDA", IMM, 2 };
+    table[0xAA] = { "TAX", IMP, 2 };
+    table[0xAC] = { "LDY", ABS, 4 };
+    table[0xAD] = { "LDA", ABS, 4 };
+    table[0xAE] = { "LDX", ABS, 4 };
+    table[0xB0] = { "BCS", REL, 2 };
+    table[0xB1] = { "LDA", IZY, 5 };
+    table[0xB4] = { "LDY", ZPX, 4 };
+    table[0xB5] = { "LDA", ZPX, 4 };
+    table[0xB6] = { "LDX", ZPY, 4 };
+    table[0xB8] = { "CLV", IMP, 2 };
+    table[0xB9] = { "LDA", ABY, 4 };
+    table[0xBA] = { "TSX", IMP, 2 };
+    table[0xBC] = { "LDY", ABX, 4 };
+    table[0xBD] = { "LDA", ABX, 4 };
+    table[0xBE] = { "LDX", ABY, 4 };
+    table[0xC0] = { "CPY", IMM, 2 };
+    table[0xC1] = { "CMP", IZX, 6 };
+    table[0xC4] = { "CPY", ZPG, 3 };
+    table[0xC5] = { "CMP", ZPG, 3 };
+    table[0xC6] = { "DEC", ZPG, 5 };
+    table[0xC8] = { "INY", IMP, 2 };
+    table[0xC9] = { "CMP", IMM, 2 };
+    table[0xCA] = { "DEX", IMP, 2 };
+    table[0xCC] = { "CPY", ABS, 4 };
+    table[0xCD] = { "CMP", ABS, 4 };
+    table[0xCE] = { "DEC", ABS, 6 };
+    table[0xD0] = { "BNE", REL, 2 };
+    table[0xD1] = { "CMP", IZY, 5 };
+    table[0xD5] = { "CMP", ZPX, 4 };
+    table[0xD6] = { "DEC", ZPX, 6 };
+    table[0xD8] = { "CLD", IMP, 2 };
+    table[0xD9] = { "CMP", ABY, 4 };
+    table[0xDD] = { "CMP", ABX, 4 };
+    table[0xDE] = { "DEC", ABX, 7 };
+    table[0xE0] = { "CPX", IMM, 2 };
+    table[0xE1] = { "SBC", IZX, 6 };
+    table[0xE4] = { "CPX", ZPG, 3 };
+    table[0xE5] = { "SBC", ZPG, 3 };
+    table[0xE6] = { "INC", ZPG, 5 };
+    table[0xE8] = { "INX", IMP, 2 };
+    table[0xE9] = { "SBC", IMM, 2 };
+    table[0xEA] = { "NOP", IMP, 2 };
+    table[0xEC] = { "CPX", ABS, 4 };
+    table[0xED] = { "SBC", ABS, 4 };
+    table[0xEE] = { "INC", ABS, 6 };
+    table[0xF0] = { "BEQ", REL, 2 };
+    table[0xF1] = { "SBC", IZY, 5 };
+    table[0xF5] = { "SBC", ZPX, 4 };
+    table[0xF6] = { "INC", ZPX, 6 };
+    table[0xF8] = { "SED", IMP, 2 };
+    table[0xF9] = { "SBC", ABY, 4 };
+    table[0xFD] = { "SBC", ABX, 4 };
+    table[0xFE] = { "INC", ABX, 7 };
+    return table;
+}
+
+inline constexpr std::array<opcode, 256> OPCODES = make_opcodes();
+
+inline constexpr const char *addressing_names[ADDRESSING_MODES] = {
+    "implied", "accumulator", "immediate", "zero page", "zero page,x", "zero page,y",
+    "absolute", "absolute,x", "absolute,y", "indirect", "(indirect,x)", "(indirect),y", "relative"
+};
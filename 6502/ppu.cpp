@@ -0,0 +1,585 @@
+#include "ppu.h"
+
+#include <algorithm>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+const uint64_t NEVER = Scheduler::NEVER;
+
+/* Points of the frame the PPU catches up through, after the 240 lines */
+const uint32_t VBLANK = 240;  /* Vblank flag and NMI */
+const uint32_t PRE = 241;     /* Pre-render line, flags cleared */
+const uint32_t RELOAD = 242;  /* Pre-render line, v reloaded from t */
+const uint32_t END = 243;
+
+PPU::PPU(void) : frames(0), headless(false), cpu(nullptr), mapper(nullptr), next(nullptr), event(-1) {
+    memset(pixels, 0, sizeof(pixels));
+    memset(&regs, 0, sizeof(regs));
+    regs.sprite0_dot = NEVER;
+    regs.overflow_dot = NEVER;
+    io = { &PPU::read, &PPU::write, this };
+    dma_io = { &PPU::read_dma, &PPU::write_dma, this };
+}
+
+void PPU::plug(CPU<BUS> &cpu, Mapper &mapper) {
+    this->cpu = &cpu;
+    this->mapper = &mapper;
+    cpu.bus->map_io(0x20, 0x3F, &io);
+    next = cpu.bus->device(0x40);
+    cpu.bus->map_io(0x40, 0x40, &dma_io);
+    cpu.bus->add_state(&regs, sizeof(regs), &PPU::loaded, this);
+    event = cpu.events.add(&PPU::fired, this);
+    mapper.before_write = &PPU::mapper_write;
+    mapper.listener = this;
+
+    regs.frame = now();
+    mapper.ppu_timing(regs.frame, rendering());
+    schedule();
+}
+
+void PPU::sync() {
+    catch_up(now());
+}
+
+// Helper Functions
+
+/* 2C02 colors */
+const uint32_t NES_COLORS[64] = {
+    0x666666, 0x002A88, 0x1412A7, 0x3B00A4, 0x5C007E, 0x6E0040, 0x6C0600, 0x561D00,
+    0x333500, 0x0B4800, 0x005200, 0x004F08, 0x00404D, 0x000000, 0x000000, 0x000000,
+    0xADADAD, 0x155FD9, 0x4240FF, 0x7527FE, 0xA01ACC, 0xB71E7B, 0xB53120, 0x994E00,
+    0x6B6D00, 0x388700, 0x0C9300, 0x008F32, 0x007C8D, 0x000000, 0x000000, 0x000000,
+    0xFFFEFF, 0x64B0FF, 0x9290FF, 0xC676FF, 0xF36AFF, 0xFE6ECC, 0xFE8170, 0xEA9E22,
+    0xBCBE00, 0x88D800, 0x5CE430, 0x45E082, 0x48CDDE, 0x4F4F4F, 0x000000, 0x000000,
+    0xFFFEFF, 0xC0DFFF, 0xD3D2FF, 0xE8C8FF, 0xFBC2FF, 0xFEC4EA, 0xFECCC5, 0xF7D8A5,
+    0xE4E594, 0xCFEF96, 0xBDF4AB, 0xB3F3CC, 0xB5EBF2, 0xB8B8B8, 0x000000, 0x000000,
+};
+
+/* Colors with the emphasis bits of $2001 (red, green, blue), the channels
+ * not emphasized are dimmed to 3/4 */
+struct color_tables {
+    uint32_t colors[8][64];
+
+    color_tables() {
+        for (int e = 0; e < 8; e++) {
+            for (int c = 0; c < 64; c++) {
+                uint32_t color = 0;
+                for (int channel = 0; channel < 3; channel++) {
+                    int shift = 16 - channel * 8; /* Red, green, blue */
+                    uint32_t value = NES_COLORS[c] >> shift & 0xFF;
+                    if (e && !(e >> channel & 1))
+                        value = value * 3 / 4;
+                    color |= value << shift;
+                }
+                colors[e][c] = color;
+            }
+        }
+    }
+};
+
+const uint32_t *color_table(int emphasis) {
+    static const color_tables tables;
+    return tables.colors[emphasis];
+}
+
+/* Bits of each byte in reverse order, for sprites flipped horizontally */
+struct flip_table {
+    uint8_t bytes[256];
+
+    flip_table() {
+        for (int i = 0; i < 256; i++) {
+            bytes[i] = 0;
+            for (int bit = 0; bit < 8; bit++)
+                bytes[i] |= (i >> bit & 1) << (7 - bit);
+        }
+    }
+};
+
+const flip_table FLIPPED_BYTES;
+const uint8_t *const FLIPPED = FLIPPED_BYTES.bytes;
+
+#if defined(__SSE2__)
+/* Byte i of each tile repeated over the 8 pixels of the tile, two tiles */
+inline __m128i spread(uint8_t a, uint8_t b) {
+    __m128i bytes = _mm_cvtsi32_si128(a | b << 8);
+    bytes = _mm_unpacklo_epi8(bytes, bytes);
+    bytes = _mm_unpacklo_epi16(bytes, bytes);
+    return _mm_unpacklo_epi32(bytes, bytes);
+}
+#endif
+
+/* Bit planes of count tiles (even) to 8 pixels each: the 2 bit color, with
+ * the palette (attr, already shifted by 2) on top when it is not 0 */
+void decode_tiles(const uint8_t *lo, const uint8_t *hi, const uint8_t *attr, int count, uint8_t *out) {
+#if defined(__SSE2__)
+    const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+    const __m128i one = _mm_set1_epi8(1), two = _mm_set1_epi8(2);
+    for (int i = 0; i < count; i += 2) {
+        __m128i l = _mm_cmpeq_epi8(_mm_and_si128(spread(lo[i], lo[i + 1]), bits), bits);
+        __m128i h = _mm_cmpeq_epi8(_mm_and_si128(spread(hi[i], hi[i + 1]), bits), bits);
+        __m128i color = _mm_or_si128(_mm_and_si128(l, one), _mm_and_si128(h, two));
+        __m128i palette = _mm_and_si128(spread(attr[i], attr[i + 1]), _mm_or_si128(l, h));
+        _mm_storeu_si128((__m128i *)(out + i * 8), _mm_or_si128(color, palette));
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        for (int p = 0; p < 8; p++) {
+            uint8_t color = (lo[i] >> (7 - p) & 1) | (hi[i] >> (7 - p) & 1) << 1;
+            out[i * 8 + p] = color ? color | attr[i] : 0;
+        }
+    }
+#endif
+}
+
+/* Layers the sprites (front) and the background (back) of a line into
+ * palette indexes. Sprite pixels are 0x10 | palette << 2 | color, plus 0x20
+ * when behind the background and 0x40 for sprite 0. Returns the first x
+ * where sprite 0 hits the background, -1 when it does not */
+int compose_line(const uint8_t *back, const uint8_t *front, uint8_t *index) {
+    int hit = -1;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128(), three = _mm_set1_epi8(3);
+    const __m128i behind = _mm_set1_epi8(0x20), first = _mm_set1_epi8(0x40), color = _mm_set1_epi8(0x1F);
+    for (int x = 0; x < PPU::WIDTH; x += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(back + x));
+        __m128i s = _mm_load_si128((const __m128i *)(front + x));
+        __m128i b_clear = _mm_cmpeq_epi8(_mm_and_si128(b, three), zero);
+        __m128i s_clear = _mm_cmpeq_epi8(_mm_and_si128(s, three), zero);
+        __m128i s_behind = _mm_cmpeq_epi8(_mm_and_si128(s, behind), behind);
+        __m128i use_b = _mm_or_si128(s_clear, _mm_andnot_si128(b_clear, s_behind));
+        __m128i pixel = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, _mm_and_si128(s, color)));
+        _mm_store_si128((__m128i *)(index + x), pixel);
+        if (hit < 0) {
+            __m128i s_first = _mm_cmpeq_epi8(_mm_and_si128(s, first), first);
+            int mask = _mm_movemask_epi8(_mm_andnot_si128(b_clear, _mm_andnot_si128(s_clear, s_first)));
+            if (mask)
+                hit = x + __builtin_ctz(mask);
+        }
+    }
+#else
+    for (int x = 0; x < PPU::WIDTH; x++) {
+        uint8_t b = back[x], s = front[x];
+        bool use_b = !(s & 3) || ((s & 0x20) && (b & 3));
+        index[x] = use_b ? b : s & 0x1F;
+        if (hit < 0 && (s & 0x40) && (s & 3) && (b & 3))
+            hit = x;
+    }
+#endif
+    return hit;
+}
+
+void lookup_colors_plain(const uint8_t *index, const uint32_t *colors, uint32_t *out) {
+    for (int x = 0; x < PPU::WIDTH; x++)
+        out[x] = colors[index[x]];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) void lookup_colors_avx2(const uint8_t *index, const uint32_t *colors, uint32_t *out) {
+    for (int x = 0; x < PPU::WIDTH; x += 8) {
+        __m256i i = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(index + x)));
+        _mm256_storeu_si256((__m256i *)(out + x), _mm256_i32gather_epi32((const int *)colors, i, 4));
+    }
+}
+
+bool has_avx2() {
+    __builtin_cpu_init(); /* Might run before the constructor doing it */
+    return __builtin_cpu_supports("avx2");
+}
+
+const bool HAS_AVX2 = has_avx2();
+#endif
+
+/* Palette indexes of a line to colors */
+void lookup_colors(const uint8_t *index, const uint32_t *colors, uint32_t *out) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (HAS_AVX2) {
+        lookup_colors_avx2(index, colors, out);
+        return;
+    }
+#endif
+    lookup_colors_plain(index, colors, out);
+}
+
+// Rendering
+
+/* Dot, from the start of the frame, each step is done at */
+uint64_t PPU::point(uint32_t step) const {
+    if (step < VBLANK)
+        return step * LINE + 257; /* Once the line is out */
+    switch (step) {
+    case VBLANK: return 241 * LINE + 1;
+    case PRE: return 261 * LINE + 1;
+    case RELOAD: return 261 * LINE + 304;
+    }
+    return FRAME - (regs.odd && rendering());
+}
+
+void PPU::catch_up(uint64_t dot) {
+    while (dot >= regs.frame + point(regs.step)) {
+        uint32_t step = regs.step++;
+        if (step < VBLANK) {
+            render_line(step);
+        } else if (step == VBLANK) {
+            regs.vblank = 1;
+            frames++;
+            if (regs.ctrl & 0x80)
+                cpu->nmi();
+        } else if (step == PRE) {
+            regs.vblank = 0;
+            regs.sprite0_dot = NEVER;
+            regs.overflow_dot = NEVER;
+        } else if (step == RELOAD) {
+            if (rendering())
+                regs.v = regs.t;
+        } else {
+            regs.frame += point(END);
+            regs.odd ^= 1;
+            regs.step = 0;
+            mapper->ppu_timing(regs.frame, rendering());
+        }
+    }
+}
+
+/* The event comes for the NMI and to finish the frame, lines in between
+ * wait for the CPU */
+void PPU::schedule() {
+    uint64_t dot = regs.frame + point(regs.step <= VBLANK ? VBLANK : END);
+    cpu->events.schedule(event, (dot + 2) / 3);
+}
+
+/* Bit planes of the background tile k tiles right of v, with its palette */
+void PPU::fetch_tile(uint16_t v, int k, uint8_t &lo, uint8_t &hi, uint8_t &attr) {
+    int coarse = (v & 0x1F) + k;
+    v = (v & ~0x1F) | (coarse & 0x1F);
+    if (coarse >= 32)
+        v ^= 0x0400;
+    uint8_t tile = nametable(0x2000 | (v & 0x0FFF));
+    uint8_t at = nametable(0x23C0 | (v & 0x0C00) | (v >> 4 & 0x38) | (v >> 2 & 0x07));
+    attr = (at >> ((v >> 4 & 4) | (v & 2)) & 3) << 2;
+    uint16_t addr = (regs.ctrl & 0x10) << 8 | tile << 4 | v >> 12;
+    lo = mapper->chr[addr >> 10][addr & 0x3FF];
+    hi = mapper->chr[addr >> 10][(addr & 0x3FF) + 8];
+}
+
+/* Bit planes of the row of the sprite, flipped so bit 7 is its left pixel */
+void PPU::fetch_sprite(const uint8_t *sprite, int row, uint8_t &lo, uint8_t &hi) {
+    int height = regs.ctrl & 0x20 ? 16 : 8;
+    uint8_t tile = sprite[1], attr = sprite[2];
+    if (attr & 0x80)
+        row = height - 1 - row;
+    uint16_t addr;
+    if (height == 16)
+        addr = (tile & 1) << 12 | (tile & 0xFE) << 4 | (row & 8) << 1 | (row & 7);
+    else
+        addr = (regs.ctrl & 0x08) << 9 | tile << 4 | row;
+    lo = peek(addr);
+    hi = peek(addr + 8);
+    if (attr & 0x40) {
+        lo = FLIPPED[lo];
+        hi = FLIPPED[hi];
+    }
+}
+
+/* Sprites on the line into front, at most 8, or only counted when front is
+ * null. Raises the overflow flag when there are more */
+void PPU::sprites(int line, uint8_t *front) {
+    int height = regs.ctrl & 0x20 ? 16 : 8;
+    int found = 0;
+    for (int i = 0; i < 64; i++) {
+        const uint8_t *sprite = regs.oam + i * 4;
+        int row = line - sprite[0] - 1;
+        if (row < 0 || row >= height)
+            continue;
+        if (++found > 8) {
+            if (regs.overflow_dot == NEVER)
+                regs.overflow_dot = regs.frame + (line - 1) * LINE + 256; /* Found during the line before */
+            break;
+        }
+        if (!front)
+            continue;
+
+        uint8_t lo, hi, x = sprite[3];
+        fetch_sprite(sprite, row, lo, hi);
+        uint8_t flags = 0x10 | (sprite[2] & 3) << 2 | (sprite[2] & 0x20) | (i ? 0 : 0x40);
+        for (int p = 0; p < 8 && x + p < WIDTH; p++) {
+            uint8_t color = (lo >> (7 - p) & 1) | (hi >> (7 - p) & 1) << 1;
+            if (color && !(front[x + p] & 3))
+                front[x + p] = flags | color;
+        }
+    }
+}
+
+/* Headless lines only need sprite 0 against the two background tiles
+ * under it. Same result as compose_line on the whole line */
+int PPU::sprite0_hit(int line) {
+    if ((regs.mask & 0x18) != 0x18)
+        return -1;
+    int row = line - regs.oam[0] - 1;
+    if (row < 0 || row >= (regs.ctrl & 0x20 ? 16 : 8))
+        return -1;
+    uint8_t lo, hi, attr;
+    fetch_sprite(regs.oam, row, lo, hi);
+    int x = regs.oam[3];
+    uint32_t sprite = (lo | hi) << 24; /* Bit 31 is pixel x */
+
+    /* 16 background pixels from the tile under x, bit 31 is its left pixel */
+    int first = (x + regs.x) / 8;
+    uint8_t lo1, hi1, lo2, hi2;
+    fetch_tile(regs.v, first, lo1, hi1, attr);
+    fetch_tile(regs.v, first + 1, lo2, hi2, attr);
+    uint32_t back = ((lo1 | hi1) << 8 | (lo2 | hi2)) << 16;
+    back <<= (x + regs.x) % 8;
+
+    uint32_t hits = sprite & back;
+    if (x < 8) {
+        int clip = !(regs.mask & 0x02) || !(regs.mask & 0x04) ? 8 - x : 0;
+        hits &= ~0u >> clip; /* Left pixels hidden */
+    }
+    if (x > 248)
+        hits &= ~0u << (32 - (WIDTH - x)); /* Off the right edge */
+    return hits ? x + __builtin_clz(hits) : -1;
+}
+
+void PPU::render_line(int line) {
+    if (!rendering()) {
+        if (!headless) {
+            uint32_t *out = pixels + line * WIDTH;
+            const uint32_t *rgb = color_table(regs.mask >> 5);
+            std::fill(out, out + WIDTH, rgb[regs.palette[0] & (regs.mask & 0x01 ? 0x30 : 0x3F)]);
+        }
+        return;
+    }
+
+    int hit = -1;
+    if (headless) {
+        if (regs.sprite0_dot == NEVER)
+            hit = sprite0_hit(line);
+        sprites(line, nullptr);
+    } else {
+        hit = draw_line(line);
+    }
+    if (hit >= 0 && hit < 255 && regs.sprite0_dot == NEVER)
+        regs.sprite0_dot = regs.frame + line * LINE + hit + 1;
+
+    /* Dot 256 goes down a line, dot 257 takes the horizontal scroll back */
+    if ((regs.v & 0x7000) != 0x7000) {
+        regs.v += 0x1000;
+    } else {
+        regs.v &= ~0x7000;
+        int y = regs.v >> 5 & 0x1F;
+        if (y == 29) {
+            y = 0;
+            regs.v ^= 0x0800;
+        } else if (y == 31) {
+            y = 0;
+        } else {
+            y++;
+        }
+        regs.v = (regs.v & ~0x03E0) | y << 5;
+    }
+    regs.v = (regs.v & ~0x041F) | (regs.t & 0x041F);
+}
+
+/* Pixels of a line while rendering, returns where sprite 0 hits */
+int PPU::draw_line(int line) {
+    /* 34 tiles, the line scrolled by fine X takes 33 */
+    alignas(16) uint8_t back[34 * 8];
+    alignas(16) uint8_t front[WIDTH];
+    alignas(16) uint8_t index[WIDTH];
+    if (regs.mask & 0x08) {
+        uint8_t lo[34], hi[34], attr[34];
+        for (int i = 0; i < 34; i++)
+            fetch_tile(regs.v, i, lo[i], hi[i], attr[i]);
+        decode_tiles(lo, hi, attr, 34, back);
+        if (!(regs.mask & 0x02))
+            memset(back + regs.x, 0, 8);
+    } else {
+        memset(back, 0, sizeof(back));
+    }
+
+    memset(front, 0, sizeof(front));
+    sprites(line, regs.mask & 0x10 ? front : nullptr);
+    if (!(regs.mask & 0x04))
+        memset(front, 0, 8);
+
+    int hit = compose_line(back + regs.x, front, index);
+
+    const uint32_t *rgb = color_table(regs.mask >> 5);
+    uint8_t gray = regs.mask & 0x01 ? 0x30 : 0x3F;
+    uint32_t colors[32];
+    for (int i = 0; i < 32; i++)
+        colors[i] = rgb[palette(i) & gray];
+    lookup_colors(index, colors, pixels + line * WIDTH);
+    return hit;
+}
+
+// Memory
+
+uint8_t &PPU::nametable(uint16_t addr) {
+    return regs.nametables[mapper->nametable[addr >> 10 & 3] * 0x400 + (addr & 0x3FF)];
+}
+
+/* $3F10, $3F14, $3F18 and $3F1C are the same as $3F00, $3F04... */
+uint8_t &PPU::palette(uint16_t addr) {
+    addr &= 0x1F;
+    if ((addr & 0x13) == 0x10)
+        addr &= ~0x10;
+    return regs.palette[addr];
+}
+
+uint8_t PPU::peek(uint16_t addr) {
+    addr &= 0x3FFF;
+    if (addr < 0x2000)
+        return mapper->chr[addr >> 10][addr & 0x3FF];
+    if (addr < 0x3F00)
+        return nametable(addr);
+    return palette(addr);
+}
+
+void PPU::poke(uint16_t addr, uint8_t val) {
+    addr &= 0x3FFF;
+    if (addr < 0x2000) {
+        uint8_t *page = mapper->chr_write[addr >> 10];
+        if (page)
+            page[addr & 0x3FF] = val;
+    } else if (addr < 0x3F00) {
+        nametable(addr) = val;
+    } else {
+        palette(addr) = val & 0x3F;
+    }
+}
+
+// Registers
+
+/* Write only registers read back the last value written (open bus) */
+uint8_t PPU::read(void *device, uint16_t addr) {
+    PPU &ppu = *(PPU *)device;
+    auto &regs = ppu.regs;
+    uint64_t now = ppu.now();
+    ppu.catch_up(now);
+
+    switch (addr & 7) {
+    case 2: {
+        /* Sprite 0 hit is known once its line is drawn, the line under
+         * way is drawn early for games polling for it */
+        uint64_t line = (now - regs.frame) / LINE;
+        if (ppu.rendering() && regs.sprite0_dot == NEVER && line < VBLANK && regs.step == line)
+            ppu.catch_up(regs.frame + ppu.point(regs.step));
+        uint8_t status = regs.vblank << 7 | (regs.sprite0_dot <= now) << 6 | (regs.overflow_dot <= now) << 5;
+        regs.latch = status | (regs.latch & 0x1F);
+        regs.vblank = 0;
+        regs.w = 0;
+        break;
+    }
+    case 4:
+        regs.latch = regs.oam[regs.oam_addr];
+        if ((regs.oam_addr & 3) == 2)
+            regs.latch &= 0xE3; /* Unused bits of the attributes */
+        break;
+    case 7: {
+        uint16_t v = regs.v & 0x3FFF;
+        if (v >= 0x3F00) {
+            regs.latch = ppu.palette(v) | (regs.latch & 0xC0);
+            regs.buffer = ppu.peek(v - 0x1000); /* The nametable under the palette */
+        } else {
+            regs.latch = regs.buffer;
+            regs.buffer = ppu.peek(v);
+        }
+        regs.v += regs.ctrl & 0x04 ? 32 : 1;
+        break;
+    }
+    }
+    return regs.latch;
+}
+
+void PPU::write(void *device, uint16_t addr, uint8_t val) {
+    PPU &ppu = *(PPU *)device;
+    auto &regs = ppu.regs;
+    ppu.catch_up(ppu.now());
+    regs.latch = val;
+
+    switch (addr & 7) {
+    case 0: {
+        bool enabled = regs.ctrl & 0x80;
+        regs.ctrl = val;
+        regs.t = (regs.t & ~0x0C00) | (val & 3) << 10;
+        if (!enabled && (val & 0x80) && regs.vblank)
+            ppu.cpu->nmi();
+        break;
+    }
+    case 1: {
+        bool rendering = ppu.rendering();
+        regs.mask = val;
+        if (rendering != ppu.rendering())
+            ppu.mapper->ppu_timing(regs.frame, ppu.rendering());
+        break;
+    }
+    case 3:
+        regs.oam_addr = val;
+        break;
+    case 4:
+        regs.oam[regs.oam_addr++] = val;
+        break;
+    case 5:
+        if (!regs.w) {
+            regs.t = (regs.t & ~0x001F) | val >> 3;
+            regs.x = val & 7;
+        } else {
+            regs.t = (regs.t & 0x0C1F) | (val & 7) << 12 | (val & 0xF8) << 2;
+        }
+        regs.w ^= 1;
+        break;
+    case 6:
+        if (!regs.w) {
+            regs.t = (regs.t & 0x00FF) | (val & 0x3F) << 8;
+        } else {
+            regs.t = (regs.t & 0xFF00) | val;
+            regs.v = regs.t;
+        }
+        regs.w ^= 1;
+        break;
+    case 7:
+        ppu.poke(regs.v, val);
+        regs.v += regs.ctrl & 0x04 ? 32 : 1;
+        break;
+    }
+}
+
+uint8_t PPU::read_dma(void *device, uint16_t addr) {
+    PPU &ppu = *(PPU *)device;
+    if (ppu.next && ppu.next->read)
+        return ppu.next->read(ppu.next->device, addr);
+    return addr >> 8;
+}
+
+/* OAM DMA copies a page of CPU memory to OAM, the CPU stops for 513
+ * cycles, 514 when it starts on an odd cycle */
+void PPU::write_dma(void *device, uint16_t addr, uint8_t val) {
+    PPU &ppu = *(PPU *)device;
+    if (addr != 0x4014) {
+        if (ppu.next && ppu.next->write)
+            ppu.next->write(ppu.next->device, addr, val);
+        return;
+    }
+    ppu.catch_up(ppu.now());
+    for (int i = 0; i < 0x100; i++)
+        ppu.regs.oam[(ppu.regs.oam_addr + i) & 0xFF] = ppu.cpu->bus->read(val << 8 | i);
+    ppu.cpu->stall(513 + (ppu.cpu->cycles & 1));
+}
+
+void PPU::fired(void *device, uint64_t cycle) {
+    PPU &ppu = *(PPU *)device;
+    ppu.catch_up(cycle * 3);
+    ppu.schedule();
+}
+
+void PPU::loaded(void *device) {
+    ((PPU *)device)->schedule();
+}
+
+void PPU::mapper_write(void *device) {
+    PPU &ppu = *(PPU *)device;
+    ppu.catch_up(ppu.now());
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "bus.h"
+#include "cpu.h"
+#include "mapper.h"
+
+/* Picture processing unit (2C02, NTSC)
+ * Registers on $2000 - $3FFF (8 mirrored) and OAM DMA on $4014. The PPU
+ * is not stepped dot by dot: it catches up, a whole scanline at a time,
+ * when the CPU touches one of its registers, the mapper is about to switch
+ * banks, or an event comes (vblank and the end of the frame). Each line is
+ * drawn with the registers as they are when it is drawn, so changes made
+ * in the middle of a line show from the next one.
+ * Tiles are decoded and layered 16 pixels at a time with SSE2, colors are
+ * looked up 8 pixels at a time with AVX2 when the CPU has it. */
+class PPU {
+    public:
+    static const int WIDTH = 256, HEIGHT = 240;
+    static const uint64_t LINE = 341;        /* Dots */
+    static const uint64_t FRAME = 341 * 262; /* One dot less on odd frames while rendering */
+
+    uint32_t pixels[WIDTH * HEIGHT]; /* 0x00RRGGBB */
+    uint64_t frames;                 /* Frames done since plug */
+
+    /* No pixels: lines only do what the CPU can see, sprite 0 hit (looked
+     * for under sprite 0 only), sprite overflow and the scroll, timing and
+     * flags stay the same. pixels is left as it was. Can be switched at
+     * any time, the state is the same either way */
+    bool headless;
+
+    PPU();
+    PPU(const PPU &) = delete;
+    PPU &operator=(const PPU &) = delete;
+
+    /* Maps the registers and adds the PPU to the save states and events.
+     * OAM DMA shares its page with the controllers and the APU, plug the
+     * PPU after them: it passes on the accesses that are not its own */
+    void plug(CPU<BUS> &, Mapper &);
+
+    /* Catches up to the CPU */
+    void sync();
+
+    private:
+    CPU<BUS> *cpu;
+    Mapper *mapper;
+    BUS::io io, dma_io;
+    const BUS::io *next; /* Device on the page of $4014 before the PPU */
+    int event;
+
+    struct {
+        uint8_t ctrl, mask, vblank, oam_addr;
+        uint16_t v, t; /* VRAM address and the one rendering reloads it from */
+        uint8_t x, w;  /* Fine X scroll and the write toggle of $2005/$2006 */
+        uint8_t buffer, latch; /* $2007 read buffer and the open bus */
+        uint8_t odd;
+        uint8_t pad[3];
+        uint32_t step;  /* Next point of the frame to go through */
+        uint64_t frame; /* Dot the frame started at */
+        uint64_t sprite0_dot, overflow_dot; /* When the flags go up, NEVER if they do not */
+        uint8_t oam[256];
+        uint8_t palette[32];
+        uint8_t nametables[0x1000]; /* 2 KB in the console, 4 for four screen */
+    } regs;
+
+    inline uint64_t now() const {
+        return cpu->cycles * 3;
+    }
+    inline bool rendering() const {
+        return regs.mask & 0x18;
+    }
+
+    uint64_t point(uint32_t step) const;
+    void catch_up(uint64_t dot);
+    void schedule();
+    void render_line(int line);
+    int draw_line(int line);
+    void sprites(int line, uint8_t *front);
+    int sprite0_hit(int line);
+    void fetch_tile(uint16_t v, int k, uint8_t &lo, uint8_t &hi, uint8_t &attr);
+    void fetch_sprite(const uint8_t *sprite, int row, uint8_t &lo, uint8_t &hi);
+
+    uint8_t peek(uint16_t addr);
+    void poke(uint16_t addr, uint8_t val);
+    uint8_t &nametable(uint16_t addr);
+    uint8_t &palette(uint16_t addr);
+
+    static uint8_t read(void *, uint16_t);
+    static void write(void *, uint16_t, uint8_t);
+    static uint8_t read_dma(void *, uint16_t);
+    static void write_dma(void *, uint16_t, uint8_t);
+    static void fired(void *, uint64_t);
+    static void loaded(void *);
+    static void mapper_write(void *);
+};
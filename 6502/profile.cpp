@@ -0,0 +1,105 @@
+#include "profile.h"
+#include "opcodes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+Profile::Profile(unsigned sample_every, bool exact) : exact(exact), sample_every(sample_every ? sample_every : 1), random(0x6502) {
+    clear();
+
+    /* Smallest of a few back to back clock reads */
+    timer_ns = UINT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+        auto start = std::chrono::steady_clock::now();
+        auto end = std::chrono::steady_clock::now();
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        timer_ns = std::min(timer_ns, ns);
+    }
+}
+
+void Profile::clear() {
+    memset(opcodes, 0, sizeof(opcodes));
+    memset(hot_pcs, 0, sizeof(hot_pcs));
+    sample_at = 0;
+    time_next = false;
+}
+
+/* The sample stands for sample_every cycles of instructions like it */
+void Profile::count_sampled(uint8_t op_code, uint64_t cycles) {
+    opcodes[op_code].count += (sample_every + cycles / 2) / cycles;
+    opcodes[op_code].cycles += sample_every;
+}
+
+// Helper Functions
+
+double percent(uint64_t part, uint64_t total) {
+    return total ? 100.0 * part / total : 0;
+}
+
+/* Host time per instruction, from the sampled ones */
+double average_ns(const Profile::counter &c) {
+    return c.samples ? (double)c.ns / c.samples : 0;
+}
+
+void report_counter(FILE *out, const char *name, const Profile::counter &c, uint64_t total) {
+    fprintf(out, "%-24s %12llu %6.2f%% %14llu %6.2f %8.1f\n", name, (unsigned long long)c.count,
+        percent(c.count, total), (unsigned long long)c.cycles, c.count ? (double)c.cycles / c.count : 0,
+        average_ns(c));
+}
+
+void Profile::report(FILE *out, unsigned top) const {
+    uint64_t total = 0, total_cycles = 0;
+    counter modes[ADDRESSING_MODES] = {};
+    std::vector<int> order;
+    for (int op = 0; op < 0x100; op++) {
+        const counter &c = opcodes[op];
+        if (!c.count)
+            continue;
+        total += c.count;
+        total_cycles += c.cycles;
+        counter &m = modes[OPCODES[op].mode];
+        m.count += c.count;
+        m.cycles += c.cycles;
+        m.samples += c.samples;
+        m.ns += c.ns;
+        order.push_back(op);
+    }
+    std::sort(order.begin(), order.end(), [this](int a, int b) {
+        return opcodes[a].count > opcodes[b].count;
+    });
+
+    fprintf(out, "instructions %llu cycles %llu %s, timed every %u cycles\n\n", (unsigned long long)total,
+        (unsigned long long)total_cycles, exact ? "exact" : "estimated", sample_every);
+
+    fprintf(out, "%-24s %12s %7s %14s %6s %8s\n", "opcode", "count", "share", "cycles", "cpi", "ns");
+    for (int op : order) {
+        char name[32];
+        snprintf(name, sizeof(name), "%02X %s %s", op, OPCODES[op].name,
+            OPCODES[op].mode == IMP ? "" : addressing_names[OPCODES[op].mode]);
+        report_counter(out, name, opcodes[op], total);
+    }
+
+    fprintf(out, "\n%-24s %12s %7s %14s %6s %8s\n", "mode", "count", "share", "cycles", "cpi", "ns");
+    for (int mode = 0; mode < ADDRESSING_MODES; mode++)
+        if (modes[mode].count)
+            report_counter(out, addressing_names[mode], modes[mode], total);
+
+    std::vector<uint16_t> pcs;
+    uint64_t samples = 0;
+    for (uint16_t i = 0; i < 0x8000; i++) {
+        samples += hot_pcs[i];
+        if (hot_pcs[i])
+            pcs.push_back(i);
+    }
+    size_t shown = std::min<size_t>(top, pcs.size());
+    std::partial_sort(pcs.begin(), pcs.begin() + shown, pcs.end(), [this](uint16_t a, uint16_t b) {
+        return hot_pcs[a] > hot_pcs[b];
+    });
+
+    fprintf(out, "\n%-24s %12s %7s\n", "pc", "samples", "share");
+    for (size_t i = 0; i < shown; i++)
+        fprintf(out, "%04X %19s %12u %6.2f%%\n", 0x8000 + pcs[i], "", hot_pcs[pcs[i]],
+            percent(hot_pcs[pcs[i]], samples));
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+/* Execution profile
+ * A CPU built with CPU_PROFILE and given a Profile counts the instructions
+ * it runs and the cycles they take, per opcode. Samples are due at a cycle
+ * about every sample_every cycles (at random, so loops do not always land
+ * on the same instruction): the instruction running on that cycle has its
+ * PC put in a histogram of the PRG-ROM window ($8000 - $FFFF), and the one
+ * after it is timed on the host. Without exact counts only the samples are
+ * counted, each standing for sample_every cycles, and run_for treats them
+ * like events so the instructions in between run without any profiling
+ * code, cheap enough to be left on. Addressing modes are summed from the
+ * opcodes in the report. Without CPU_PROFILE the CPU has no profiling code
+ * at all. */
+class Profile {
+    public:
+    struct counter {
+        uint64_t count;
+        uint64_t cycles;
+        uint64_t samples; /* Timed ones */
+        uint64_t ns; /* Host time of the timed instructions */
+    };
+
+    counter opcodes[0x100];
+    uint32_t hot_pcs[0x8000]; /* Samples per PC, $8000 + index */
+
+    const bool exact;
+
+    Profile(unsigned sample_every = 1024, bool exact = true);
+    void clear();
+
+    /* Counters per opcode and per addressing mode, then the top hot PCs */
+    void report(FILE *, unsigned top = 20) const;
+
+    /* Cycle the next sample is taken at */
+    inline uint64_t next() const {
+        return sample_at;
+    }
+
+    inline bool due(uint64_t cycle) const {
+        return cycle >= sample_at;
+    }
+
+    inline void count(uint8_t op_code, uint64_t cycles) {
+        opcodes[op_code].count++;
+        opcodes[op_code].cycles += cycles;
+    }
+
+    /* Times the next instruction, after a sample */
+    inline bool timing() const {
+        return time_next;
+    }
+
+    /* Takes the sample due, the instruction ended on cycle now */
+    void add_sample(uint8_t op_code, uint16_t pc, uint64_t cycles, uint64_t now) {
+        if (!exact)
+            count_sampled(op_code, cycles);
+        if (pc & 0x8000)
+            hot_pcs[pc & 0x7FFF]++;
+        time_next = true;
+
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        sample_at = now + 1 + random % (2 * sample_every - 1); /* sample_every on average */
+    }
+
+    void add_time(uint8_t op_code, uint64_t ns) {
+        opcodes[op_code].samples++;
+        opcodes[op_code].ns += ns > timer_ns ? ns - timer_ns : 0;
+        time_next = false;
+    }
+
+    private:
+    void count_sampled(uint8_t, uint64_t);
+
+    unsigned sample_every;
+    uint64_t sample_at;
+    bool time_next;
+    uint32_t random;
+    uint64_t timer_ns; /* What reading the clock twice takes, taken out of the samples */
+};
@@ -0,0 +1,165 @@
+#include "rewind.h"
+
+#include <cstring>
+
+template <class Bus>
+Rewind<Bus>::Rewind(CPU<Bus> &cpu, size_t size, unsigned interval, frame_fn run_frame, void *context)
+    : cpu(cpu), run(run_frame), context(context), interval(interval ? interval : 1), frames(0),
+      state_size(0), ring(new uint8_t[size]), ring_size(size), used(0), since_key(0) {
+}
+
+template <class Bus>
+Rewind<Bus>::~Rewind(void) {
+}
+
+template <class Bus>
+uint64_t Rewind<Bus>::oldest() const {
+    return entries.empty() ? frames : entries.front().frame;
+}
+
+template <class Bus>
+void Rewind<Bus>::run_frame() {
+    /* After a seek to a snapshot the frame is already there */
+    if (frames % interval == 0 && (entries.empty() || entries.back().frame != frames))
+        record();
+    run(context, cpu, frames);
+    frames++;
+}
+
+template <class Bus>
+bool Rewind<Bus>::seek(uint64_t frame) {
+    if (frame > frames || entries.empty() || frame < entries.front().frame)
+        return false;
+
+    size_t i = entries.size() - 1;
+    while (entries[i].frame > frame)
+        i--;
+    while (entries.size() > i + 1) {
+        used -= entries.back().size;
+        entries.pop_back();
+    }
+
+    /* Back to the key, then forward applying the deltas */
+    size_t key = i;
+    while (!entries[key].key)
+        key--;
+    memset(last.get(), 0, state_size);
+    for (size_t j = key; j <= i; j++)
+        decode(entries[j], last.get());
+    since_key = i - key + 1;
+
+    cpu.load_state(last.get());
+    for (frames = entries[i].frame; frames < frame; frames++)
+        run(context, cpu, frames);
+    return true;
+}
+
+/* The state size changes when the bus gets new state regions, start over */
+template <class Bus>
+void Rewind<Bus>::resize_states() {
+    state_size = cpu.state_size();
+    last.reset(new uint8_t[state_size]());
+    state.reset(new uint8_t[state_size]);
+    /* Worst case is a changed byte every other byte, 5 bytes for 2 */
+    packed.reset(new uint8_t[state_size * 3 + 8]);
+    entries.clear();
+    used = 0;
+    since_key = 0;
+}
+
+template <class Bus>
+void Rewind<Bus>::record() {
+    if (cpu.state_size() != state_size)
+        resize_states();
+    cpu.save_state(state.get());
+
+    bool key = since_key % KEY_EVERY == 0;
+    size_t size = encode(key ? nullptr : last.get(), state.get(), packed.get());
+    while (ring_size - used < size && !entries.empty())
+        drop_oldest();
+    if (entries.empty() && !key) {
+        key = true;
+        size = encode(nullptr, state.get(), packed.get());
+    }
+    if (size > ring_size)
+        return;
+
+    size_t offset = 0;
+    if (!entries.empty())
+        offset = (entries.back().offset + entries.back().size) % ring_size;
+    copy_in(offset, packed.get(), size);
+    entries.push_back({ frames, offset, size, key });
+    used += size;
+    since_key = key ? 1 : since_key + 1;
+    memcpy(last.get(), state.get(), state_size);
+}
+
+/* A key goes with all the deltas built on it */
+template <class Bus>
+void Rewind<Bus>::drop_oldest() {
+    do {
+        used -= entries.front().size;
+        entries.pop_front();
+    } while (!entries.empty() && !entries.front().key);
+}
+
+/* Runs of unchanged bytes and of changed bytes, each pair as two 16 bit
+ * lengths followed by the changed bytes XORed with the previous ones.
+ * Without previous state the bytes are XORed with zeros */
+template <class Bus>
+size_t Rewind<Bus>::encode(const uint8_t *prev, const uint8_t *cur, uint8_t *out) {
+    size_t size = 0;
+    size_t i = 0;
+    while (i < state_size) {
+        size_t same = 0;
+        while (i + same < state_size && same < 0xFFFF && cur[i + same] == (prev ? prev[i + same] : 0))
+            same++;
+        i += same;
+        size_t changed = 0;
+        while (i + changed < state_size && changed < 0xFFFF && cur[i + changed] != (prev ? prev[i + changed] : 0))
+            changed++;
+
+        out[size++] = same;
+        out[size++] = same >> 8;
+        out[size++] = changed;
+        out[size++] = changed >> 8;
+        for (size_t j = 0; j < changed; j++)
+            out[size++] = cur[i + j] ^ (prev ? prev[i + j] : 0);
+        i += changed;
+    }
+    return size;
+}
+
+template <class Bus>
+void Rewind<Bus>::decode(const entry &e, uint8_t *out) {
+    copy_out(e.offset, packed.get(), e.size);
+    const uint8_t *in = packed.get();
+    const uint8_t *end = in + e.size;
+    size_t i = 0;
+    while (in < end) {
+        size_t same = in[0] | (in[1] << 8);
+        size_t changed = in[2] | (in[3] << 8);
+        in += 4;
+        i += same;
+        for (size_t j = 0; j < changed; j++)
+            out[i++] ^= *in++;
+    }
+}
+
+/* The ring wraps around, an entry can be split in two */
+template <class Bus>
+void Rewind<Bus>::copy_in(size_t offset, const uint8_t *data, size_t size) {
+    size_t first = size < ring_size - offset ? size : ring_size - offset;
+    memcpy(ring.get() + offset, data, first);
+    memcpy(ring.get(), data + first, size - first);
+}
+
+template <class Bus>
+void Rewind<Bus>::copy_out(size_t offset, uint8_t *data, size_t size) {
+    size_t first = size < ring_size - offset ? size : ring_size - offset;
+    memcpy(data, ring.get() + offset, first);
+    memcpy(data + first, ring.get(), size - first);
+}
+
+/* Buses the rewind buffer is built for */
+template class Rewind<BUS>;
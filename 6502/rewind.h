@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+
+#include "cpu.h"
+
+/* Rewind buffer
+ * Every interval frames the state of the machine is saved into a ring of
+ * a fixed number of bytes. Each snapshot is stored as the XOR of the one
+ * before, which is mostly zeros, run length encoded. Every KEY_EVERY
+ * snapshots one is stored whole (XOR against zeros) so a snapshot only
+ * needs the ones back to its key. When the ring is full the oldest key
+ * goes with all the snapshots after it.
+ *
+ * Frames are run through the callback given so seeking can run the frames
+ * between the snapshot and the frame asked for the same way they were run
+ * the first time, input included. */
+template <class Bus>
+class Rewind {
+    public:
+    typedef void (*frame_fn)(void *, CPU<Bus> &, uint64_t frame);
+
+    static const unsigned KEY_EVERY = 16;
+
+    Rewind(CPU<Bus> &, size_t size, unsigned interval, frame_fn run_frame, void *context);
+    ~Rewind();
+
+    uint64_t frame() const { /* Frames run so far */
+        return frames;
+    }
+    uint64_t oldest() const; /* First frame seek can go back to */
+
+    void run_frame(); /* Runs the next frame, recording it when due */
+
+    /* Goes back to the frame, forgets everything recorded after it. False
+     * when the frame is older than the buffer or has not been run yet */
+    bool seek(uint64_t frame);
+
+    private:
+    struct entry {
+        uint64_t frame;
+        size_t offset; /* In the ring */
+        size_t size;
+        bool key;
+    };
+
+    CPU<Bus> &cpu;
+    frame_fn run;
+    void *context;
+    unsigned interval;
+    uint64_t frames;
+
+    size_t state_size;
+    std::unique_ptr<uint8_t[]> last; /* State of the newest snapshot */
+    std::unique_ptr<uint8_t[]> state;
+    std::unique_ptr<uint8_t[]> packed; /* Snapshot being encoded */
+
+    std::unique_ptr<uint8_t[]> ring;
+    size_t ring_size;
+    size_t used;
+    std::deque<entry> entries; /* Oldest first */
+    unsigned since_key;
+
+    void record();
+    void resize_states();
+    size_t encode(const uint8_t *, const uint8_t *, uint8_t *);
+    void decode(const entry &, uint8_t *);
+    void drop_oldest();
+    void copy_in(size_t, const uint8_t *, size_t);
+    void copy_out(size_t, uint8_t *, size_t);
+};
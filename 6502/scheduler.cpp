@@ -0,0 +1,109 @@
+#include "scheduler.h"
+
+Scheduler::Scheduler(void) : limit(0), count(0), size(0) {
+    for (event &e : events)
+        e = { nullptr, nullptr, NEVER, -1 };
+}
+
+int Scheduler::add(callback fire, void *device) {
+    if (count == MAX_EVENTS)
+        return -1;
+    events[count] = { fire, device, NEVER, -1 };
+    return count++;
+}
+
+void Scheduler::schedule(int id, uint64_t cycle) {
+    event &e = events[id];
+    uint64_t before = e.cycle;
+    e.cycle = cycle;
+    if (e.slot < 0) {
+        place(size++, id);
+        sift_up(e.slot);
+    } else if (cycle < before) {
+        sift_up(e.slot);
+    } else {
+        sift_down(e.slot);
+    }
+    if (cycle < limit)
+        limit = cycle;
+}
+
+void Scheduler::cancel(int id) {
+    if (events[id].slot >= 0)
+        remove(id);
+}
+
+uint64_t Scheduler::when(int id) const {
+    return events[id].slot >= 0 ? events[id].cycle : NEVER;
+}
+
+void Scheduler::save(uint64_t *cycles) const {
+    for (int id = 0; id < MAX_EVENTS; id++)
+        cycles[id] = when(id);
+}
+
+void Scheduler::restore(const uint64_t *cycles) {
+    for (int id = 0; id < count; id++) {
+        if (cycles[id] == NEVER)
+            cancel(id);
+        else
+            schedule(id, cycles[id]);
+    }
+    limit = 0;
+}
+
+void Scheduler::run(uint64_t cycle) {
+    while (size && events[heap[0]].cycle <= cycle) {
+        int id = heap[0];
+        uint64_t due = events[id].cycle;
+        remove(id);
+        events[id].fire(events[id].device, due);
+    }
+}
+
+// Heap
+
+void Scheduler::place(int slot, int id) {
+    heap[slot] = id;
+    events[id].slot = slot;
+}
+
+void Scheduler::sift_up(int slot) {
+    int id = heap[slot];
+    while (slot > 0) {
+        int parent = (slot - 1) / 2;
+        if (events[heap[parent]].cycle <= events[id].cycle)
+            break;
+        place(slot, heap[parent]);
+        slot = parent;
+    }
+    place(slot, id);
+}
+
+void Scheduler::sift_down(int slot) {
+    int id = heap[slot];
+    for (;;) {
+        int child = slot * 2 + 1;
+        if (child >= size)
+            break;
+        if (child + 1 < size && events[heap[child + 1]].cycle < events[heap[child]].cycle)
+            child++;
+        if (events[id].cycle <= events[heap[child]].cycle)
+            break;
+        place(slot, heap[child]);
+        slot = child;
+    }
+    place(slot, id);
+}
+
+void Scheduler::remove(int id) {
+    int slot = events[id].slot;
+    events[id].slot = -1;
+    events[id].cycle = NEVER;
+    if (--size == slot)
+        return;
+    int moved = heap[size];
+    place(slot, moved);
+    sift_up(slot);
+    sift_down(events[moved].slot);
+}
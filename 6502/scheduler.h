@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+
+/* Cycle timestamped events
+ * Devices add a callback once and then schedule it for the CPU cycle it is
+ * due at: vblank NMI, mapper IRQ counters, APU frame IRQ, end of a DMA...
+ * Pending events are kept in a small binary min-heap. The CPU runs
+ * instructions up to limit, the earliest of the end of the run and the
+ * next event, so between events the run loop compares the cycles to limit
+ * and nothing else, devices are never polled.
+ * Events fire between instructions, with the cycle they were due at. */
+class Scheduler {
+    public:
+    typedef void (*callback)(void *device, uint64_t cycle);
+
+    static const int MAX_EVENTS = 16;
+    static const uint64_t NEVER = UINT64_MAX;
+
+    uint64_t limit; /* Cycle the CPU runs up to before looking at the events again */
+
+    Scheduler();
+
+    /* Returns the id of the event, -1 when there is no room left */
+    int add(callback, void *device);
+    inline int added() const {
+        return count;
+    }
+
+    /* An event is pending at most once, scheduling it again moves it */
+    void schedule(int id, uint64_t cycle);
+    void cancel(int id);
+    uint64_t when(int id) const; /* NEVER when not pending */
+
+    inline uint64_t next() const {
+        return size ? events[heap[0]].cycle : NEVER;
+    }
+
+    /* When each event is due, MAX_EVENTS of them, for save states. Events
+     * have to be added in the same order before restoring */
+    void save(uint64_t *) const;
+    void restore(const uint64_t *);
+
+    /* Fires, in order, the events due at or before cycle. Callbacks can
+     * schedule events again, the ones due by then fire in the same call */
+    void run(uint64_t cycle);
+
+    /* Makes the CPU look at the events and interrupts after the current
+     * instruction */
+    inline void interrupt() {
+        limit = 0;
+    }
+
+    private:
+    struct event {
+        callback fire;
+        void *device;
+        uint64_t cycle;
+        int slot; /* Position in the heap, -1 when not pending */
+    };
+
+    event events[MAX_EVENTS];
+    int count;
+    int heap[MAX_EVENTS]; /* Ids, earliest first */
+    int size;
+
+    void place(int slot, int id);
+    void sift_up(int slot);
+    void sift_down(int slot);
+    void remove(int id);
+};
@@ -0,0 +1,156 @@
+#include "trace.h"
+#include "opcodes.h"
+
+#include <chrono>
+#include <zlib.h>
+
+/* snprintf is most of the time of the drain thread, lines are put
+ * together by hand */
+char *put_hex(char *out, unsigned value, int digits) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (int i = digits - 1; i >= 0; i--)
+        out[i] = hex[value & 0xF], value >>= 4;
+    return out + digits;
+}
+
+char *put_text(char *out, const char *text) {
+    while (*text)
+        *out++ = *text++;
+    return out;
+}
+
+char *put_decimal(char *out, uint64_t value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (count)
+        *out++ = digits[--count];
+    return out;
+}
+
+char *put_register(char *out, const char *name, uint8_t value) {
+    out = put_text(out, name);
+    out = put_hex(out, value, 2);
+    *out++ = ' ';
+    return out;
+}
+
+size_t format_trace(const Trace::entry &e, char *line) {
+    const opcode &m = OPCODES[e.bytes[0]];
+    uint8_t low = e.bytes[1];
+    uint16_t word = e.bytes[2] << 8 | low;
+    char *out = line;
+
+    /* Gap marker */
+    if (e.dropped) {
+        out = put_decimal(put_text(out, "; "), e.dropped);
+        out = put_text(out, " instructions dropped\n");
+    }
+
+    /* Address and the bytes of the instruction, padded to 16 columns */
+    out = put_hex(out, e.PC, 4);
+    out = put_text(out, "  ");
+    int length = m.length;
+    for (int i = 0; i < 3; i++) {
+        if (i < length)
+            out = put_hex(out, e.bytes[i], 2);
+        else
+            out = put_text(out, "  ");
+        *out++ = ' ';
+    }
+    *out++ = ' ';
+
+    /* Disassembly, padded to 32 columns */
+    char *disassembly = out;
+    out = put_text(out, m.name);
+    *out++ = ' ';
+    switch (m.mode) {
+    case IMP: default: break;
+    case ACC: out = put_text(out, "A"); break;
+    case IMM: out = put_hex(put_text(out, "#$"), low, 2); break;
+    case ZPG: out = put_hex(put_text(out, "$"), low, 2); break;
+    case ZPX: out = put_text(put_hex(put_text(out, "$"), low, 2), ",X"); break;
+    case ZPY: out = put_text(put_hex(put_text(out, "$"), low, 2), ",Y"); break;
+    case ABS: out = put_hex(put_text(out, "$"), word, 4); break;
+    case ABX: out = put_text(put_hex(put_text(out, "$"), word, 4), ",X"); break;
+    case ABY: out = put_text(put_hex(put_text(out, "$"), word, 4), ",Y"); break;
+    case IND: out = put_text(put_hex(put_text(out, "($"), word, 4), ")"); break;
+    case IZX: out = put_text(put_hex(put_text(out, "($"), low, 2), ",X)"); break;
+    case IZY: out = put_text(put_hex(put_text(out, "($"), low, 2), "),Y"); break;
+    case REL: out = put_hex(put_text(out, "$"), (uint16_t)(e.PC + 2 + (int8_t)low), 4); break;
+    }
+    while (out < disassembly + 32)
+        *out++ = ' ';
+
+    out = put_register(out, "A:", e.AC);
+    out = put_register(out, "X:", e.X);
+    out = put_register(out, "Y:", e.Y);
+    out = put_register(out, "P:", e.SR);
+    out = put_register(out, "SP:", e.SP);
+
+    out = put_decimal(put_text(out, "CYC:"), e.cycles);
+    *out++ = '\n';
+    return out - line;
+}
+
+// Ring
+
+Trace::Trace(void) : ring(new entry[SIZE]), gap(0), head(0), tail(0), lost(0), running(false), file(nullptr) {
+}
+
+Trace::~Trace(void) {
+    close();
+}
+
+bool Trace::open(const char *path) {
+    close();
+    file = gzopen(path, "wb1");
+    if (!file)
+        return false;
+    gzbuffer((gzFile)file, 1 << 16);
+    running = true;
+    drainer = std::thread(&Trace::drain, this);
+    return true;
+}
+
+void Trace::close() {
+    if (!file)
+        return;
+    running = false;
+    drainer.join();
+    if (gap) /* Dropped up to the end */
+        gzprintf((gzFile)file, "; %llu instructions dropped\n", (unsigned long long)gap);
+    gap = 0;
+    gzclose((gzFile)file);
+    file = nullptr;
+}
+
+/* Formats everything in the ring in chunks, sleeps a bit when it is empty.
+ * Once stopped it keeps going until the ring is empty */
+void Trace::drain() {
+    const size_t LINE_SIZE = 192; /* An instruction and a gap marker */
+    const size_t CHUNK = 512;
+    std::unique_ptr<char[]> text(new char[CHUNK * LINE_SIZE]);
+
+    for (;;) {
+        bool stop = !running.load(std::memory_order_acquire);
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        if (t == h) {
+            if (stop)
+                break;
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            continue;
+        }
+
+        size_t count = h - t < CHUNK ? h - t : CHUNK;
+        size_t used = 0;
+        for (size_t i = 0; i < count; i++)
+            used += format_trace(ring[(t + i) & (SIZE - 1)], text.get() + used);
+        tail.store(t + count, std::memory_order_release);
+        gzwrite((gzFile)file, text.get(), used);
+    }
+}
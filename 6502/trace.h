@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+/* Instruction trace
+ * A CPU built with CPU_TRACE and given a Trace pushes every instruction it
+ * runs, with the registers from before running it, into a single producer
+ * single consumer ring. A thread drains the ring to a gzip file, one line
+ * per instruction in the nestest log format (without the PPU column and
+ * the memory values). When the ring is full instructions are dropped and
+ * counted instead of waiting for the thread, emulation never stalls. The
+ * file says where: a line like "; 1234 instructions dropped" takes their
+ * place.
+ * Without CPU_TRACE the CPU has no trace code at all.
+ * Link with -lz */
+class Trace {
+    public:
+    struct entry {
+        uint64_t cycles;
+        uint16_t PC;
+        uint8_t bytes[3]; /* Opcode and operands, as many as the instruction has */
+        uint8_t AC, X, Y, SR, SP;
+        uint32_t dropped; /* Right before this one, set by push */
+    };
+
+    static const size_t SIZE = 1 << 16; /* Entries in the ring, a power of two */
+
+    Trace();
+    ~Trace();
+    Trace(const Trace &) = delete;
+    Trace &operator=(const Trace &) = delete;
+
+    /* Starts draining to path, returns false when it can not be written */
+    bool open(const char *path);
+    /* Waits for the ring to be written out and closes the file */
+    void close();
+
+    uint64_t dropped() const {
+        return lost.load(std::memory_order_relaxed);
+    }
+
+    /* Only ever called by the thread running the CPU */
+    inline void push(const entry &e) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == SIZE) {
+            lost.store(lost.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            gap++;
+            return;
+        }
+        entry &at = ring[h & (SIZE - 1)];
+        at = e;
+        at.dropped = gap < UINT32_MAX ? gap : UINT32_MAX;
+        gap = 0;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    private:
+    std::unique_ptr<entry[]> ring;
+    uint64_t gap; /* Dropped since the last push that made it, CPU side */
+    alignas(64) std::atomic<size_t> head; /* Written by the CPU */
+    alignas(64) std::atomic<size_t> tail; /* Written by the drain thread */
+    alignas(64) std::atomic<uint64_t> lost;
+    std::atomic<bool> running;
+
+    void *file; /* gzFile, kept out of the header */
+    std::thread drainer;
+
+    void drain();
+};
+
+/* Formats e as a nestest log line (with the newline), returns its length */
+size_t format_trace(const Trace::entry &e, char *line);
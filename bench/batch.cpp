@@ -0,0 +1,123 @@
+/* Batch against separate CPUs
+ * Runs INSTANCES consoles for FRAMES frames on a loop in ROM at $8000,
+ * once in a Batch and once as as many CPU<BUS>, each instance starting
+ * with its own A and byte at $10. Prints the host ns per frame of one
+ * instance for both and checks they end with the same registers.
+ * The ALU loop is register only instructions and a JMP, which the batch
+ * runs on whole groups at once. The memory loop has a zero page load and
+ * store and a branch, which the batch runs one instance at a time.
+ *
+ * Build: g++ -std=c++17 -O2 -I6502 bench/batch.cpp 6502/cpu.cpp 6502/bus.cpp 6502/scheduler.cpp 6502/batch.cpp -o batch
+ * */
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "batch.h"
+
+const size_t INSTANCES = 1024;
+const unsigned FRAMES = 10;
+const int RUNS = 3;
+
+const uint8_t ALU[] = {
+    0xE8,             /* 8000 INX */
+    0x8A,             /* 8001 TXA */
+    0x69, 0x11,       /* 8002 ADC #$11 */
+    0x49, 0x5A,       /* 8004 EOR #$5A */
+    0xA8,             /* 8006 TAY */
+    0x18,             /* 8007 CLC */
+    0xC8,             /* 8008 INY */
+    0x0A,             /* 8009 ASL A */
+    0x29, 0x7F,       /* 800A AND #$7F */
+    0x09, 0x01,       /* 800C ORA #$01 */
+    0xAA,             /* 800E TAX */
+    0xCA,             /* 800F DEX */
+    0x98,             /* 8010 TYA */
+    0xE9, 0x03,       /* 8011 SBC #$03 */
+    0x4A,             /* 8013 LSR A */
+    0x38,             /* 8014 SEC */
+    0xC9, 0x40,       /* 8015 CMP #$40 */
+    0x4C, 0x00, 0x80, /* 8017 JMP $8000 */
+};
+
+const uint8_t MEMORY[] = {
+    0xE8,             /* 8000 INX */
+    0x8A,             /* 8001 TXA */
+    0x65, 0x10,       /* 8002 ADC $10 */
+    0x85, 0x11,       /* 8004 STA $11 */
+    0xA8,             /* 8006 TAY */
+    0xC8,             /* 8007 INY */
+    0x29, 0x0F,       /* 8008 AND #$0F */
+    0xD0, 0x02,       /* 800A BNE $800E */
+    0xA2, 0x00,       /* 800C LDX #$00 */
+    0x4C, 0x00, 0x80, /* 800E JMP $8000 */
+};
+
+struct loop {
+    const char *name;
+    const uint8_t *code;
+    size_t size;
+};
+
+const loop LOOPS[] = {
+    { "alu", ALU, sizeof(ALU) },
+    { "memory", MEMORY, sizeof(MEMORY) },
+};
+
+uint8_t rom[0x8000];
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+    for (const loop &l : LOOPS) {
+        memset(rom, 0, sizeof(rom));
+        memcpy(rom, l.code, l.size);
+
+        double batched = 0, separate = 0;
+        bool same = true;
+        for (int run = 0; run < RUNS; run++) {
+            std::unique_ptr<Batch<BUS>> batch(new Batch<BUS>(INSTANCES));
+            std::vector<CPU<BUS>> cpus(INSTANCES);
+            for (size_t i = 0; i < INSTANCES; i++) {
+                batch->bus(i).map(0x80, 0xFF, rom, sizeof(rom), false);
+                batch->bus(i).ram[0x10] = i;
+                batch->regs.AC[i] = i;
+                batch->regs.PC[i] = 0x8000;
+                cpus[i].set_bus(std::unique_ptr<BUS>(new BUS()));
+                cpus[i].bus->map(0x80, 0xFF, rom, sizeof(rom), false);
+                cpus[i].bus->ram[0x10] = i;
+                cpus[i].AC = i;
+                cpus[i].SP = 0xFD;
+                cpus[i].set_status(0x24);
+                cpus[i].PC = 0x8000;
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            batch->run_frames_all(FRAMES);
+            double seconds = seconds_since(start);
+            if (!run || seconds < batched)
+                batched = seconds;
+
+            start = std::chrono::steady_clock::now();
+            for (CPU<BUS> &cpu : cpus)
+                cpu.run_for(FRAMES * CPU<BUS>::CYCLES_PER_FRAME);
+            seconds = seconds_since(start);
+            if (!run || seconds < separate)
+                separate = seconds;
+
+            for (size_t i = 0; i < INSTANCES; i++)
+                same = same && cpus[i].AC == batch->regs.AC[i] && cpus[i].PC == batch->regs.PC[i] &&
+                       cpus[i].cycles == batch->regs.cycles[i];
+        }
+
+        double frames = (double)INSTANCES * FRAMES;
+        printf("%-8s batch %7.0f ns/frame  separate %7.0f ns/frame  %.2fx%s\n", l.name, batched * 1e9 / frames,
+               separate * 1e9 / frames, separate / batched, same ? "" : "  (results differ)");
+    }
+    return 0;
+}
@@ -0,0 +1,201 @@
+/* Microbenchmark of the operand read path
+ * Runs the real CPU<BUS> on loops of one instruction repeated, each
+ * reading its operand through one addressing mode from RAM, ROM or an I/O
+ * page, and prints the host ns per instruction. The loops are in ROM at
+ * $8000, 64 copies of the instruction then a JMP back.
+ * Each loop also runs on a core stripped down to the loop instructions over
+ * the same BUS, once reading the operand through the addressing mode wrapped
+ * in a std::function (CPU::read before the op table) and once through the
+ * addressing mode as a template parameter (read_op now). The speedup is
+ * between those two, the CPU column is what the whole instruction costs.
+ *
+ * Build: g++ -std=c++17 -O2 -I6502 bench/read_path.cpp 6502/cpu.cpp 6502/bus.cpp 6502/scheduler.cpp -o read_path
+ * */
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+
+#include "cpu.h"
+
+const uint64_t CYCLES = 200000000;
+const int RUNS = 3;
+const int COPIES = 64;
+
+struct loop {
+    const char *name;
+    uint8_t bytes[3]; /* The instruction */
+    int length;
+};
+
+const loop LOOPS[] = {
+    { "ORA zpg (ram)",       { 0x05, 0x10, 0x00 }, 2 },
+    { "EOR abs,x (ram)",     { 0x5D, 0x00, 0x03 }, 3 },
+    { "EOR abs,x (rom)",     { 0x5D, 0x00, 0x90 }, 3 },
+    { "LDA (ind),y (ram)",   { 0xB1, 0x20, 0x00 }, 2 },
+    { "LDA abs (io)",        { 0xAD, 0x16, 0x40 }, 3 },
+};
+
+uint8_t io_read(void *, uint16_t addr) {
+    return addr;
+}
+
+void io_write(void *, uint16_t, uint8_t) {
+}
+
+const BUS::io IO = { io_read, io_write, nullptr };
+
+/* CPU with the loop in ROM, RAM and ROM filled with noise and an I/O
+ * device on $4000 - $5FFF */
+struct machine {
+    uint8_t rom[0x8000];
+    CPU<BUS> cpu;
+
+    machine(const loop &l) {
+        uint32_t seed = 0x6502;
+        for (uint8_t &byte : rom) {
+            seed = seed * 1103515245 + 12345;
+            byte = seed >> 16;
+        }
+        uint8_t *at = rom;
+        for (int i = 0; i < COPIES; i++, at += l.length)
+            for (int j = 0; j < l.length; j++)
+                at[j] = l.bytes[j];
+        at[0] = 0x4C; /* JMP $8000 */
+        at[1] = 0x00;
+        at[2] = 0x80;
+        rom[0x7FFC] = 0x00;
+        rom[0x7FFD] = 0x80;
+
+        cpu.set_bus(std::unique_ptr<BUS>(new BUS()));
+        cpu.bus->map_io(0x40, 0x5F, &IO);
+        cpu.bus->map(0x80, 0xFF, rom, sizeof(rom), false);
+        for (size_t i = 0; i < BUS::RAM_SIZE; i++)
+            cpu.bus->ram[i] = rom[0x1000 + i];
+        cpu.bus->write(0x20, 0x00); /* ($20),Y points at $0300 */
+        cpu.bus->write(0x21, 0x03);
+        cpu.reset();
+        cpu.X = 0x40;
+        cpu.Y = 0x40;
+    }
+};
+
+/* Only the instructions of the loops, reading the operand either way */
+struct core {
+    BUS *bus;
+    uint8_t AC, X, Y;
+    uint16_t PC;
+    uint64_t cycles;
+    bool page_crossed;
+
+    core(CPU<BUS> &cpu) : bus(cpu.bus.get()), AC(cpu.AC), X(cpu.X), Y(cpu.Y), PC(cpu.PC),
+                          cycles(cpu.cycles), page_crossed(false) {}
+
+    uint16_t addr_zpg() {
+        return bus->read(PC++);
+    }
+
+    uint16_t addr_abs() {
+        uint8_t low_byte = bus->read(PC++);
+        uint8_t high_byte = bus->read(PC++);
+        return (high_byte << 8) | low_byte;
+    }
+
+    uint16_t addr_abs_x() {
+        uint8_t low_byte = bus->read(PC++);
+        uint8_t high_byte = bus->read(PC++);
+        page_crossed = (low_byte + X) >> 8;
+        return ((high_byte << 8) | low_byte) + X;
+    }
+
+    uint16_t addr_indr_y() {
+        uint8_t addr = bus->read(PC++);
+        uint8_t low_byte = bus->read(addr++);
+        uint8_t high_byte = bus->read(addr);
+        page_crossed = (low_byte + Y) >> 8;
+        return ((high_byte << 8) | low_byte) + Y;
+    }
+
+    uint8_t read(std::function<uint16_t(void)> addr_mode) {
+        return bus->read(addr_mode());
+    }
+
+    template <uint16_t (core::*addr_mode)()>
+    uint8_t read() {
+        return bus->read((this->*addr_mode)());
+    }
+
+    template <uint16_t (core::*addr_mode)(), bool function>
+    uint8_t operand() {
+        if constexpr (function)
+            return read([this]() { return (this->*addr_mode)(); });
+        else
+            return read<addr_mode>();
+    }
+
+    template <bool function>
+    void run_for(uint64_t n) {
+        uint64_t end = cycles + n;
+        while (cycles < end) {
+            page_crossed = false;
+            switch (bus->read(PC++)) {
+                case 0x05: AC |= operand<&core::addr_zpg, function>(); cycles += 3; break;
+                case 0x5D: AC ^= operand<&core::addr_abs_x, function>(); cycles += 4; break;
+                case 0xB1: AC = operand<&core::addr_indr_y, function>(); cycles += 5; break;
+                case 0xAD: AC = operand<&core::addr_abs, function>(); cycles += 4; break;
+                case 0x4C: PC = addr_abs(); cycles += 3; break;
+            }
+            cycles += page_crossed;
+        }
+    }
+};
+
+/* Best of RUNS, in seconds, and the AC it ended with */
+template <class F>
+double best_of(const loop &l, uint8_t &result, F run) {
+    double best = 0;
+    for (int i = 0; i < RUNS; i++) {
+        std::unique_ptr<machine> m(new machine(l));
+        auto start = std::chrono::steady_clock::now();
+        result = run(m->cpu);
+        auto end = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        if (!i || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+int main() {
+    for (const loop &l : LOOPS) {
+        /* Instructions in CYCLES, stepping through once */
+        std::unique_ptr<machine> counted(new machine(l));
+        uint64_t instructions = 0;
+        while (counted->cpu.cycles < CYCLES) {
+            counted->cpu.step();
+            instructions++;
+        }
+
+        uint8_t results[3];
+        double function = best_of(l, results[0], [](CPU<BUS> &cpu) {
+            core c(cpu);
+            c.run_for<true>(CYCLES - c.cycles);
+            return c.AC;
+        });
+        double templated = best_of(l, results[1], [](CPU<BUS> &cpu) {
+            core c(cpu);
+            c.run_for<false>(CYCLES - c.cycles);
+            return c.AC;
+        });
+        double whole = best_of(l, results[2], [](CPU<BUS> &cpu) {
+            cpu.run_for(CYCLES - cpu.cycles);
+            return cpu.AC;
+        });
+        double ns = 1e9 / instructions;
+        printf("%-18s std::function %5.2f  template %5.2f  speedup %.2fx  CPU %5.2f ns/instruction%s\n", l.name,
+               function * ns, templated * ns, function / templated, whole * ns,
+               results[0] == results[1] && results[1] == results[2] ? "" : "  (results differ)");
+    }
+    return 0;
+}
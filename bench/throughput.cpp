@@ -0,0 +1,245 @@
+/* Instruction throughput of the 6502 core
+ * Runs small instruction mixes (ALU, branches, indexed memory accesses,
+ * stack) and optionally real PRG images on the interpreter, the block
+ * cache and the JIT. Prints one CSV line per run: emulated MHz, host ns
+ * per instruction and instructions per emulated cycle (IPC). Each run is
+ * the best of a few, the instruction count comes from a separate pass
+ * stepping one instruction at a time through the same cycles.
+ *
+ * PRG images are 16 or 32 KB, or .nes files: their first and last 16 KB
+ * banks are mapped at $8000 and $C000 with 8 KB of cartridge RAM at
+ * $6000, and they run from the reset vector with nothing on the I/O
+ * pages, so games mostly spin waiting for the PPU.
+ *
+ * Build: g++ -std=c++17 -O2 -I6502 bench/throughput.cpp 6502/cpu.cpp 6502/bus.cpp 6502/scheduler.cpp 6502/block_cache.cpp 6502/jit.cpp -o throughput
+ * Usage: throughput [-c cycles] [prg...]
+ * */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "block_cache.h"
+#include "cpu.h"
+#include "jit.h"
+
+/* Loops assembled at $8000 */
+const uint8_t ALU[] = {
+    0xA9, 0x01,       /* 8000 LDA #$01 */
+    0xA2, 0x00,       /* 8002 LDX #$00 */
+    0x69, 0x03,       /* 8004 ADC #$03 */
+    0x29, 0x7F,       /* 8006 AND #$7F */
+    0x49, 0x55,       /* 8008 EOR #$55 */
+    0x0A,             /* 800A ASL A */
+    0x09, 0x01,       /* 800B ORA #$01 */
+    0x4A,             /* 800D LSR A */
+    0xE9, 0x02,       /* 800E SBC #$02 */
+    0xAA,             /* 8010 TAX */
+    0xE8,             /* 8011 INX */
+    0x8A,             /* 8012 TXA */
+    0xC9, 0x40,       /* 8013 CMP #$40 */
+    0x4C, 0x04, 0x80, /* 8015 JMP $8004 */
+};
+
+const uint8_t BRANCH[] = {
+    0xA2, 0x00,       /* 8000 LDX #$00 */
+    0xA0, 0x00,       /* 8002 LDY #$00 */
+    0xE8,             /* 8004 INX */
+    0x8A,             /* 8005 TXA */
+    0x29, 0x01,       /* 8006 AND #$01 */
+    0xF0, 0x01,       /* 8008 BEQ $800B */
+    0xC8,             /* 800A INY */
+    0x8A,             /* 800B TXA */
+    0x29, 0x02,       /* 800C AND #$02 */
+    0xD0, 0x01,       /* 800E BNE $8011 */
+    0x88,             /* 8010 DEY */
+    0xE0, 0x80,       /* 8011 CPX #$80 */
+    0x90, 0x01,       /* 8013 BCC $8016 */
+    0xC8,             /* 8015 INY */
+    0x98,             /* 8016 TYA */
+    0x30, 0x00,       /* 8017 BMI $8019 */
+    0x10, 0xE9,       /* 8019 BPL $8004 */
+    0x4C, 0x04, 0x80, /* 801B JMP $8004 */
+};
+
+/* abs,X and (ind),Y with page crossings every now and then */
+const uint8_t INDEXED[] = {
+    0xA9, 0xF0,       /* 8000 LDA #$F0 */
+    0x85, 0x10,       /* 8002 STA $10 */
+    0xA9, 0x02,       /* 8004 LDA #$02 */
+    0x85, 0x11,       /* 8006 STA $11 */
+    0xA2, 0x00,       /* 8008 LDX #$00 */
+    0xA0, 0x00,       /* 800A LDY #$00 */
+    0xBD, 0xF0, 0x02, /* 800C LDA $02F0,X */
+    0x7D, 0x80, 0x03, /* 800F ADC $0380,X */
+    0x9D, 0x00, 0x05, /* 8012 STA $0500,X */
+    0xB1, 0x10,       /* 8015 LDA ($10),Y */
+    0x79, 0xC0, 0x03, /* 8017 ADC $03C0,Y */
+    0x91, 0x10,       /* 801A STA ($10),Y */
+    0xE8,             /* 801C INX */
+    0xC8,             /* 801D INY */
+    0xC8,             /* 801E INY */
+    0x4C, 0x0C, 0x80, /* 801F JMP $800C */
+};
+
+const uint8_t STACK[] = {
+    0xA2, 0x00,       /* 8000 LDX #$00 */
+    0x20, 0x0E, 0x80, /* 8002 JSR $800E */
+    0x48,             /* 8005 PHA */
+    0x08,             /* 8006 PHP */
+    0x28,             /* 8007 PLP */
+    0x68,             /* 8008 PLA */
+    0xE8,             /* 8009 INX */
+    0x4C, 0x02, 0x80, /* 800A JMP $8002 */
+    0xEA,             /* 800D NOP */
+    0x48,             /* 800E PHA */
+    0x8A,             /* 800F TXA */
+    0x48,             /* 8010 PHA */
+    0x20, 0x18, 0x80, /* 8011 JSR $8018 */
+    0x68,             /* 8014 PLA */
+    0xAA,             /* 8015 TAX */
+    0x68,             /* 8016 PLA */
+    0x60,             /* 8017 RTS */
+    0x08,             /* 8018 PHP */
+    0x28,             /* 8019 PLP */
+    0x60,             /* 801A RTS */
+};
+
+const int RUNS = 3;
+
+/* 32 KB at $8000 plus the cartridge RAM at $6000 */
+struct image {
+    std::string name;
+    std::vector<uint8_t> prg;
+    uint8_t ram[0x2000];
+};
+
+image synthetic(const char *name, const uint8_t *code, size_t size) {
+    image rom;
+    rom.name = name;
+    rom.prg.assign(0x8000, 0xEA);
+    memcpy(rom.prg.data(), code, size);
+    rom.prg[0x7FFC] = 0x00; /* Reset vector, $8000 */
+    rom.prg[0x7FFD] = 0x80;
+    return rom;
+}
+
+bool load(const char *path, image &rom) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+    std::vector<uint8_t> data;
+    uint8_t buffer[0x4000];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.insert(data.end(), buffer, buffer + size);
+    fclose(file);
+
+    if (data.size() >= 16 && !memcmp(data.data(), "NES\x1A", 4)) {
+        size_t start = 16 + (data[6] & 4 ? 512 : 0); /* Trainer */
+        size_t prg_size = data[4] * 0x4000;
+        if (!prg_size || data.size() < start + prg_size)
+            return false;
+        data = std::vector<uint8_t>(data.begin() + start, data.begin() + start + prg_size);
+    }
+    if (data.size() < 0x4000 || data.size() % 0x4000)
+        return false;
+
+    const char *slash = strrchr(path, '/');
+    rom.name = slash ? slash + 1 : path;
+    rom.prg.resize(0x8000);
+    memcpy(rom.prg.data(), data.data(), 0x4000);
+    memcpy(rom.prg.data() + 0x4000, data.data() + data.size() - 0x4000, 0x4000);
+    return true;
+}
+
+/* Fresh machine at power up, RAM cleared */
+void power_up(CPU<BUS> &cpu, image &rom) {
+    cpu.set_bus(std::unique_ptr<BUS>(new BUS()));
+    memset(cpu.bus->ram, 0, sizeof(cpu.bus->ram));
+    memset(rom.ram, 0, sizeof(rom.ram));
+    cpu.bus->map(0x80, 0xFF, rom.prg.data(), rom.prg.size(), false);
+    cpu.bus->map(0x60, 0x7F, rom.ram, sizeof(rom.ram), true);
+    cpu.AC = cpu.X = cpu.Y = 0;
+    cpu.SP = 0xFD;
+    cpu.set_status(0x24);
+    cpu.cycles = 0;
+    cpu.PC = cpu.bus->read(0xFFFC) | (cpu.bus->read(0xFFFD) << 8);
+}
+
+uint64_t count_instructions(image &rom, uint64_t cycles) {
+    CPU<BUS> cpu;
+    power_up(cpu, rom);
+    uint64_t count = 0;
+    while (cpu.cycles < cycles) {
+        cpu.step();
+        count++;
+    }
+    return count;
+}
+
+template <class Engine>
+double best_time(image &rom, uint64_t cycles) {
+    double best = 1e30;
+    for (int i = 0; i < RUNS; i++) {
+        CPU<BUS> cpu;
+        power_up(cpu, rom);
+        Engine engine(cpu);
+        auto start = std::chrono::steady_clock::now();
+        engine.run_for(cycles);
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+/* Adapter so the interpreter runs like the other engines */
+struct Interpreter {
+    CPU<BUS> &cpu;
+    Interpreter(CPU<BUS> &cpu) : cpu(cpu) {
+    }
+    uint64_t run_for(uint64_t cycles) {
+        return cpu.run_for(cycles);
+    }
+};
+
+void report(const image &rom, const char *engine, uint64_t cycles, uint64_t instructions, double seconds) {
+    printf("%s,%s,%llu,%llu,%.6f,%.2f,%.3f,%.4f\n", rom.name.c_str(), engine, (unsigned long long)cycles,
+           (unsigned long long)instructions, seconds, cycles / seconds / 1e6, seconds * 1e9 / instructions,
+           (double)instructions / cycles);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    uint64_t cycles = 50000000;
+    std::vector<image> roms;
+    roms.push_back(synthetic("alu", ALU, sizeof(ALU)));
+    roms.push_back(synthetic("branch", BRANCH, sizeof(BRANCH)));
+    roms.push_back(synthetic("indexed", INDEXED, sizeof(INDEXED)));
+    roms.push_back(synthetic("stack", STACK, sizeof(STACK)));
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            cycles = strtoull(argv[++i], nullptr, 0);
+            continue;
+        }
+        image rom;
+        if (!load(argv[i], rom)) {
+            fprintf(stderr, "%s: not a PRG image\n", argv[i]);
+            return 2;
+        }
+        roms.push_back(rom);
+    }
+
+    printf("mix,engine,cycles,instructions,seconds,mhz,ns_per_instruction,ipc\n");
+    for (image &rom : roms) {
+        uint64_t instructions = count_instructions(rom, cycles);
+        report(rom, "interpreter", cycles, instructions, best_time<Interpreter>(rom, cycles));
+        report(rom, "blocks", cycles, instructions, best_time<BlockCache<BUS>>(rom, cycles));
+        report(rom, "jit", cycles, instructions, best_time<JIT<BUS>>(rom, cycles));
+    }
+    return 0;
+}
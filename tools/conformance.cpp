@@ -0,0 +1,759 @@
+/* 6502 conformance harness
+ * Loads a test binary (Klaus Dormann's functional and decimal tests, or
+ * any flat image) in 64 KB of RAM and runs it until it gets stuck in a
+ * loop jumping to itself, which is how these tests end. It passes when the
+ * loop is at the success address given, and the result byte, if any, is 0.
+ *
+ * With -d the engine runs next to a second machine on the plain
+ * interpreter. The engine runs slices of its own, the interpreter catches
+ * up after each one and their registers, cycles and memory are compared.
+ *
+ * With -g the interpreter is checked instruction by instruction against a
+ * golden trace in the nestest log format (plain or gzip, as written by
+ * Trace). It compares PC, A, X, Y, P, SP, and CYC when the trace has it.
+ * The registers start from the first line of the trace. The instructions
+ * of a gap Trace left ("; 1234 instructions dropped") are run unchecked.
+ *
+ * With -w the interpreter writes its run as a trace -g can check, so two
+ * builds of the core can be compared instruction by instruction, like the
+ * lazy flags against the eager ones on any image (random bytes do too):
+ *   conformance -w eager.gz -m 1e8 image
+ *   conformance-lazy -g eager.gz -m 1e8 image
+ *
+ * With -t the core checks itself instead:
+ *   fork    runs the binary on a machine forked twice, the parent and the
+ *           child gone before the grandchild runs, and on one never forked.
+ *           All of them have to end with the same registers and memory.
+ *           A machine with an I/O page has to refuse to fork
+ *   rewind  runs the binary by frames through a rewind buffer too small to
+ *           hold them all, seeks back and forth and compares the state to
+ *           the one saved at that frame the first time
+ *   bcd     NMOS decimal ADC and SBC, every A, operand and carry against
+ *           the sequences of the 6502.org decimal mode tutorial, no binary
+ *   batch   the instructions Batch runs on a whole group at once, every A
+ *           and operand against the CPU, then instances of a loop taking
+ *           NMIs and IRQs of their own against separate CPUs, no binary
+ *
+ * Build: g++ -std=c++17 -O2 -I6502 tools/conformance.cpp 6502/cpu.cpp 6502/cpu_nmos.cpp 6502/bus.cpp 6502/scheduler.cpp 6502/block_cache.cpp 6502/jit.cpp 6502/rewind.cpp 6502/batch.cpp -lz -o conformance
+ * Usage: conformance [options] binary
+ *   -v 2a03|nmos               CPU variant (2a03), decimal mode needs nmos
+ *   -e interpreter|blocks|jit  engine to run (interpreter), only the interpreter for nmos
+ *   -d                         compare the engine against the interpreter
+ *   -g trace                   compare the interpreter against a golden trace
+ *   -w trace                   write the run of the interpreter as a trace (gzip)
+ *   -t fork|rewind|bcd|batch   self check, see above
+ *   -l address                 where the binary is loaded (0), .nes files load their first 16 KB
+ *   -s address                 start address (reset vector)
+ *   -p address                 address of the success loop
+ *   -r address                 byte that has to be 0 for a pass (ERROR of the decimal test)
+ *   -m cycles                  give up after that many cycles (1e10)
+ * Example: conformance -v nmos -s 0x400 -p 0x3469 6502_functional_test.bin
+ * */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <zlib.h>
+
+#include "batch.h"
+#include "block_cache.h"
+#include "cpu.h"
+#include "jit.h"
+#include "rewind.h"
+
+struct options {
+    std::string engine = "interpreter";
+    std::string variant = "2a03";
+    bool differential = false;
+    const char *golden = nullptr;
+    const char *write = nullptr;
+    std::string test;
+    const char *binary = nullptr;
+    uint16_t load = 0;
+    long start = -1;
+    long success = -1;
+    long result = -1;
+    uint64_t max_cycles = 10000000000ull;
+};
+
+/* Machine with a flat 64 KB of RAM */
+template <class Cpu>
+struct machine {
+    uint8_t memory[0x10000];
+    Cpu cpu;
+
+    machine(const std::vector<uint8_t> &image, const options &opt) {
+        memset(memory, 0, sizeof(memory));
+        for (size_t i = 0; i < image.size() && opt.load + i < sizeof(memory); i++)
+            memory[opt.load + i] = image[i];
+        cpu.set_bus(std::unique_ptr<BUS>(new BUS()));
+        cpu.bus->map(0x00, 0xFF, memory, sizeof(memory), true);
+        cpu.AC = cpu.X = cpu.Y = 0;
+        cpu.SP = 0xFD;
+        cpu.set_status(0x24);
+        cpu.cycles = 0;
+        cpu.PC = opt.start >= 0 ? opt.start : memory[0xFFFC] | memory[0xFFFD] << 8;
+    }
+};
+
+/* Adapter so the interpreter runs like the other engines */
+template <class Cpu>
+struct Interpreter {
+    Cpu &cpu;
+    Interpreter(Cpu &cpu) : cpu(cpu) {
+    }
+    uint64_t run_for(uint64_t cycles) {
+        return cpu.run_for(cycles);
+    }
+};
+
+// Helper Functions
+
+std::vector<uint8_t> read_file(const char *path) {
+    std::vector<uint8_t> data;
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return data;
+    uint8_t buffer[0x4000];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.insert(data.end(), buffer, buffer + size);
+    fclose(file);
+
+    /* nestest and friends, only the first PRG bank */
+    if (data.size() >= 16 + 0x4000 && !memcmp(data.data(), "NES\x1A", 4))
+        data = std::vector<uint8_t>(data.begin() + 16, data.begin() + 16 + 0x4000);
+    return data;
+}
+
+template <class Cpu>
+void print_state(const char *name, Cpu &cpu) {
+    fprintf(stderr, "%-10s PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu\n", name, cpu.PC, cpu.AC, cpu.X,
+            cpu.Y, cpu.status(), cpu.SP, (unsigned long long)cpu.cycles);
+}
+
+template <class Cpu>
+bool same_state(Cpu &a, Cpu &b) {
+    return a.PC == b.PC && a.AC == b.AC && a.X == b.X && a.Y == b.Y && a.status() == b.status() && a.SP == b.SP &&
+           a.cycles == b.cycles;
+}
+
+/* Whether the instruction at PC jumps to itself: JMP to its own address
+ * or a branch back onto itself that is taken. Bits 7 - 6 of a branch
+ * opcode pick the flag (N, V, C, Z), bit 5 the value it is taken on */
+template <class Cpu>
+bool looping(machine<Cpu> &m) {
+    uint16_t pc = m.cpu.PC;
+    uint8_t op_code = m.memory[pc];
+    uint8_t low = m.memory[(uint16_t)(pc + 1)], high = m.memory[(uint16_t)(pc + 2)];
+    if (op_code == 0x4C)
+        return (low | high << 8) == pc;
+    if (OPCODES[op_code].mode != REL || low != 0xFE)
+        return false;
+    static const uint8_t flags[] = { 0x80, 0x40, 0x01, 0x02 };
+    bool set = m.cpu.status() & flags[op_code >> 6];
+    return set == !!(op_code & 0x20);
+}
+
+/* Runs until the machine loops on itself, the engine going in slices on
+ * its own. With a reference machine on the interpreter, it catches up
+ * after each slice and the registers, cycles and memory have to match.
+ * Returns false when the engine diverged from the interpreter */
+template <class Engine, class Cpu>
+bool run(machine<Cpu> &m, const std::vector<uint8_t> &image, const options &opt) {
+    const uint64_t SLICE = 10000;
+
+    Engine engine(m.cpu);
+    std::unique_ptr<machine<Cpu>> ref;
+    if (opt.differential)
+        ref.reset(new machine<Cpu>(image, opt));
+
+    for (;;) {
+        engine.run_for(SLICE);
+        if (ref) {
+            while (ref->cpu.cycles < m.cpu.cycles)
+                ref->cpu.step();
+            if (!same_state(m.cpu, ref->cpu) || memcmp(m.memory, ref->memory, sizeof(m.memory))) {
+                fprintf(stderr, "%s diverged from the interpreter\n", opt.engine.c_str());
+                print_state(opt.engine.c_str(), m.cpu);
+                print_state("interpreter", ref->cpu);
+                for (size_t i = 0; i < sizeof(m.memory); i++)
+                    if (m.memory[i] != ref->memory[i]) {
+                        fprintf(stderr, "first memory difference at %04zX: %02X, %02X\n", i, m.memory[i],
+                                ref->memory[i]);
+                        break;
+                    }
+                return false;
+            }
+        }
+        if (looping(m) || m.cpu.cycles >= opt.max_cycles)
+            break;
+    }
+    return true;
+}
+
+bool parse_byte(const char *line, const char *name, uint8_t &value) {
+    const char *at = strstr(line, name);
+    if (!at)
+        return false;
+    value = strtoul(at + strlen(name), nullptr, 16);
+    return true;
+}
+
+/* Registers from a nestest log line, cycles are optional */
+struct trace_line {
+    uint16_t PC;
+    uint8_t AC, X, Y, SR, SP;
+    bool has_cycles;
+    uint64_t cycles;
+};
+
+bool parse_line(const char *line, trace_line &t) {
+    char *end;
+    t.PC = strtoul(line, &end, 16);
+    if (end != line + 4)
+        return false;
+    const char *regs = strstr(line, "A:");
+    if (!regs || !parse_byte(regs, "A:", t.AC) || !parse_byte(regs, "X:", t.X) || !parse_byte(regs, "Y:", t.Y) ||
+        !parse_byte(regs, " P:", t.SR) || !parse_byte(regs, "SP:", t.SP))
+        return false;
+    const char *cycles = strstr(regs, "CYC:");
+    t.has_cycles = cycles;
+    t.cycles = cycles ? strtoull(cycles + 4, nullptr, 10) : 0;
+    return true;
+}
+
+template <class Cpu>
+bool matches(Cpu &cpu, const trace_line &t) {
+    return cpu.PC == t.PC && cpu.AC == t.AC && cpu.X == t.X && cpu.Y == t.Y && cpu.status() == t.SR &&
+           cpu.SP == t.SP && (!t.has_cycles || cpu.cycles == t.cycles);
+}
+
+template <class Cpu>
+bool run_golden(machine<Cpu> &m, const options &opt, uint64_t &lines, uint64_t &dropped) {
+    gzFile file = gzopen(opt.golden, "rb");
+    if (!file) {
+        fprintf(stderr, "%s: can not open\n", opt.golden);
+        return false;
+    }
+
+    char line[256];
+    trace_line t;
+    lines = 0;
+    dropped = 0;
+    uint64_t skip = 0;
+    bool ok = true;
+    while (gzgets(file, line, sizeof(line))) {
+        if (line[0] == ';' && lines) { /* Gap, only after the registers are known */
+            uint64_t count = strtoull(line + 1, nullptr, 10);
+            skip += count;
+            dropped += count;
+            continue;
+        }
+        if (!parse_line(line, t)) {
+            fprintf(stderr, "%s:%llu: not a trace line\n", opt.golden, (unsigned long long)lines + 1);
+            ok = false;
+            break;
+        }
+        if (lines++ == 0) {
+            m.cpu.PC = t.PC;
+            m.cpu.AC = t.AC;
+            m.cpu.X = t.X;
+            m.cpu.Y = t.Y;
+            m.cpu.SP = t.SP;
+            m.cpu.set_status(t.SR);
+            m.cpu.cycles = t.cycles;
+        } else {
+            for (; skip; skip--)
+                m.cpu.step();
+            m.cpu.step();
+        }
+        if (!matches(m.cpu, t)) {
+            fprintf(stderr, "line %llu differs\nexpected   %s", (unsigned long long)lines, line);
+            print_state("got", m.cpu);
+            ok = false;
+            break;
+        }
+        if (m.cpu.cycles >= opt.max_cycles)
+            break;
+    }
+    gzclose(file);
+    return ok;
+}
+
+/* Steps the interpreter like run, writing a line before each instruction */
+template <class Cpu>
+bool write_trace(machine<Cpu> &m, const options &opt) {
+    gzFile file = gzopen(opt.write, "wb1");
+    if (!file) {
+        fprintf(stderr, "%s: can not write\n", opt.write);
+        return false;
+    }
+
+    Cpu &cpu = m.cpu;
+    for (;;) {
+        gzprintf(file, "%04X  A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu\n", cpu.PC, cpu.AC, cpu.X, cpu.Y,
+                 cpu.status(), cpu.SP, (unsigned long long)cpu.cycles);
+        uint16_t pc = cpu.PC;
+        cpu.step();
+        if (cpu.PC == pc || cpu.cycles >= opt.max_cycles)
+            break;
+    }
+    gzclose(file);
+    return true;
+}
+
+bool parse_options(int argc, char **argv, options &opt) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (!strcmp(arg, "-d")) {
+            opt.differential = true;
+            continue;
+        }
+        if (arg[0] != '-') {
+            opt.binary = arg;
+            continue;
+        }
+        if (!value)
+            return false;
+        i++;
+        if (!strcmp(arg, "-e"))
+            opt.engine = value;
+        else if (!strcmp(arg, "-v"))
+            opt.variant = value;
+        else if (!strcmp(arg, "-g"))
+            opt.golden = value;
+        else if (!strcmp(arg, "-w"))
+            opt.write = value;
+        else if (!strcmp(arg, "-t"))
+            opt.test = value;
+        else if (!strcmp(arg, "-l"))
+            opt.load = strtoul(value, nullptr, 0);
+        else if (!strcmp(arg, "-s"))
+            opt.start = strtol(value, nullptr, 0);
+        else if (!strcmp(arg, "-p"))
+            opt.success = strtol(value, nullptr, 0);
+        else if (!strcmp(arg, "-r"))
+            opt.result = strtol(value, nullptr, 0);
+        else if (!strcmp(arg, "-m"))
+            opt.max_cycles = strtod(value, nullptr);
+        else
+            return false;
+    }
+    if (opt.variant != "2a03" && opt.variant != "nmos")
+        return false;
+    /* The block cache and the JIT only come in the NES flavor */
+    if (opt.variant == "nmos" && opt.engine != "interpreter")
+        return false;
+    if (opt.test == "bcd" || opt.test == "batch")
+        return true;
+    if (!opt.test.empty() && opt.test != "fork" && opt.test != "rewind")
+        return false;
+    return opt.binary && (opt.engine == "interpreter" || opt.engine == "blocks" || opt.engine == "jit");
+}
+
+// Self Checks
+/* Registers, cycles and the whole address space, read through the bus */
+bool same_machine(CPU<BUS> &a, CPU<BUS> &b) {
+    if (!same_state(a, b))
+        return false;
+    for (unsigned addr = 0; addr < 0x10000; addr++)
+        if (a.bus->read(addr) != b.bus->read(addr))
+            return false;
+    return true;
+}
+
+bool check_fork(const std::vector<uint8_t> &image, const options &opt) {
+    const uint64_t BEFORE = 1000000, AFTER = 1000000;
+
+    machine<CPU<BUS>> reference(image, opt);
+    reference.cpu.run_for(BEFORE);
+    reference.cpu.run_for(AFTER);
+
+    std::unique_ptr<machine<CPU<BUS>>> parent(new machine<CPU<BUS>>(image, opt));
+    parent->cpu.run_for(BEFORE);
+    std::unique_ptr<CPU<BUS>> child = parent->cpu.fork();
+    std::unique_ptr<CPU<BUS>> grandchild = child ? child->fork() : nullptr;
+    if (!grandchild) {
+        printf("fork fail, refused\n");
+        return false;
+    }
+
+    /* Devices are not forked, a machine with one has to refuse */
+    std::unique_ptr<machine<CPU<BUS>>> with_device(new machine<CPU<BUS>>(image, opt));
+    const BUS::io device = { nullptr, nullptr, nullptr };
+    with_device->cpu.bus->map_io(0x40, 0x40, &device);
+    bool ok = !with_device->cpu.fork();
+
+    parent->cpu.run_for(AFTER);
+    ok = ok && same_machine(parent->cpu, reference.cpu);
+    parent.reset();
+    child->run_for(AFTER);
+    ok = ok && same_machine(*child, reference.cpu);
+    child.reset();
+    grandchild->run_for(AFTER);
+    ok = ok && same_machine(*grandchild, reference.cpu);
+
+    printf("fork %s\n", ok ? "pass" : "fail");
+    return ok;
+}
+
+void run_frame(void *, CPU<BUS> &cpu, uint64_t frame) {
+    uint64_t end = (frame + 1) * CPU<BUS>::CYCLES_PER_FRAME;
+    if (cpu.cycles < end)
+        cpu.run_for(end - cpu.cycles);
+}
+
+bool check_rewind(const std::vector<uint8_t> &image, const options &opt) {
+    const unsigned FRAMES = 600, SEEKS = 200;
+
+    /* The 64 KB go in the state too */
+    machine<CPU<BUS>> m(image, opt);
+    m.cpu.bus->add_state(m.memory, sizeof(m.memory));
+    Rewind<BUS> rewind(m.cpu, 512 * 1024, 4, run_frame, nullptr);
+
+    /* State at the start of each frame, from running straight */
+    size_t size = m.cpu.state_size();
+    std::vector<uint8_t> states((FRAMES + 1) * size);
+    std::vector<uint8_t> state(size);
+    for (unsigned frame = 0; frame <= FRAMES; frame++) {
+        m.cpu.save_state(&states[frame * size]);
+        if (frame < FRAMES)
+            rewind.run_frame();
+    }
+
+    bool ok = rewind.oldest() > 0 && !rewind.seek(rewind.oldest() - 1);
+    uint32_t random = 0x6502;
+    for (unsigned i = 0; ok && i < SEEKS; i++) {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        uint64_t frame = rewind.oldest() + random % (rewind.frame() - rewind.oldest() + 1);
+        ok = rewind.seek(frame);
+
+        /* Then a few frames forward, recording again */
+        for (unsigned n = 0; ok && n < 8; n++) {
+            m.cpu.save_state(state.data());
+            ok = !memcmp(state.data(), &states[rewind.frame() * size], size);
+            if (rewind.frame() == FRAMES)
+                break;
+            rewind.run_frame();
+        }
+    }
+
+    printf("rewind %s, frames back to %llu\n", ok ? "pass" : "fail", (unsigned long long)rewind.oldest());
+    return ok;
+}
+
+/* Sequences 1 and 2 of appendix A (ADC) and sequence 3 of appendix B (SBC)
+ * of the tutorial, for the NMOS 6502 */
+struct bcd_result {
+    uint8_t AC;
+    bool N, V, Z, C;
+};
+
+bcd_result bcd_adc(int a, int b, int c) {
+    int low = (a & 0x0F) + (b & 0x0F) + c;
+    if (low >= 0x0A)
+        low = ((low + 0x06) & 0x0F) + 0x10;
+    int sum = (a & 0xF0) + (b & 0xF0) + low;
+    int signed_sum = (int8_t)(a & 0xF0) + (int8_t)(b & 0xF0) + low;
+    bcd_result r;
+    r.N = sum & 0x80;
+    r.V = signed_sum < -128 || signed_sum > 127;
+    r.Z = !((a + b + c) & 0xFF);
+    if (sum >= 0xA0)
+        sum += 0x60;
+    r.AC = sum;
+    r.C = sum >= 0x100;
+    return r;
+}
+
+bcd_result bcd_sbc(int a, int b, int c) {
+    int low = (a & 0x0F) - (b & 0x0F) + c - 1;
+    if (low < 0)
+        low = ((low - 0x06) & 0x0F) - 0x10;
+    int diff = (a & 0xF0) - (b & 0xF0) + low;
+    if (diff < 0)
+        diff -= 0x60;
+    int binary = a - b - (1 - c);
+    bcd_result r;
+    r.AC = diff;
+    r.N = binary & 0x80;
+    r.V = (a ^ b) & (a ^ binary) & 0x80;
+    r.Z = !(binary & 0xFF);
+    r.C = binary >= 0;
+    return r;
+}
+
+bool check_bcd() {
+    static uint8_t memory[0x10000];
+    CPU<BUS, NMOS6502> cpu;
+    cpu.set_bus(std::unique_ptr<BUS>(new BUS()));
+    cpu.bus->map(0x00, 0xFF, memory, sizeof(memory), true);
+
+    unsigned failed = 0;
+    for (int sbc = 0; sbc < 2; sbc++)
+        for (int c = 0; c < 2; c++)
+            for (int a = 0; a < 0x100; a++)
+                for (int b = 0; b < 0x100; b++) {
+                    memory[0x200] = sbc ? 0xE9 : 0x69; /* ADC/SBC # */
+                    memory[0x201] = b;
+                    cpu.PC = 0x200;
+                    cpu.AC = a;
+                    cpu.set_status(0x2C | c); /* D set */
+                    cpu.step();
+
+                    bcd_result r = sbc ? bcd_sbc(a, b, c) : bcd_adc(a, b, c);
+                    uint8_t p = cpu.status();
+                    if (cpu.AC == r.AC && !(p & 0x80) == !r.N && !(p & 0x40) == !r.V && !(p & 0x02) == !r.Z &&
+                        !(p & 0x01) == !r.C)
+                        continue;
+                    if (failed++ < 10)
+                        fprintf(stderr, "%s A:%02X M:%02X C:%d got A:%02X P:%02X expected A:%02X\n", sbc ? "SBC" : "ADC",
+                                a, b, c, cpu.AC, p, r.AC);
+                }
+
+    printf("bcd %s, %u of %u wrong\n", failed ? "fail" : "pass", failed, 2 * 2 * 0x100 * 0x100);
+    return !failed;
+}
+
+/* Every implied and immediate instruction, the ones Batch runs on a whole
+ * group among them, against the CPU: the operand and the carry go through
+ * all their values and A through all of them across the group, X, Y, SP
+ * and the other flags follow from them */
+unsigned check_group_ops(Batch<BUS> &batch, uint8_t *memory) {
+    const size_t LANES = Batch<BUS>::LANES;
+    CPU<BUS> cpu;
+    cpu.set_bus(std::unique_ptr<BUS>(new BUS()));
+    cpu.bus->map(0x00, 0xFF, memory, 0x10000, true);
+    Batch<BUS>::state &regs = batch.regs;
+
+    unsigned failed = 0;
+    for (int op = 0; op < 0x100; op++) {
+        addressing mode = OPCODES[op].mode;
+        if (mode != IMM && mode != IMP && mode != ACC)
+            continue;
+        memory[0x200] = op;
+        for (int c = 0; c < 2; c++)
+            for (int b = 0; b < 0x100; b++)
+                for (int a = 0; a < 0x100; a += LANES) {
+                    memory[0x201] = b;
+                    for (size_t i = 0; i < LANES; i++) {
+                        regs.AC[i] = a + i;
+                        regs.X[i] = (a + i) ^ b;
+                        regs.Y[i] = a + i + b;
+                        regs.SP[i] = b ^ 0xA5;
+                        regs.SR[i] = 0x20 | ((a + i + b * 3) & 0xCE) | c;
+                        regs.PC[i] = 0x200;
+                    }
+                    uint64_t before = regs.cycles[0];
+                    batch.step_all();
+                    for (size_t i = 0; i < LANES; i++) {
+                        cpu.AC = a + i;
+                        cpu.X = (a + i) ^ b;
+                        cpu.Y = a + i + b;
+                        cpu.SP = b ^ 0xA5;
+                        cpu.set_status(0x20 | ((a + i + b * 3) & 0xCE) | c);
+                        cpu.PC = 0x200;
+                        cpu.cycles = before;
+                        cpu.step();
+                        if (cpu.AC == regs.AC[i] && cpu.X == regs.X[i] && cpu.Y == regs.Y[i] && cpu.SP == regs.SP[i] &&
+                            cpu.status() == regs.SR[i] && cpu.PC == regs.PC[i] && cpu.cycles == regs.cycles[i])
+                            continue;
+                        if (failed++ < 10)
+                            fprintf(stderr, "%02X A:%02X M:%02X C:%d got A:%02X P:%02X expected A:%02X P:%02X\n", op,
+                                    (unsigned)(a + i), b, c, regs.AC[i], regs.SR[i], cpu.AC, cpu.status());
+                    }
+                }
+    }
+    return failed;
+}
+
+/* Timer of an instance, toggles its IRQ line from its own events */
+template <class Cpu>
+struct irq_timer {
+    Cpu *cpu;
+    int event;
+    uint64_t period;
+    bool up;
+
+    static void fired(void *device, uint64_t cycle) {
+        irq_timer *timer = (irq_timer *)device;
+        timer->up = !timer->up;
+        timer->cpu->set_irq(Cpu::IRQ_MAPPER, timer->up);
+        timer->cpu->events.schedule(timer->event, cycle + timer->period);
+    }
+
+    void start(Cpu &on, uint64_t every) {
+        cpu = &on;
+        period = every;
+        up = false;
+        event = on.events.add(fired, this);
+        on.events.schedule(event, period);
+    }
+};
+
+/* Register only loop in ROM, counting its NMIs and IRQs in $10 and $11 */
+const uint8_t INTERRUPT_LOOP[] = {
+    0x58,             /* $8000 CLI */
+    0xE8,             /* $8001 INX */
+    0x8A,             /* TXA */
+    0x69, 0x11,       /* ADC #$11 */
+    0x49, 0x5A,       /* EOR #$5A */
+    0xA8,             /* TAY */
+    0x18,             /* CLC */
+    0xC8,             /* INY */
+    0x4C, 0x01, 0x80, /* JMP $8001 */
+};
+const uint8_t NMI_HANDLER[] = { 0xE6, 0x10, 0x40 }; /* $8100 INC $10, RTI */
+const uint8_t IRQ_HANDLER[] = { 0xE6, 0x11, 0x40 }; /* $8110 INC $11, RTI */
+
+/* Instances of the loop in a batch and on separate CPUs, sharing the ROM,
+ * with an IRQ timer each. Those of the first group all have the same one
+ * and stay in lockstep, those of the second have timers of their own
+ * period and NMIs on frames of their own. They have to end the same */
+unsigned check_batch_interrupts() {
+    const size_t COUNT = 2 * Batch<BUS>::LANES;
+    const unsigned FRAMES = 60;
+
+    static uint8_t rom[0x8000];
+    memcpy(rom, INTERRUPT_LOOP, sizeof(INTERRUPT_LOOP));
+    memcpy(rom + 0x100, NMI_HANDLER, sizeof(NMI_HANDLER));
+    memcpy(rom + 0x110, IRQ_HANDLER, sizeof(IRQ_HANDLER));
+    rom[0x7FFA] = 0x00, rom[0x7FFB] = 0x81;
+    rom[0x7FFE] = 0x10, rom[0x7FFF] = 0x81;
+
+    Batch<BUS> batch(COUNT);
+    std::vector<CPU<BUS>> cpus(COUNT);
+    std::vector<irq_timer<CPU<Lane<BUS>>>> lane_timers(COUNT);
+    std::vector<irq_timer<CPU<BUS>>> timers(COUNT);
+    for (size_t i = 0; i < COUNT; i++) {
+        batch.bus(i).map(0x80, 0xFF, rom, sizeof(rom), false);
+        batch.regs.PC[i] = 0x8000;
+        cpus[i].set_bus(std::unique_ptr<BUS>(new BUS()));
+        cpus[i].bus->map(0x80, 0xFF, rom, sizeof(rom), false);
+        cpus[i].SP = 0xFD;
+        cpus[i].set_status(0x24);
+        cpus[i].PC = 0x8000;
+        uint64_t period = i < Batch<BUS>::LANES ? 3000 : 3000 + 700 * i;
+        lane_timers[i].start(batch.cpu(i), period);
+        timers[i].start(cpus[i], period);
+    }
+
+    for (unsigned frame = 0; frame < FRAMES; frame++) {
+        batch.run_frames_all(1);
+        for (size_t i = 0; i < COUNT; i++) {
+            run_frame(nullptr, cpus[i], frame);
+            if (i >= Batch<BUS>::LANES && (frame + i) % 3 == 0) {
+                batch.cpu(i).nmi();
+                cpus[i].nmi();
+            }
+        }
+    }
+
+    unsigned failed = 0;
+    for (size_t i = 0; i < COUNT; i++) {
+        CPU<BUS> &cpu = cpus[i];
+        Batch<BUS>::state &regs = batch.regs;
+        uint8_t *ram = batch.bus(i).ram;
+        bool same = cpu.AC == regs.AC[i] && cpu.X == regs.X[i] && cpu.Y == regs.Y[i] && cpu.SP == regs.SP[i] &&
+                    cpu.status() == regs.SR[i] && cpu.PC == regs.PC[i] && cpu.cycles == regs.cycles[i] &&
+                    !memcmp(ram, cpu.bus->ram, BUS::RAM_SIZE);
+        if (same)
+            continue;
+        if (failed++ < 10)
+            fprintf(stderr, "instance %zu PC:%04X NMIs %u IRQs %u expected PC:%04X NMIs %u IRQs %u\n", i, regs.PC[i],
+                    ram[0x10], ram[0x11], cpu.PC, cpu.bus->ram[0x10], cpu.bus->ram[0x11]);
+    }
+    return failed;
+}
+
+bool check_batch() {
+    /* One instruction first, so the CPUs have looked at their events */
+    static uint8_t memory[0x10000];
+    Batch<BUS> batch(Batch<BUS>::LANES);
+    for (size_t i = 0; i < batch.size(); i++) {
+        batch.bus(i).map(0x00, 0xFF, memory, sizeof(memory), true);
+        batch.regs.PC[i] = 0x200;
+    }
+    memory[0x200] = 0xEA; /* NOP */
+    batch.step_all();
+
+    unsigned group = check_group_ops(batch, memory);
+    unsigned interrupts = check_batch_interrupts();
+    printf("batch %s, %u instructions and %u instances wrong\n", group || interrupts ? "fail" : "pass", group,
+           interrupts);
+    return !group && !interrupts;
+}
+
+/* Runs the binary on a CPU of the variant asked for, returns the exit code */
+template <class Cpu>
+int check(const std::vector<uint8_t> &image, const options &opt) {
+    std::unique_ptr<machine<Cpu>> m(new machine<Cpu>(image, opt));
+    auto begin = std::chrono::steady_clock::now();
+    bool ok = false;
+    if (opt.golden) {
+        uint64_t lines, dropped;
+        ok = run_golden(*m, opt, lines, dropped);
+        if (ok)
+            printf("trace matched, %llu lines, %llu instructions dropped\n", (unsigned long long)lines,
+                   (unsigned long long)dropped);
+    } else if (opt.write) {
+        ok = write_trace(*m, opt);
+    } else if (opt.engine == "interpreter") {
+        ok = run<Interpreter<Cpu>>(*m, image, opt);
+    } else if constexpr (std::is_same<Cpu, CPU<BUS>>::value) {
+        if (opt.engine == "blocks")
+            ok = run<BlockCache<BUS>>(*m, image, opt);
+        else
+            ok = run<JIT<BUS>>(*m, image, opt);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    if (!opt.golden) {
+        bool trapped = m->cpu.cycles < opt.max_cycles;
+        if (!trapped)
+            ok = false;
+        if (opt.success >= 0 && m->cpu.PC != opt.success)
+            ok = false;
+        if (opt.result >= 0 && m->memory[opt.result & 0xFFFF])
+            ok = false;
+        printf("%s %s at %04X", ok ? "pass" : "fail", trapped ? "trapped" : "gave up", m->cpu.PC);
+        if (opt.result >= 0)
+            printf(" result %02X", m->memory[opt.result & 0xFFFF]);
+        printf(" cycles %llu seconds %.3f mhz %.1f\n", (unsigned long long)m->cpu.cycles, seconds,
+               m->cpu.cycles / seconds / 1e6);
+    }
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    options opt;
+    if (!parse_options(argc, argv, opt)) {
+        fprintf(stderr, "usage: %s [-v 2a03|nmos] [-e interpreter|blocks|jit] [-d] [-g trace] [-w trace] [-t fork|rewind|bcd|batch] [-l load] [-s start] "
+                        "[-p success] [-r result] [-m cycles] binary\n", argv[0]);
+        return 2;
+    }
+    if (opt.test == "bcd")
+        return check_bcd() ? 0 : 1;
+    if (opt.test == "batch")
+        return check_batch() ? 0 : 1;
+    std::vector<uint8_t> image = read_file(opt.binary);
+    if (image.empty()) {
+        fprintf(stderr, "%s: can not read\n", opt.binary);
+        return 2;
+    }
+
+    if (opt.test == "fork")
+        return check_fork(image, opt) ? 0 : 1;
+    if (opt.test == "rewind")
+        return check_rewind(image, opt) ? 0 : 1;
+    if (opt.variant == "nmos")
+        return check<CPU<BUS, NMOS6502>>(image, opt);
+    return check<CPU<BUS>>(image, opt);
+}
@@ -0,0 +1,136 @@
+/* Headless movie replay
+ * Runs an input movie on a cartridge (.nes, or a bare 16 or 32 KB PRG
+ * image) as fast as it goes, no audio, and prints the speed and the hash
+ * of the final state. The movie has to start from the state given, or
+ * from power up when there is none.
+ *   -n  headless PPU, no pixels
+ *   -v  runs the movie on two machines at once, one drawing and one
+ *       headless, and checks their states hash the same after every frame
+ *
+ * Build: g++ -std=c++17 -O2 -I6502 tools/replay.cpp 6502/cpu.cpp 6502/bus.cpp 6502/scheduler.cpp 6502/cartridge.cpp 6502/mapper.cpp 6502/apu.cpp 6502/ppu.cpp 6502/controller.cpp 6502/movie.cpp -o replay
+ * Usage: replay [-n] [-v] rom movie [state]
+ * */
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "apu.h"
+#include "cartridge.h"
+#include "controller.h"
+#include "cpu.h"
+#include "mapper.h"
+#include "movie.h"
+#include "ppu.h"
+
+std::vector<uint8_t> read_file(const char *path) {
+    std::vector<uint8_t> data;
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return data;
+    uint8_t buffer[0x4000];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.insert(data.end(), buffer, buffer + size);
+    fclose(file);
+    return data;
+}
+
+struct machine {
+    Controller pads;
+    std::unique_ptr<Mapper> mapper;
+    CPU<BUS> cpu;
+    APU apu;
+    PPU ppu;
+    std::vector<uint8_t> state;
+
+    machine(std::shared_ptr<const Cartridge> cart, bool headless) {
+        cpu.set_bus(std::unique_ptr<BUS>(new BUS()));
+        pads.plug(*cpu.bus);
+        mapper = Mapper::create(cart);
+        mapper->plug(cpu);
+        apu.plug(cpu);
+        ppu.headless = headless;
+        ppu.plug(cpu, *mapper);
+        state.resize(cpu.state_size());
+    }
+
+    uint64_t hash() {
+        cpu.save_state(state.data());
+        return hash_state(state.data(), state.size());
+    }
+};
+
+int main(int argc, char **argv) {
+    bool headless = false, verify = false;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (!strcmp(argv[arg], "-n"))
+            headless = true;
+        else if (!strcmp(argv[arg], "-v"))
+            verify = true;
+        else
+            break;
+    }
+    if (argc - arg < 2) {
+        fprintf(stderr, "usage: %s [-n] [-v] rom movie [state]\n", argv[0]);
+        return 2;
+    }
+    const char *rom = argv[arg], *movie_path = argv[arg + 1], *state_path = argc - arg > 2 ? argv[arg + 2] : nullptr;
+
+    std::shared_ptr<const Cartridge> cart = Cartridge::open(rom);
+    if (!cart || !Mapper::create(cart)) {
+        fprintf(stderr, "%s: not a cartridge of a supported mapper\n", rom);
+        return 2;
+    }
+    Movie movie;
+    if (!movie.load(movie_path)) {
+        fprintf(stderr, "%s: not a movie\n", movie_path);
+        return 2;
+    }
+
+    std::vector<std::unique_ptr<machine>> machines;
+    machines.emplace_back(new machine(cart, headless && !verify));
+    if (verify)
+        machines.emplace_back(new machine(cart, true));
+    for (auto &m : machines) {
+        CPU<BUS> &cpu = m->cpu;
+        if (state_path) {
+            std::vector<uint8_t> saved = read_file(state_path);
+            if (saved.size() != m->state.size() || !cpu.load_state(saved.data())) {
+                fprintf(stderr, "%s: not a save state of this machine\n", state_path);
+                return 2;
+            }
+        } else {
+            cpu.reset(); /* Power up */
+        }
+        if (m->hash() != movie.start_hash) {
+            fprintf(stderr, "%s: movie does not start from this state\n", movie_path);
+            return 1;
+        }
+    }
+
+    /* Frames end at fixed cycles so the overshoot does not add up */
+    uint64_t start = machines[0]->cpu.cycles;
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t frame = 0; frame < movie.frames(); frame++) {
+        uint64_t end = start + (frame + 1) * CPU<BUS>::CYCLES_PER_FRAME;
+        for (auto &m : machines) {
+            m->pads.buttons[0] = movie.input[frame * 2];
+            m->pads.buttons[1] = movie.input[frame * 2 + 1];
+            if (m->cpu.cycles < end)
+                m->cpu.run_for(end - m->cpu.cycles);
+        }
+        if (verify && machines[0]->hash() != machines[1]->hash()) {
+            printf("frame %zu: headless state differs from the rendering one\n", frame);
+            return 1;
+        }
+    }
+    auto finish = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(finish - begin).count();
+    printf("frames %zu seconds %.3f fps %.0f hash %016" PRIx64 "%s\n", movie.frames(), seconds,
+           movie.frames() / seconds, machines[0]->hash(), verify ? " headless matches" : "");
+    return 0;
+}